@@ -0,0 +1,149 @@
+#pragma once
+
+// Compact binary transport for the regional server's client API.
+//
+// Every message is a length-prefixed frame (see wire.hpp). Requests carry a
+// client-chosen request id, an opcode naming the endpoint, a flags byte and
+// two length-prefixed fields (auth token and form body), followed by a W3C
+// traceparent when kFlagTrace is set. Responses echo the
+// request id with the HTTP status code, flags and the body. Because replies
+// are matched by id, a connection can have many requests in flight and the
+// server may answer them in any order.
+//
+// Opcodes map 1:1 onto the HTTP routes so the server can reuse the same
+// handlers for both transports.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "wire.hpp"
+
+namespace binproto {
+
+enum class Opcode : uint8_t {
+    login = 1,
+    register_user = 2,
+    profile = 3,
+    update_profile = 4,
+    logout = 5,
+    create_service = 6,
+    make_order = 7,
+    delete_service = 8,
+    update_service = 9,
+    update_order_status = 10,
+    my_orders = 20,
+    all_services = 21,
+    loyalty_buyers = 22,
+    loyalty_sellers = 23,
+    my_services = 24,
+};
+
+struct Route {
+    Opcode opcode;
+    bool post;
+    const char* target;
+};
+
+inline constexpr Route kRoutes[] = {
+    {Opcode::login, true, "/login"},
+    {Opcode::register_user, true, "/register"},
+    {Opcode::profile, true, "/profile"},
+    {Opcode::update_profile, true, "/update_profile"},
+    {Opcode::logout, true, "/logout"},
+    {Opcode::create_service, true, "/create_service"},
+    {Opcode::make_order, true, "/make_order"},
+    {Opcode::delete_service, true, "/delete_service"},
+    {Opcode::update_service, true, "/update_service"},
+    {Opcode::update_order_status, true, "/update_order_status"},
+    {Opcode::my_orders, false, "/my_orders"},
+    {Opcode::all_services, false, "/all_services"},
+    {Opcode::loyalty_buyers, false, "/loyalty/buyers"},
+    {Opcode::loyalty_sellers, false, "/loyalty/sellers"},
+    {Opcode::my_services, false, "/my_services"},
+};
+
+inline const Route* find_route(Opcode opcode) {
+    for (const Route& route : kRoutes) {
+        if (route.opcode == opcode) return &route;
+    }
+    return nullptr;
+}
+
+inline const Route* find_route(bool post, std::string_view target) {
+    for (const Route& route : kRoutes) {
+        if (route.post == post && target == route.target) return &route;
+    }
+    return nullptr;
+}
+
+// Flags byte: on requests, ask for the JSON representation; on responses,
+// the body is JSON.
+constexpr uint8_t kFlagJson = 0x01;
+// Request only: a traceparent field follows the body.
+constexpr uint8_t kFlagTrace = 0x02;
+
+// Upper bound on a single frame; anything larger is treated as a protocol
+// error and the connection is dropped.
+constexpr uint32_t kMaxFrameSize = 16 * 1024 * 1024;
+
+struct Request {
+    uint64_t id = 0;
+    Opcode opcode = Opcode::login;
+    uint8_t flags = 0;
+    std::string_view token;
+    std::string_view body;
+    std::string_view traceparent; // only with kFlagTrace
+};
+
+struct Response {
+    uint64_t id = 0;
+    unsigned status = 0;
+    uint8_t flags = 0;
+    std::string_view body;
+};
+
+// Appends a complete frame (length prefix included) to `out`.
+inline void encode_request(std::string& out, const Request& req) {
+    size_t start = wire::begin_frame(out);
+    wire::put_varint(out, req.id);
+    wire::put_u8(out, static_cast<uint8_t>(req.opcode));
+    wire::put_u8(out, req.flags);
+    wire::put_bytes(out, req.token);
+    wire::put_bytes(out, req.body);
+    if (req.flags & kFlagTrace) wire::put_bytes(out, req.traceparent);
+    wire::finish_frame(out, start);
+}
+
+// Decodes a frame payload (without the length prefix). The token, body and
+// traceparent views point into `payload`.
+inline bool decode_request(std::string_view payload, Request& req) {
+    uint8_t opcode;
+    return wire::get_varint(payload, req.id)
+        && wire::get_u8(payload, opcode)
+        && (req.opcode = static_cast<Opcode>(opcode), wire::get_u8(payload, req.flags))
+        && wire::get_bytes(payload, req.token)
+        && wire::get_bytes(payload, req.body)
+        && (!(req.flags & kFlagTrace) || wire::get_bytes(payload, req.traceparent))
+        && payload.empty();
+}
+
+inline void encode_response(std::string& out, const Response& res) {
+    size_t start = wire::begin_frame(out);
+    wire::put_varint(out, res.id);
+    wire::put_varint(out, res.status);
+    wire::put_u8(out, res.flags);
+    wire::put_bytes(out, res.body);
+    wire::finish_frame(out, start);
+}
+
+inline bool decode_response(std::string_view payload, Response& res) {
+    uint64_t status;
+    if (!wire::get_varint(payload, res.id) || !wire::get_varint(payload, status)) return false;
+    res.status = static_cast<unsigned>(status);
+    return wire::get_u8(payload, res.flags)
+        && wire::get_bytes(payload, res.body)
+        && payload.empty();
+}
+
+} // namespace binproto
@@ -1,4 +1,17 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <unordered_map>
 #include <string>
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
@@ -6,183 +19,1834 @@
 #include <memory>
 #include <vector>
 #include <sstream>
+#include <thread>
 
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp> // For version string
 #include <boost/asio/ip/tcp.hpp>   // For TCP functionality
 
+#include "json_writer.hpp"
+#include "logger.hpp"
+#include "merkle.hpp"
+#include "metrics.hpp"
+#include "pipeline.hpp"
+#include "sql_statement.hpp"
+#include "sync_protocol.hpp"
+#include "tracing.hpp"
+
 namespace beast = boost::beast; // For convenience
 namespace http = beast::http;    // For HTTP types
 using tcp = boost::asio::ip::tcp; // For TCP
 
-// Function declarations
-void insert_korisnici(sqlite3* db, const std::string& server_id, const std::string& data);
-void insert_usluge(sqlite3* db, const std::string& server_id, const std::string& data);
-void insert_narudzbe(sqlite3* db, const std::string& server_id, const std::string& data);
-void insert_loyalnost(sqlite3* db, const std::string& server_id, const std::string& data);
-void insert_data(sqlite3* db, const std::string& sql, const std::string& server_id, const std::string& data);
+static metrics::Counter& connections_accepted = metrics::Registry::global()
+    .counter("central_connections_accepted_total", "Accepted regional server connections");
+static metrics::Gauge& sessions_active = metrics::Registry::global()
+    .gauge("central_sessions_active", "Open regional server connections");
+static metrics::Counter& messages_received = metrics::Registry::global()
+    .counter("central_messages_received_total", "Sync messages received");
+static metrics::Family<metrics::Counter>& rows_received = metrics::Registry::global()
+    .counter_family("central_rows_received_total", "Synced rows, by table");
+static metrics::Counter& rows_duplicate = metrics::Registry::global()
+    .counter("central_rows_duplicate_total", "Resent synced rows skipped because they were already stored");
+static metrics::Histogram& commit_duration = metrics::Registry::global()
+    .histogram("central_ingest_transaction_seconds", "Time to store one transaction of synced rows, commit included");
+static metrics::Counter& transactions_committed = metrics::Registry::global()
+    .counter("central_ingest_transactions_total", "Committed ingest transactions");
 
-class Session : public std::enable_shared_from_this<Session> {
+// Rows stored per transaction; a larger message is committed in several.
+// Set by --max-batch-rows.
+static size_t max_batch_rows = 10000;
+
+// Also append every synced change to sync_data as "<seq>,<op>,<col>,..."
+// text, a raw audit log of what each region sent. Set by --audit-log.
+static bool audit_log = false;
+
+// OR IGNORE on (server_id, seq) covers a crash between storing rows and
+// their watermark.
+static sql::Statement<sql::Params<std::string_view, std::string_view, int64_t>, sql::Columns<>> insert_sync_data{
+    "INSERT OR IGNORE INTO sync_data (server_id, data, timestamp, seq) VALUES (?, ?, datetime('now'), ?)"};
+static sql::Statement<sql::Params<std::string_view>, sql::Columns<int64_t>> select_watermark{
+    "SELECT seq FROM sync_watermarks WHERE server_id = ?"};
+static sql::Statement<sql::Params<std::string_view, int64_t>, sql::Columns<>> upsert_watermark{
+    R"(INSERT INTO sync_watermarks (server_id, seq) VALUES (?, ?)
+       ON CONFLICT (server_id) DO UPDATE SET seq = MAX(seq, excluded.seq))"};
+static sql::Statement<sql::Params<std::string_view, int64_t, int64_t>, sql::Columns<>> upsert_deleted_service{
+    R"(INSERT INTO usluge_deleted (region_id, service_id, seq) VALUES (?, ?, ?)
+       ON CONFLICT (region_id, service_id) DO UPDATE SET seq = excluded.seq)"};
+static sql::Statement<sql::Params<>, sql::Columns<>> begin_transaction{"BEGIN"};
+static sql::Statement<sql::Params<>, sql::Columns<>> commit_transaction{"COMMIT"};
+static sql::Statement<sql::Params<>, sql::Columns<>> rollback_transaction{"ROLLBACK"};
+
+// ---- replica tables ---------------------------------------------------------
+//
+// Every replicated table has a typed copy on central named after its
+// syncproto::Table, with the schema's columns plus region_id and the seq of
+// the change last applied, keyed by (region_id, primary key). Rows are
+// upserted and deleted in place, so the tables hold each region's current
+// data and can be queried and joined across regions directly. The seq guard
+// makes applying a change twice, or an older one after a newer, a no-op.
+
+struct ReplicaTable {
+    std::string upsert_sql, delete_sql; // outlive the pools, which keep the pointer
+    std::unique_ptr<sql::StatementPool> upsert, remove;
+};
+
+static std::array<ReplicaTable, std::size(syncproto::kTables)> replica_tables; // in kTables order
+
+// Secondary indexes for the foreign keys cross-region queries filter and
+// join on; every one leads with region_id like the primary key.
+static const char* const kReplicaIndexes[] = {
+    "CREATE INDEX IF NOT EXISTS usluge_seller ON usluge (region_id, seller_id)",
+    "CREATE INDEX IF NOT EXISTS usluge_seq ON usluge (region_id, seq)", // catalog pushes
+    "CREATE INDEX IF NOT EXISTS narudzbe_buyer ON narudzbe (region_id, buyer_id)",
+    "CREATE INDEX IF NOT EXISTS narudzbe_seller ON narudzbe (region_id, seller_id)",
+    "CREATE INDEX IF NOT EXISTS narudzbe_service ON narudzbe (region_id, service_id)",
+    "CREATE INDEX IF NOT EXISTS loyalnost_buyer_seller ON loyalnost (region_id, buyer_id, seller_id)",
+};
+
+const char* sql_type(syncproto::ColumnType type) {
+    switch (type) {
+        case syncproto::ColumnType::integer: return "INTEGER";
+        case syncproto::ColumnType::real: return "REAL";
+        case syncproto::ColumnType::text: return "TEXT";
+    }
+    return "BLOB";
+}
+
+static std::string replica_ddl; // CREATE TABLE / INDEX for every replica table
+
+// Builds the replica tables' DDL and statements from kTables. Runs once at
+// startup; the statements are then prepared on each partition as used.
+void init_replica_tables() {
+    for (size_t t = 0; t < std::size(syncproto::kTables); ++t) {
+        const syncproto::Table& table = syncproto::kTables[t];
+        std::string name = table.name, key = table.columns[0].name;
+        std::string definitions, columns, placeholders, updates;
+        for (size_t i = 0; i < table.column_count; ++i) {
+            std::string column = table.columns[i].name;
+            definitions += column + " " + sql_type(table.columns[i].type) + (i ? ", " : " NOT NULL, ");
+            columns += ", " + column;
+            placeholders += ", ?";
+            if (i) updates += column + " = excluded." + column + ", ";
+        }
+        replica_ddl += "CREATE TABLE IF NOT EXISTS " + name + " (region_id TEXT NOT NULL, " + definitions +
+                       "seq INTEGER NOT NULL, PRIMARY KEY (region_id, " + key + "));\n";
+
+        ReplicaTable& replica = replica_tables[t];
+        replica.upsert_sql = "INSERT INTO " + name + " (region_id" + columns + ", seq) VALUES (?" + placeholders +
+                             ", ?) ON CONFLICT (region_id, " + key + ") DO UPDATE SET " + updates +
+                             "seq = excluded.seq WHERE excluded.seq > " + name + ".seq";
+        replica.delete_sql = "DELETE FROM " + name + " WHERE region_id = ? AND " + key + " = ? AND seq <= ?";
+        replica.upsert = std::make_unique<sql::StatementPool>(replica.upsert_sql.c_str());
+        replica.remove = std::make_unique<sql::StatementPool>(replica.delete_sql.c_str());
+    }
+    for (const char* index : kReplicaIndexes) replica_ddl += std::string(index) + ";\n";
+}
+
+bool create_replica_tables(sqlite3* db) {
+    char* err_msg = nullptr;
+    if (sqlite3_exec(db, replica_ddl.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        LOG_ERROR << "Error creating replica tables: " << err_msg;
+        sqlite3_free(err_msg);
+        return false;
+    }
+    return true;
+}
+
+// Applies one synced change to its replica table.
+bool store_row(sqlite3* db, std::string_view region_id, const syncproto::Row& row) {
+    ReplicaTable& replica = replica_tables[static_cast<size_t>(row.table - syncproto::kTables)];
+    sql::StatementPool& pool = row.op == syncproto::Op::remove ? *replica.remove : *replica.upsert;
+    sqlite3_stmt* stmt = pool.acquire(db);
+    if (!stmt) return false;
+
+    int index = 1;
+    sql::bind(stmt, index++, region_id);
+    if (row.op == syncproto::Op::remove) {
+        sql::bind(stmt, index++, row.key);
+    } else {
+        for (size_t i = 0; i < row.table->column_count; ++i, ++index) {
+            const syncproto::Value& v = row.values[i];
+            if (v.null) {
+                sql::bind(stmt, index, nullptr);
+                continue;
+            }
+            switch (row.table->columns[i].type) {
+                case syncproto::ColumnType::integer: sql::bind(stmt, index, v.integer); break;
+                case syncproto::ColumnType::real: sql::bind(stmt, index, v.real); break;
+                case syncproto::ColumnType::text: sql::bind(stmt, index, v.text); break;
+            }
+        }
+    }
+    sql::bind(stmt, index, static_cast<int64_t>(row.seq));
+
+    auto start = std::chrono::steady_clock::now();
+    int rc = sqlite3_step(stmt);
+    pool.release(stmt, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count()));
+    return rc == SQLITE_DONE;
+}
+
+// Creates a partition's tables: the audit log, the watermark and the replica
+// tables.
+bool create_database(sqlite3* db) {
+    const char* create_table_sql =
+        "CREATE TABLE IF NOT EXISTS sync_data ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "server_id TEXT NOT NULL,"
+        "data TEXT NOT NULL,"
+        "timestamp TEXT NOT NULL,"
+        "seq INTEGER);"
+        // Highest changelog seq stored per region
+        "CREATE TABLE IF NOT EXISTS sync_watermarks ("
+        "server_id TEXT PRIMARY KEY,"
+        "seq INTEGER NOT NULL);"
+        // Services deleted from usluge, and the seq of the delete, so
+        // catalog pushes carry deletes too
+        "CREATE TABLE IF NOT EXISTS usluge_deleted ("
+        "region_id TEXT NOT NULL,"
+        "service_id INTEGER NOT NULL,"
+        "seq INTEGER NOT NULL,"
+        "PRIMARY KEY (region_id, service_id));";
+
+    char* err_msg = nullptr;
+    if (sqlite3_exec(db, create_table_sql, nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        LOG_ERROR << "Error creating table: " << err_msg;
+        sqlite3_free(err_msg);
+        return false;
+    }
+
+    // Databases from before sequence numbers lack the seq column; their old
+    // rows keep NULL, which the unique index ignores.
+    sqlite3_stmt* stmt;
+    bool has_seq = false;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('sync_data') WHERE name = 'seq'", -1, &stmt, nullptr) == SQLITE_OK) {
+        has_seq = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    std::string migrate = has_seq ? "" : "ALTER TABLE sync_data ADD COLUMN seq INTEGER;";
+    migrate += "CREATE UNIQUE INDEX IF NOT EXISTS sync_data_server_seq ON sync_data (server_id, seq);";
+    if (sqlite3_exec(db, migrate.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        LOG_ERROR << "Error migrating sync_data: " << err_msg;
+        sqlite3_free(err_msg);
+        return false;
+    }
+    return create_replica_tables(db);
+}
+
+// ---- aggregates -------------------------------------------------------------
+//
+// Cross-region figures kept up to date as batches are stored, so reading
+// them costs a shared lock instead of a scan of the replica tables:
+//   - revenue and order counts by status, per region (cancelled orders
+//     don't count as revenue);
+//   - the top services by revenue across all regions;
+//   - active buyers (with at least one order that isn't cancelled), per region;
+//   - the distribution of loyalty points, per region.
+// Before a change overwrites an order or a loyalty row, the writer reads the
+// stored image and stages the difference. Staged changes are applied when
+// the transaction commits and dropped if it rolls back, so the figures only
+// ever reflect stored data. At startup they are rebuilt from the partitions.
+
+struct Order {
+    int64_t buyer_id = 0;
+    int64_t service_id = 0;
+    double cost = 0;
+    std::string status;
+};
+
+// A row's new hash for the partition's hash trees; nullopt once deleted.
+struct HashChange {
+    size_t table; // index into kTables
+    int64_t key;
+    std::optional<uint64_t> hash;
+};
+
+// Row images before and after each change; nullopt where the row didn't or
+// no longer exists. Also carries the hash tree updates, which wait for the
+// commit the same way.
+struct StagedChanges {
+    std::vector<std::pair<std::optional<Order>, std::optional<Order>>> orders;
+    std::vector<std::pair<std::optional<int64_t>, std::optional<int64_t>>> points;
+    std::vector<HashChange> hashes;
+    bool catalog = false; // usluge changed; other regions are told after commit
+
+    void clear() {
+        orders.clear();
+        points.clear();
+        hashes.clear();
+        catalog = false;
+    }
+};
+
+constexpr size_t kTopServices = 10;
+// Lower bounds of the loyalty point buckets.
+constexpr int64_t kLoyaltyBuckets[] = {0, 100, 200, 300, 500};
+
+class Aggregates {
 public:
-    Session(boost::asio::io_context& io_context, sqlite3* db)
-        : socket_(io_context), db_(db) {}
+    void apply(const std::string& region, const StagedChanges& changes) {
+        if (changes.orders.empty() && changes.points.empty()) return;
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        Region& r = regions_[region];
+        for (const auto& [before, after] : changes.orders) {
+            if (before) add_order(region, r, *before, -1);
+            if (after) add_order(region, r, *after, 1);
+        }
+        for (const auto& [before, after] : changes.points) {
+            if (before) --r.loyalty[bucket(*before)];
+            if (after) ++r.loyalty[bucket(*after)];
+        }
+    }
 
-    tcp::socket& socket() {
-        return socket_;
+    // Adds what a partition already holds (at startup).
+    void load(sqlite3* db, const std::string& region) {
+        static sql::Statement<sql::Params<>, sql::Columns<int64_t, int64_t, double, std::string>> all_orders{
+            "SELECT buyer_id, service_id, cost, order_status FROM narudzbe"};
+        static sql::Statement<sql::Params<>, sql::Columns<int64_t>> all_points{
+            "SELECT loyalty_points FROM loyalnost"};
+        StagedChanges changes;
+        auto orders = all_orders.query(db);
+        while (orders.step()) {
+            auto [buyer_id, service_id, cost, status] = orders.row();
+            changes.orders.emplace_back(std::nullopt, Order{buyer_id, service_id, cost, std::move(status)});
+        }
+        auto points = all_points.query(db);
+        while (auto row = points.next()) changes.points.emplace_back(std::nullopt, std::get<0>(*row));
+        apply(region, changes);
     }
 
-    void start() {
-        auto self(shared_from_this());
-        boost::asio::async_read_until(socket_, buffer_, '\n',
-            boost::bind(&Session::handle_read, self, boost::asio::placeholders::error));
+    // GET /aggregates.
+    void render(std::string& out) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        JsonWriter writer(out);
+        writer.begin_object().key("regions").begin_object();
+        for (const auto& [id, r] : regions_) {
+            writer.key(id).begin_object()
+                .field("revenue", r.revenue)
+                .field("active_buyers", static_cast<long long>(r.active_orders.size()));
+            writer.key("orders").begin_object();
+            for (const auto& [status, count] : r.orders) writer.field(status, static_cast<long long>(count));
+            writer.end_object().key("loyalty_points").begin_object();
+            for (size_t i = 0; i < std::size(kLoyaltyBuckets); ++i) {
+                writer.field(std::to_string(kLoyaltyBuckets[i]) + "+", static_cast<long long>(r.loyalty[i]));
+            }
+            writer.end_object().end_object();
+        }
+        writer.end_object().key("top_services").begin_array();
+        size_t n = 0;
+        for (auto it = ranking_.begin(); it != ranking_.end() && n < kTopServices; ++it, ++n) {
+            const ServiceKey& key = it->second;
+            writer.begin_object()
+                .field("region", key.first)
+                .field("service_id", static_cast<long long>(key.second))
+                .field("orders", static_cast<long long>(services_.at(key).orders))
+                .field("revenue", it->first)
+                .end_object();
+        }
+        writer.end_array().end_object();
     }
 
 private:
-    void handle_read(const boost::system::error_code& error) {
-        if (!error) {
-            std::istream is(&buffer_);
-            std::string message;
-            std::getline(is, message);
+    using ServiceKey = std::pair<std::string, int64_t>; // region, service_id
+
+    struct ServiceStats {
+        int64_t orders = 0;
+        double revenue = 0;
+    };
+
+    struct Region {
+        double revenue = 0;
+        std::map<std::string, int64_t> orders;                // by status
+        std::unordered_map<int64_t, int64_t> active_orders;   // by buyer; only buyers with some
+        std::array<int64_t, std::size(kLoyaltyBuckets)> loyalty{};
+    };
+
+    static size_t bucket(int64_t points) {
+        size_t i = 0;
+        while (i + 1 < std::size(kLoyaltyBuckets) && points >= kLoyaltyBuckets[i + 1]) ++i;
+        return i;
+    }
+
+    // Adds (sign 1) or takes back (sign -1) one order.
+    void add_order(const std::string& region, Region& r, const Order& order, int sign) {
+        auto status = r.orders.find(order.status);
+        if (status == r.orders.end()) status = r.orders.emplace(order.status, 0).first;
+        if ((status->second += sign) == 0) r.orders.erase(status);
+        if (order.status == "cancelled") return;
+
+        r.revenue += sign * order.cost;
+        auto buyer = r.active_orders.find(order.buyer_id);
+        if (buyer == r.active_orders.end()) buyer = r.active_orders.emplace(order.buyer_id, 0).first;
+        if ((buyer->second += sign) == 0) r.active_orders.erase(buyer);
 
-            std::cout << "Received data: " << message << std::endl;
+        // The ranking is keyed by revenue, so it is re-inserted on every change.
+        ServiceKey key{region, order.service_id};
+        ServiceStats& service = services_[key];
+        if (service.orders) ranking_.erase({service.revenue, key});
+        service.orders += sign;
+        service.revenue += sign * order.cost;
+        if (service.orders) {
+            ranking_.emplace(service.revenue, key);
+        } else {
+            services_.erase(key);
+        }
+    }
+
+    mutable std::shared_mutex mutex_;
+    std::map<std::string, Region> regions_;
+    std::map<ServiceKey, ServiceStats> services_;
+    std::set<std::pair<double, ServiceKey>, std::greater<>> ranking_; // highest revenue first
+};
+
+static Aggregates aggregates;
 
-            // Split the message into server_id and data
-            std::size_t separator_pos = message.find('|');
-            if (separator_pos != std::string::npos) {
-                std::string server_id = message.substr(0, separator_pos);
-                std::string data = message.substr(separator_pos + 1);
+static sql::Statement<sql::Params<std::string_view, int64_t>, sql::Columns<int64_t, int64_t, double, std::string, int64_t>>
+    select_order{"SELECT buyer_id, service_id, cost, order_status, seq FROM narudzbe WHERE region_id = ? AND order_id = ?"};
+static sql::Statement<sql::Params<std::string_view, int64_t>, sql::Columns<int64_t, int64_t>> select_points{
+    "SELECT loyalty_points, seq FROM loyalnost WHERE region_id = ? AND loyalty_id = ?"};
 
-                // Process the received data for different tables
-                process_data(server_id, data);
+size_t column_index(const syncproto::Table& table, std::string_view name) {
+    for (size_t i = 0; i < table.column_count; ++i) {
+        if (name == table.columns[i].name) return i;
+    }
+    return 0;
+}
+
+// Stages what `row` is about to change for the aggregates; call before
+// store_row. Changes the seq guard will ignore stage nothing.
+bool stage_change(sqlite3* db, std::string_view region, const syncproto::Row& row, StagedChanges& staged) {
+    static const syncproto::Table* narudzbe = syncproto::find_table("narudzbe");
+    static const syncproto::Table* loyalnost = syncproto::find_table("loyalnost");
+    bool remove = row.op == syncproto::Op::remove;
+    // store_row's guards: upserts apply over an older seq, deletes over an
+    // older or equal one.
+    auto stale = [&](int64_t stored_seq) {
+        return remove ? stored_seq > static_cast<int64_t>(row.seq) : stored_seq >= static_cast<int64_t>(row.seq);
+    };
+
+    if (row.table == narudzbe) {
+        static const size_t buyer = column_index(*narudzbe, "buyer_id"), service = column_index(*narudzbe, "service_id"),
+                            cost = column_index(*narudzbe, "cost"), status = column_index(*narudzbe, "order_status");
+        std::optional<Order> before, after;
+        auto cursor = select_order.query(db, region, row.key);
+        if (!cursor) return false;
+        if (cursor.step()) {
+            auto [buyer_id, service_id, stored_cost, stored_status, seq] = cursor.row();
+            if (stale(seq)) return true;
+            before = Order{buyer_id, service_id, stored_cost, std::string(stored_status)};
+        } else if (!cursor.done()) {
+            return false;
+        }
+        if (!remove) {
+            after = Order{row.values[buyer].integer, row.values[service].integer, row.values[cost].real,
+                          std::string(row.values[status].text)};
+        }
+        if (before || after) staged.orders.emplace_back(std::move(before), std::move(after));
+    } else if (row.table == loyalnost) {
+        static const size_t points = column_index(*loyalnost, "loyalty_points");
+        std::optional<int64_t> before, after;
+        auto cursor = select_points.query(db, region, row.key);
+        if (!cursor) return false;
+        if (cursor.step()) {
+            auto [stored_points, seq] = cursor.row();
+            if (stale(seq)) return true;
+            before = stored_points;
+        } else if (!cursor.done()) {
+            return false;
+        }
+        if (!remove) after = row.values[points].integer;
+        if (before || after) staged.points.emplace_back(before, after);
+    }
+    return true;
+}
+
+int64_t unix_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Every region that has connected since startup, with its stats. Entries are
+// never removed; a region that disconnects keeps its history.
+class RegionRegistry {
+public:
+    struct Region {
+        explicit Region(const std::string& id)
+            : id(id),
+              connected(metrics::Registry::global()
+                            .gauge_family("central_region_connected", "Open sync connections, by region")
+                            .with(metrics::label("region", id))),
+              batches(metrics::Registry::global()
+                          .counter_family("central_region_batches_total", "Sync batches stored, by region")
+                          .with(metrics::label("region", id))),
+              rows(metrics::Registry::global()
+                       .counter_family("central_region_rows_total", "Synced rows stored, by region")
+                       .with(metrics::label("region", id))),
+              bytes(metrics::Registry::global()
+                        .counter_family("central_region_bytes_total", "Sync frame bytes received, by region")
+                        .with(metrics::label("region", id))) {}
+
+        const std::string id;
+        metrics::Gauge& connected;
+        metrics::Counter& batches;
+        metrics::Counter& rows;
+        metrics::Counter& bytes;
+        std::atomic<uint64_t> watermark{0};
+        std::atomic<int64_t> last_seen_ms{0};
+
+        // Set at each handshake; guarded by the registry's mutex.
+        std::string address;
+        uint32_t version = 0;
+        uint64_t capabilities = 0;
+        int64_t connected_at_ms = 0;
+        uint64_t connects = 0;
+    };
+
+    // Records a handshake and returns the region's entry.
+    Region& connect(const std::string& id, const std::string& address, uint32_t version, uint64_t capabilities) {
+        std::lock_guard<contention::Mutex> lock(mutex_);
+        auto& slot = regions_[id];
+        if (!slot) slot = std::make_unique<Region>(id);
+        slot->address = address;
+        slot->version = version;
+        slot->capabilities = capabilities;
+        slot->connected_at_ms = slot->last_seen_ms = unix_ms();
+        ++slot->connects;
+        slot->connected.add();
+        return *slot;
+    }
+
+    void disconnect(Region& region) { region.connected.sub(); }
+
+    // GET /regions: one object per region.
+    void render(std::string& out) {
+        std::lock_guard<contention::Mutex> lock(mutex_);
+        JsonWriter writer(out);
+        writer.begin_array();
+        for (const auto& [id, r] : regions_) {
+            writer.begin_object()
+                .field("region", id)
+                .field("connected", r->connected.value())
+                .field("address", r->address)
+                .field("protocol_version", r->version)
+                .field("capabilities", static_cast<unsigned long long>(r->capabilities))
+                .field("connected_at_ms", static_cast<long long>(r->connected_at_ms))
+                .field("last_seen_ms", static_cast<long long>(r->last_seen_ms.load()))
+                .field("connects", static_cast<unsigned long long>(r->connects))
+                .field("batches", static_cast<unsigned long long>(r->batches.value()))
+                .field("rows", static_cast<unsigned long long>(r->rows.value()))
+                .field("bytes", static_cast<unsigned long long>(r->bytes.value()))
+                .field("watermark", static_cast<unsigned long long>(r->watermark.load()))
+                .end_object();
+        }
+        writer.end_array();
+    }
+
+private:
+    contention::Mutex mutex_{"central_regions"};
+    std::map<std::string, std::unique_ptr<Region>> regions_;
+};
+
+uint64_t load_watermark(sqlite3* db, std::string_view server_id) {
+    auto row = select_watermark.one(db, server_id);
+    return row ? static_cast<uint64_t>(std::get<0>(*row)) : 0;
+}
+
+void format_row(const syncproto::Row& row, std::string& out) {
+    out = std::to_string(row.seq);
+    if (row.op == syncproto::Op::remove) {
+        out += ",delete," + std::to_string(row.key);
+        return;
+    }
+    out += ",upsert";
+    for (size_t i = 0; i < row.table->column_count; ++i) {
+        const syncproto::Value& v = row.values[i];
+        out += ',';
+        if (v.null) continue;
+        switch (row.table->columns[i].type) {
+            case syncproto::ColumnType::integer: out += std::to_string(v.integer); break;
+            case syncproto::ColumnType::real: {
+                char buf[32];
+                out.append(buf, static_cast<size_t>(std::snprintf(buf, sizeof(buf), "%.15g", v.real)));
+                break;
             }
+            case syncproto::ColumnType::text: out.append(v.text.data(), v.text.size()); break;
+        }
+    }
+}
+
+// ---- ingest pipeline --------------------------------------------------------
+//
+// A batch passes three stages:
+//   network  the io_context threads read frames, answer the handshake and
+//            heartbeats, and hand batch frames to their region's parser;
+//   parse    --parse-threads threads inflate and decode frames into rows;
+//   write    one thread per partition applies its decoded batches (as many
+//            as are queued, up to max_batch_rows, per transaction) and posts
+//            the acks back to the sessions.
+// The stages are joined by bounded lock-free queues. A region always goes to
+// the same parser and has one writer, so its batches are stored in the order
+// they arrived. When the queues are full, sessions stop reading their
+// sockets: a slow disk pushes back through TCP to the regional servers
+// instead of piling frames up in memory.
+
+class Session;
+struct Partition;
+
+// One batch on its way through the pipeline.
+struct SyncItem {
+    std::shared_ptr<Session> session;
+    RegionRegistry::Region* region = nullptr;
+    Partition* partition = nullptr;
+    std::string frame;
+    std::string scratch;              // inflated body
+    syncproto::BatchHeader header;    // views into frame/scratch, as do the rows
+    std::vector<syncproto::Row> rows;
+    contention::QueueStats::Ticket ticket;
+};
+using SyncItemPtr = std::unique_ptr<SyncItem>;
+
+// ---- partitions -------------------------------------------------------------
+//
+// Each region's replica tables, watermark and audit log are in a database
+// file of their own, <main>.<region>.db next to the main file, written by a
+// thread of its own. Regions never wait on each other's write lock or fsync,
+// so ingest scales with the number of regions, and one region's file can be
+// archived or dropped (with central stopped) without touching the others.
+// The main file only lists the partitions.
+//
+// Cross-region reads (GET /tables, the catalog push) go through each
+// partition's read connection in turn and merge in C++, rather than ATTACHing
+// the files to one connection, so the number of regions isn't capped by
+// SQLite's attach limit.
+
+struct Partition {
+    Partition(const std::string& region, const std::string& file, size_t capacity)
+        : region(region), file(file), queue(capacity) {}
+
+    const std::string region;
+    const std::string file;
+    sqlite3* db = nullptr;
+    // Held by the writer for each transaction; the handshake takes it to
+    // read the watermark.
+    contention::Mutex mutex{"central_partition_write"};
+    // Read-only connection to the same file, for sessions; WAL lets it read
+    // the last commit while the writer has a transaction open.
+    sqlite3* reader = nullptr;
+    contention::Mutex read_mutex{"central_partition_read"};
+    pipeline::BoundedQueue<SyncItemPtr> queue; // decoded batches for the writer
+    pipeline::Doorbell bell;                   // a batch was queued
+    pipeline::Doorbell space;                  // the writer made room
+    StagedChanges staged;                      // for the aggregates, until commit; writer only
+    // Per table (kTables order), of the committed rows; sessions read them
+    // to answer MerkleQuery.
+    std::array<merkle::Tree, std::size(syncproto::kTables)> trees;
+    contention::Mutex trees_mutex{"central_merkle"};
+};
+
+// Region ids end up in file and schema names.
+bool valid_region_id(std::string_view id) {
+    return !id.empty() && id.size() <= 64 && std::all_of(id.begin(), id.end(), [](unsigned char c) {
+        return std::isalnum(c) || c == '_' || c == '-';
+    });
+}
+
+// `text` as an SQL string literal.
+std::string quoted(const std::string& text) {
+    std::string out = "'";
+    for (char c : text) out += c == '\'' ? std::string("''") : std::string(1, c);
+    return out + "'";
+}
+
+std::string partition_file(const std::string& main_file, const std::string& region) {
+    std::string base = main_file;
+    if (base.size() > 3 && base.compare(base.size() - 3, 3, ".db") == 0) base.resize(base.size() - 3);
+    return base + "." + region + ".db";
+}
+
+bool exec_sql(sqlite3* db, const std::string& sql, const char* what) {
+    char* err_msg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        LOG_ERROR << "Error " << what << ": " << err_msg;
+        sqlite3_free(err_msg);
+        return false;
+    }
+    return true;
+}
 
-            auto self(shared_from_this());
-            boost::asio::async_read_until(socket_, buffer_, '\n',
-                boost::bind(&Session::handle_read, self, boost::asio::placeholders::error));
+// Reads a replica table row (the schema's columns, from `first_column`) as
+// sync values; text views are valid until the next step.
+void read_values(sqlite3_stmt* stmt, const syncproto::Table& table, syncproto::Value* values, int first_column = 0) {
+    for (size_t i = 0; i < table.column_count; ++i) {
+        int column = first_column + static_cast<int>(i);
+        syncproto::Value& v = values[i];
+        v = {};
+        if (sqlite3_column_type(stmt, column) == SQLITE_NULL) continue;
+        v.null = false;
+        switch (table.columns[i].type) {
+            case syncproto::ColumnType::integer: v.integer = sqlite3_column_int64(stmt, column); break;
+            case syncproto::ColumnType::real: v.real = sqlite3_column_double(stmt, column); break;
+            case syncproto::ColumnType::text:
+                v.text = std::string_view(reinterpret_cast<const char*>(sqlite3_column_text(stmt, column)),
+                                          static_cast<size_t>(sqlite3_column_bytes(stmt, column)));
+                break;
         }
     }
+}
+
+static sql::Statement<sql::Params<std::string_view, std::string_view>, sql::Columns<>> insert_partition{
+    "INSERT OR IGNORE INTO partitions (region_id, file) VALUES (?, ?)"};
+static sql::Statement<sql::Params<>, sql::Columns<std::string, std::string>> select_partitions{
+    "SELECT region_id, file FROM partitions"};
+
+class PartitionStore {
+public:
+    PartitionStore(sqlite3* db, const std::string& main_file, size_t capacity)
+        : db_(db), main_file_(main_file), capacity_(capacity) {}
 
-    void process_data(const std::string& server_id, const std::string& data) {
-        std::istringstream data_stream(data);
-        std::string row;
-        while (std::getline(data_stream, row)) {
-            std::size_t table_sep_pos = row.find(",");
-            if (table_sep_pos != std::string::npos) {
-                std::string table_type = row.substr(0, table_sep_pos);
+    // Opens every partition the main file lists, after moving the tables of
+    // a database from before partitioning into partitions.
+    bool load() {
+        if (!exec_sql(db_, "CREATE TABLE IF NOT EXISTS partitions (region_id TEXT PRIMARY KEY, file TEXT NOT NULL)",
+                      "creating partitions table") ||
+            !migrate()) {
+            return false;
+        }
+        std::vector<std::pair<std::string, std::string>> listed;
+        auto cursor = select_partitions.query(db_);
+        while (auto row = cursor.next()) listed.emplace_back(std::get<0>(*row), std::get<1>(*row));
+        std::lock_guard<contention::Mutex> lock(mutex_);
+        for (const auto& [region, file] : listed) {
+            if (!partitions_.count(region) && !add(region, file)) return false;
+        }
+        return true;
+    }
+
+    // The region's partition, created on first use (then `created` is set).
+    // nullptr if its file can't be opened.
+    Partition* open(const std::string& region, bool& created) {
+        std::lock_guard<contention::Mutex> lock(mutex_);
+        created = false;
+        auto it = partitions_.find(region);
+        if (it != partitions_.end()) return it->second.get();
+        Partition* partition = add(region, partition_file(main_file_, region));
+        created = partition != nullptr;
+        return partition;
+    }
+
+    template <typename F>
+    void for_each(F&& f) {
+        std::lock_guard<contention::Mutex> lock(mutex_);
+        for (auto& [region, partition] : partitions_) f(*partition);
+    }
 
-                if (table_type == "korisnici") {
-                    insert_korisnici(db_, server_id, row.substr(table_sep_pos + 1));
-                } else if (table_type == "usluge") {
-                    insert_usluge(db_, server_id, row.substr(table_sep_pos + 1));
-                } else if (table_type == "narudzbe") {
-                    insert_narudzbe(db_, server_id, row.substr(table_sep_pos + 1));
-                } else if (table_type == "loyalnost") {
-                    insert_loyalnost(db_, server_id, row.substr(table_sep_pos + 1));
+    // GET /tables: rows per replica table and region, across all partitions.
+    // False if a partition can't be read; the counts would be partial.
+    bool render_counts(std::string& out) {
+        std::vector<Partition*> partitions;
+        for_each([&](Partition& partition) { partitions.push_back(&partition); });
+        std::array<std::map<std::string, long long>, std::size(syncproto::kTables)> counts;
+        for (Partition* partition : partitions) {
+            std::lock_guard<contention::Mutex> lock(partition->read_mutex);
+            for (size_t t = 0; t < counts.size(); ++t) {
+                std::string sql = std::string("SELECT region_id, count(*) FROM ") + syncproto::kTables[t].name +
+                                  " GROUP BY region_id";
+                sqlite3_stmt* stmt = nullptr;
+                int rc = sqlite3_prepare_v2(partition->reader, sql.c_str(), -1, &stmt, nullptr);
+                if (rc == SQLITE_OK) {
+                    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                        counts[t][reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0))] +=
+                            sqlite3_column_int64(stmt, 1);
+                    }
+                }
+                sqlite3_finalize(stmt);
+                if (rc != SQLITE_DONE) {
+                    LOG_ERROR << "Cannot count rows of " << partition->file << ": " << sqlite3_errmsg(partition->reader);
+                    return false;
                 }
             }
         }
+        JsonWriter writer(out);
+        writer.begin_object();
+        for (size_t t = 0; t < counts.size(); ++t) {
+            writer.key(syncproto::kTables[t].name).begin_object();
+            for (const auto& [region, count] : counts[t]) writer.field(region, count);
+            writer.end_object();
+        }
+        writer.end_object();
+        return true;
+    }
+
+private:
+    // Called with mutex_ held.
+    Partition* add(const std::string& region, const std::string& file) {
+        auto partition = std::make_unique<Partition>(region, file, capacity_);
+        if (sqlite3_open(file.c_str(), &partition->db) != SQLITE_OK) {
+            LOG_ERROR << "Cannot open partition " << file << ": " << sqlite3_errmsg(partition->db);
+            sqlite3_close(partition->db);
+            return nullptr;
+        }
+        sqlite3_busy_timeout(partition->db, 5000);
+        // WAL, so the reader doesn't block the writer.
+        if (!exec_sql(partition->db, "PRAGMA journal_mode = WAL", "setting journal mode") ||
+            !create_database(partition->db) ||
+            insert_partition.exec(db_, region, file) != SQLITE_DONE) {
+            sqlite3_close(partition->db);
+            return nullptr;
+        }
+        if (sqlite3_open_v2(file.c_str(), &partition->reader, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+            LOG_ERROR << "Cannot open partition " << file << " for reading: " << sqlite3_errmsg(partition->reader);
+            sqlite3_close(partition->reader);
+            sqlite3_close(partition->db);
+            return nullptr;
+        }
+        sqlite3_busy_timeout(partition->reader, 5000);
+        LOG_INFO << "Region " << region << " stored in " << file;
+        return (partitions_[region] = std::move(partition)).get();
+    }
+
+    // A main file that still has sync_watermarks holds every region's data
+    // itself; copy each region into its partition, then drop the old tables.
+    bool migrate() {
+        static sql::Statement<sql::Params<>, sql::Columns<int>> legacy{
+            "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'sync_watermarks'"};
+        static sql::Statement<sql::Params<>, sql::Columns<std::string>> legacy_regions{
+            "SELECT server_id FROM sync_watermarks UNION SELECT server_id FROM sync_data"};
+        if (!legacy.one(db_)) return true;
+        if (!create_database(db_)) return false; // bring an older file up to date first
+
+        std::vector<std::string> regions;
+        auto cursor = legacy_regions.query(db_);
+        while (auto row = cursor.next()) regions.push_back(std::get<0>(*row));
+
+        std::lock_guard<contention::Mutex> lock(mutex_);
+        for (const std::string& region : regions) {
+            if (!valid_region_id(region)) {
+                LOG_WARN << "Not migrating region with invalid id: " << region;
+                continue;
+            }
+            Partition* partition = add(region, partition_file(main_file_, region));
+            if (!partition) return false;
+            std::string id = quoted(region);
+            std::string copy = "ATTACH DATABASE " + quoted(main_file_) + " AS legacy;\nBEGIN;\n";
+            for (const syncproto::Table& table : syncproto::kTables) {
+                copy += std::string("INSERT OR IGNORE INTO ") + table.name + " SELECT * FROM legacy." + table.name +
+                        " WHERE region_id = " + id + ";\n";
+            }
+            copy += "INSERT OR IGNORE INTO sync_data SELECT * FROM legacy.sync_data WHERE server_id = " + id + ";\n"
+                    "INSERT OR IGNORE INTO sync_watermarks SELECT * FROM legacy.sync_watermarks WHERE server_id = " + id + ";\n"
+                    "COMMIT;\nDETACH DATABASE legacy;";
+            if (!exec_sql(partition->db, copy, "migrating region to its partition")) return false;
+            LOG_INFO << "Migrated region " << region << " to " << partition->file;
+        }
+
+        std::string drop = "DROP TABLE sync_data;\nDROP TABLE sync_watermarks;\n";
+        for (const syncproto::Table& table : syncproto::kTables) drop += std::string("DROP TABLE ") + table.name + ";\n";
+        return exec_sql(db_, drop, "dropping migrated tables");
     }
 
-    tcp::socket socket_;
-    boost::asio::streambuf buffer_;
     sqlite3* db_;
+    const std::string main_file_;
+    const size_t capacity_;
+    contention::Mutex mutex_{"central_partitions"};
+    std::map<std::string, std::unique_ptr<Partition>> partitions_;
 };
 
-class Server {
+static contention::QueueStats parse_queue_stats("central_parse");
+static contention::QueueStats write_queue_stats("central_write");
+static metrics::Family<metrics::Counter>& stage_items = metrics::Registry::global()
+    .counter_family("central_pipeline_items_total", "Batches through each ingest stage");
+static metrics::Family<metrics::Histogram>& stage_duration = metrics::Registry::global()
+    .histogram_family("central_pipeline_stage_seconds", "Time per batch in the parse stage, per transaction in the write stage");
+static metrics::Counter& backpressure_pauses = metrics::Registry::global()
+    .counter("central_pipeline_backpressure_total", "Times a session stopped reading because the parse queue was full");
+
+// ---- hash trees -------------------------------------------------------------
+//
+// Each partition keeps a merkle::Tree per replica table, built from the
+// tables at startup and updated as batches commit. A regional server walks
+// them with MerkleQuery to find rows central lost or has different from
+// its own (a restored backup, a hand edit, a bug), and reships those.
+
+static metrics::Counter& merkle_queries = metrics::Registry::global()
+    .counter("central_merkle_queries_total", "MerkleQuery frames answered");
+
+// Hashes every stored row of the partition into its trees.
+void load_trees(Partition& partition) {
+    auto start = std::chrono::steady_clock::now();
+    std::lock_guard<contention::Mutex> lock(partition.trees_mutex);
+    size_t rows = 0;
+    for (size_t t = 0; t < std::size(syncproto::kTables); ++t) {
+        const syncproto::Table& table = syncproto::kTables[t];
+        std::string sql = "SELECT ";
+        for (size_t i = 0; i < table.column_count; ++i) sql += std::string(i ? ", " : "") + table.columns[i].name;
+        sql += std::string(" FROM ") + table.name + " WHERE region_id = ?";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(partition.db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            LOG_WARN << "Cannot read " << table.name << " for hash trees: " << sqlite3_errmsg(partition.db);
+            continue;
+        }
+        sql::bind(stmt, 1, std::string_view(partition.region));
+        std::array<syncproto::Value, syncproto::kMaxColumns> values;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            read_values(stmt, table, values.data());
+            partition.trees[t].set(values[0].integer, merkle::row_hash(table, values.data()));
+            ++rows;
+        }
+        sqlite3_finalize(stmt);
+    }
+    LOG_INFO << "Hash trees for " << partition.region << ": " << rows << " rows in "
+             << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+             << " ms";
+}
+
+// ---- snapshots --------------------------------------------------------------
+
+// Pages copied per backup step. The partition is locked only during a step,
+// so its writer keeps storing batches while a snapshot is taken.
+constexpr int kSnapshotPagesPerStep = 64;
+// Wait before retrying a step the source's lock refused.
+constexpr int kSnapshotBusyBackoffMs = 10;
+
+static metrics::Counter& snapshots_sent = metrics::Registry::global()
+    .counter("central_snapshots_total", "Region snapshots taken for bootstrapping regional servers");
+static metrics::Histogram& snapshot_duration = metrics::Registry::global()
+    .histogram("central_snapshot_seconds", "Time to copy a partition for a snapshot");
+
+// Copies the partition to `path` with the online backup API, reads the
+// watermark the copy is consistent with, then drops central's own tables
+// (audit log, watermarks, tombstones) from the copy so only the replicated
+// tables are streamed.
+bool take_snapshot(Partition& partition, const std::string& path, uint64_t& watermark) {
+    metrics::ScopedTimer timer(snapshot_duration);
+    sqlite3* copy = nullptr;
+    if (sqlite3_open(path.c_str(), &copy) != SQLITE_OK) {
+        LOG_WARN << "Cannot create snapshot " << path << ": " << sqlite3_errmsg(copy);
+        sqlite3_close(copy);
+        return false;
+    }
+    sqlite3_backup* backup = sqlite3_backup_init(copy, "main", partition.db, "main");
+    int rc = backup ? SQLITE_OK : sqlite3_errcode(copy);
+    while (backup && (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)) {
+        if (rc != SQLITE_OK) sqlite3_sleep(kSnapshotBusyBackoffMs);
+        // The writer holds this for whole transactions, so a step never
+        // copies pages of one that is still open (the backup reads through
+        // the writer's own connection).
+        std::lock_guard<contention::Mutex> lock(partition.mutex);
+        rc = sqlite3_backup_step(backup, kSnapshotPagesPerStep);
+    }
+    if (backup) sqlite3_backup_finish(backup);
+    bool ok = rc == SQLITE_DONE;
+    if (ok) {
+        // The copy inherits WAL mode; a single self-contained file is what
+        // gets streamed.
+        sqlite3_exec(copy, "PRAGMA journal_mode = DELETE", nullptr, nullptr, nullptr);
+        // One-off statements: pooled ones would keep `copy` from closing.
+        watermark = 0;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(copy, "SELECT seq FROM sync_watermarks WHERE server_id = ?", -1, &stmt, nullptr) ==
+            SQLITE_OK) {
+            sql::bind(stmt, 1, std::string_view(partition.region));
+            if (sqlite3_step(stmt) == SQLITE_ROW) watermark = static_cast<uint64_t>(sqlite3_column_int64(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+        std::string trim;
+        if (sqlite3_prepare_v2(copy, "SELECT name FROM sqlite_master WHERE type = 'table' AND name NOT LIKE 'sqlite_%'",
+                               -1, &stmt, nullptr) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                std::string table = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+                if (!syncproto::find_table(table)) trim += "DROP TABLE \"" + table + "\";\n";
+            }
+        }
+        sqlite3_finalize(stmt);
+        ok = exec_sql(copy, trim + "VACUUM;", "trimming snapshot");
+    } else {
+        LOG_WARN << "Snapshot of " << partition.region << " failed: " << sqlite3_errstr(rc);
+    }
+    sqlite3_close(copy);
+    return ok;
+}
+
+// A snapshot file being streamed to a regional server; removed when done.
+struct SnapshotStream {
+    ~SnapshotStream() {
+        in.close();
+        std::remove(path.c_str());
+    }
+
+    std::string path;
+    std::ifstream in;
+    uint64_t watermark = 0;
+    uint64_t size = 0;
+    uint64_t offset = 0;
+};
+
+// ---- catalog push -----------------------------------------------------------
+//
+// Regional servers subscribe to the other regions' services (see
+// sync_protocol.hpp). A session keeps the seq it has sent per origin region,
+// starting from what the regional server said it has, and sends each origin's
+// changes past it, read from the origin's partition, so only deltas go out.
+// Writers publish when a commit changed usluge; sessions then push once their
+// outbox is empty, at most kCatalogPushRows per origin per frame.
+
+constexpr size_t kCatalogPushRows = 1000;
+
+// Adds the partition's catalog changes (usluge upserts and deletes) after
+// `after_seq` to `batch`, oldest first and at most `limit` of them, and sets
+// `first_seq`/`last_seq` to the first and last one's seq. Returns how many
+// were added.
+size_t catalog_changes(Partition& origin, uint64_t after_seq, size_t limit, syncproto::BatchWriter& batch,
+                       uint64_t& first_seq, uint64_t& last_seq) {
+    static const syncproto::Table& usluge = *syncproto::find_table("usluge");
+    static const std::string sql = [] {
+        std::string columns, keys = usluge.columns[0].name;
+        for (size_t i = 0; i < usluge.column_count; ++i) {
+            columns += std::string(", ") + usluge.columns[i].name;
+            if (i) keys += ", NULL";
+        }
+        return "SELECT seq, 0" + columns + " FROM usluge WHERE region_id = ?1 AND seq > ?2 "
+               "UNION ALL SELECT seq, 1, " + keys + " FROM usluge_deleted "
+               "WHERE region_id = ?1 AND seq > ?2 ORDER BY 1 LIMIT ?3";
+    }();
+    std::lock_guard<contention::Mutex> lock(origin.read_mutex);
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(origin.reader, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        LOG_WARN << "Cannot read catalog of " << origin.region << ": " << sqlite3_errmsg(origin.reader);
+        return 0;
+    }
+    sql::bind(stmt, 1, std::string_view(origin.region));
+    sql::bind(stmt, 2, static_cast<int64_t>(after_seq));
+    sql::bind(stmt, 3, static_cast<int64_t>(limit));
+    size_t count = 0;
+    std::array<syncproto::Value, syncproto::kMaxColumns> values;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        auto seq = static_cast<uint64_t>(sqlite3_column_int64(stmt, 0));
+        if (!count++) first_seq = seq;
+        last_seq = seq;
+        if (sqlite3_column_int(stmt, 1)) {
+            batch.remove(usluge, seq, sqlite3_column_int64(stmt, 2));
+            continue;
+        }
+        read_values(stmt, usluge, values.data(), 2);
+        batch.upsert(usluge, seq, values.data());
+    }
+    sqlite3_finalize(stmt);
+    return count;
+}
+
+static metrics::Counter& catalog_rows_pushed = metrics::Registry::global()
+    .counter("central_catalog_rows_pushed_total", "Service catalog changes pushed to other regions");
+
+class CatalogHub {
 public:
-    Server(boost::asio::io_context& io_context, short start_port, short end_port, sqlite3* db)
-        : io_context_(io_context), db_(db) {
-        start_accept(start_port, end_port);
+    void subscribe(const std::shared_ptr<Session>& session) {
+        std::lock_guard<contention::Mutex> lock(mutex_);
+        sessions_.push_back(session);
     }
 
+    // Tells every subscribed session that `region`'s catalog changed.
+    void publish(const std::string& region);
+
 private:
-    void start_accept(short start_port, short end_port) {
-        for (short port = start_port; port <= end_port; ++port) {
-            auto new_session = std::make_shared<Session>(io_context_, db_);
-            acceptor_.emplace_back(io_context_, tcp::endpoint(tcp::v4(), port));
-            acceptor_.back().async_accept(new_session->socket(),
-                boost::bind(&Server::handle_accept, this, new_session,
-                boost::asio::placeholders::error));
+    contention::Mutex mutex_{"central_catalog_hub"};
+    std::vector<std::weak_ptr<Session>> sessions_;
+};
+
+static CatalogHub catalog_hub;
+
+class Pipeline {
+public:
+    Pipeline(PartitionStore& partitions, size_t parsers, size_t capacity) : partitions_(partitions) {
+        for (size_t i = 0; i < parsers; ++i) parsers_.push_back(std::make_unique<Parser>(capacity));
+    }
+
+    // Starts the parsers and a writer for every partition opened so far.
+    void start() {
+        for (auto& parser : parsers_) std::thread([this, p = parser.get()] { parse_loop(*p); }).detach();
+        partitions_.for_each([this](Partition& partition) { start_writer(partition); });
+    }
+
+    // The region's partition, with its writer running. nullptr if the
+    // partition can't be opened.
+    Partition* partition(const std::string& region) {
+        bool created;
+        Partition* partition = partitions_.open(region, created);
+        if (created) start_writer(*partition);
+        return partition;
+    }
+
+    template <typename F>
+    void for_each_partition(F&& f) { partitions_.for_each(std::forward<F>(f)); }
+
+    // Network stage: queues a batch frame for its region's parser. Returns
+    // false, leaving `item` with the caller, when that queue is full.
+    bool submit(SyncItemPtr& item) {
+        Parser& parser = *parsers_[std::hash<std::string>{}(item->region->id) % parsers_.size()];
+        item->ticket = parse_queue_stats.enqueued();
+        if (!parser.queue.try_push(item)) {
+            parse_queue_stats.cancelled(item->ticket);
+            return false;
         }
+        parser.bell.ring();
+        return true;
+    }
+
+private:
+    struct Parser {
+        explicit Parser(size_t capacity) : queue(capacity) {}
+        pipeline::BoundedQueue<SyncItemPtr> queue;
+        pipeline::Doorbell bell;
+    };
+
+    void start_writer(Partition& partition) {
+        aggregates.load(partition.db, partition.region);
+        load_trees(partition);
+        std::thread([this, &partition] { write_loop(partition); }).detach();
     }
 
-    void handle_accept(std::shared_ptr<Session> new_session, const boost::system::error_code& error) {
-        if (!error) {
-            new_session->start();
+    void parse_loop(Parser& parser);
+    void write_loop(Partition& partition);
+    static bool parse(SyncItem& item);
+    static bool write_group(Partition& partition, std::vector<SyncItemPtr>& group);
+    static bool store_batch(Partition& partition, SyncItem& item, size_t& pending,
+                            std::chrono::steady_clock::time_point& started);
+    static bool commit(Partition& partition, std::chrono::steady_clock::time_point started);
+
+    PartitionStore& partitions_;
+    std::vector<std::unique_ptr<Parser>> parsers_;
+};
+
+// A session can have this many batches in the pipeline before it stops
+// reading; the regional side keeps fewer than that unacknowledged.
+constexpr unsigned kMaxInflightBatches = 8;
+
+class Session : public std::enable_shared_from_this<Session> {
+public:
+    // The socket's handlers, acks included, run on a per-connection strand.
+    Session(boost::asio::io_context& io_context, RegionRegistry& regions, Pipeline& pipeline)
+        : socket_(boost::asio::make_strand(io_context)), retry_timer_(socket_.get_executor()),
+          regions_(regions), pipeline_(pipeline) {}
+
+    ~Session() {
+        if (started_) sessions_active.sub();
+        if (region_) regions_.disconnect(*region_);
+    }
+
+    tcp::socket& socket() {
+        return socket_;
+    }
+
+    void start() {
+        started_ = true;
+        sessions_active.add();
+        read_next();
+    }
+
+    // Called by CatalogHub from a writer thread.
+    void catalog_changed(const std::string& origin) {
+        auto self(shared_from_this());
+        boost::asio::post(socket_.get_executor(), [self, origin] {
+            if (origin == self->region_->id) return;
+            self->catalog_pending_ = true;
+            if (self->outbox_.empty() && !self->snapshot_) self->push_catalog();
+        });
+    }
+
+    // Called by the pipeline when a batch is stored (or failed); acks on the
+    // session's strand.
+    static void complete(SyncItemPtr item, bool ok) {
+        auto session = std::move(item->session);
+        uint64_t last_seq = item->header.last_seq;
+        item.reset();
+        boost::asio::post(session->socket_.get_executor(), [session, ok, last_seq] {
+            session->finish_batch(ok, last_seq);
+        });
+    }
+
+private:
+    // Frames are a 4-byte length and a payload (see sync_protocol.hpp).
+    void read_next() {
+        if (inflight_ >= kMaxInflightBatches) {
+            paused_ = true;
+            return;
         }
+        auto self(shared_from_this());
+        boost::asio::async_read(socket_, boost::asio::buffer(header_),
+            [self](const boost::system::error_code& error, std::size_t) {
+                if (error) return;
+                uint32_t length = wire::get_frame_length(self->header_);
+                if (length > syncproto::kMaxFrameSize) {
+                    LOG_WARN << "Sync frame too large: " << length;
+                    return;
+                }
+                self->frame_.resize(length);
+                boost::asio::async_read(self->socket_, boost::asio::buffer(&self->frame_[0], length),
+                    boost::bind(&Session::handle_read, self, boost::asio::placeholders::error));
+            });
     }
 
-    std::vector<tcp::acceptor> acceptor_; // Adjusted for multiple acceptors
-    boost::asio::io_context& io_context_;
-    sqlite3* db_;
+    void handle_read(const boost::system::error_code& error) {
+        if (error) return;
+        messages_received.add();
+        if (!region_) {
+            handle_hello();
+            return;
+        }
+        region_->bytes.add(frame_.size() + wire::kFrameHeaderSize);
+        region_->last_seen_ms = unix_ms();
+
+        syncproto::MessageType type;
+        if (!syncproto::decode_type(frame_, type)) {
+            LOG_WARN << "Empty sync frame from " << region_->id;
+            return;
+        }
+        switch (type) {
+            case syncproto::MessageType::batch:
+                break;
+            case syncproto::MessageType::heartbeat: {
+                std::string echo;
+                syncproto::encode_heartbeat(echo);
+                send(std::move(echo));
+                read_next();
+                return;
+            }
+            case syncproto::MessageType::snapshot_request:
+                if (!(capabilities_ & syncproto::kCapSnapshot)) break;
+                start_snapshot();
+                return;
+            case syncproto::MessageType::merkle_query:
+                if (!(capabilities_ & syncproto::kCapMerkle)) break;
+                if (answer_merkle_query()) read_next();
+                return;
+            case syncproto::MessageType::catalog_subscribe:
+                if (!(capabilities_ & syncproto::kCapCatalog)) break;
+                if (subscribe_catalog()) read_next();
+                return;
+            default:
+                break;
+        }
+        if (type != syncproto::MessageType::batch) {
+            LOG_WARN << "Unexpected sync message type " << static_cast<int>(type) << " from " << region_->id;
+            return;
+        }
+
+        stage_items.with(metrics::label("stage", "network")).add();
+        pending_ = std::make_unique<SyncItem>();
+        pending_->session = shared_from_this();
+        pending_->region = region_;
+        pending_->partition = partition_;
+        pending_->frame = std::move(frame_);
+        submit();
+    }
+
+    // Hands pending_ to the pipeline. While its queue is full the socket is
+    // not read; retries back off from 1 ms to 64 ms.
+    void submit() {
+        if (pipeline_.submit(pending_)) {
+            pending_.reset();
+            retry_delay_ = std::chrono::milliseconds(0);
+            ++inflight_;
+            read_next();
+            return;
+        }
+        if (retry_delay_.count() == 0) backpressure_pauses.add();
+        retry_delay_ = std::clamp(retry_delay_ * 2, std::chrono::milliseconds(1), std::chrono::milliseconds(64));
+        retry_timer_.expires_after(retry_delay_);
+        auto self(shared_from_this());
+        retry_timer_.async_wait([self](const boost::system::error_code& error) {
+            if (!error) self->submit();
+        });
+    }
+
+    void finish_batch(bool ok, uint64_t last_seq) {
+        --inflight_;
+        if (!ok) {
+            // The regional server reconnects and resends; what was stored is
+            // skipped by the watermark.
+            boost::system::error_code ec;
+            socket_.close(ec);
+            return;
+        }
+        // Everything in the batch is stored; acknowledge its position.
+        std::string ack;
+        syncproto::encode_ack(ack, last_seq);
+        send(std::move(ack));
+        if (paused_) {
+            paused_ = false;
+            read_next();
+        }
+    }
+
+    // The first frame must be a Hello. Registers the region, opens its
+    // partition and answers with a Welcome; an unknown protocol version or a
+    // region id that can't name a file closes the connection.
+    void handle_hello() {
+        syncproto::Hello hello;
+        if (!syncproto::decode_hello(frame_, hello) || hello.region_id.empty()) {
+            LOG_WARN << "Sync connection did not start with a valid hello";
+            return;
+        }
+        std::string region_id(hello.region_id);
+        if (!valid_region_id(region_id)) {
+            LOG_WARN << "Invalid region id in hello: " << region_id;
+            return;
+        }
+        if (hello.version != syncproto::kProtocolVersion) {
+            LOG_WARN << "Region " << region_id << " speaks sync protocol " << hello.version
+                     << ", expected " << syncproto::kProtocolVersion;
+            return;
+        }
+        boost::system::error_code ec;
+        auto endpoint = socket_.remote_endpoint(ec);
+        std::string address = ec ? std::string() : endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+
+        partition_ = pipeline_.partition(region_id);
+        if (!partition_) return;
+        syncproto::Welcome welcome;
+        welcome.capabilities = hello.capabilities & syncproto::kCapAll;
+        region_ = &regions_.connect(region_id, address, hello.version, welcome.capabilities);
+        capabilities_ = welcome.capabilities;
+        {
+            std::lock_guard<contention::Mutex> lock(partition_->mutex);
+            welcome.watermark = load_watermark(partition_->db, region_id);
+        }
+        region_->watermark = welcome.watermark;
+        LOG_INFO << "Region " << region_id << " connected from " << address << " (watermark " << welcome.watermark << ")";
+
+        std::string reply;
+        syncproto::encode_welcome(reply, welcome);
+        send(std::move(reply));
+        read_next();
+    }
+
+    // Copies the region's partition on a thread of its own (it reads the
+    // whole file), then streams it back; the socket isn't read meanwhile.
+    void start_snapshot() {
+        static std::atomic<uint64_t> counter{0};
+        auto snapshot = std::make_shared<SnapshotStream>();
+        snapshot->path = partition_->file + ".snapshot." + std::to_string(counter++);
+        LOG_INFO << "Taking snapshot of " << partition_->region << " for bootstrap";
+        auto self(shared_from_this());
+        std::thread([self, snapshot] {
+            bool ok = take_snapshot(*self->partition_, snapshot->path, snapshot->watermark);
+            boost::asio::post(self->socket_.get_executor(), [self, snapshot, ok] {
+                if (ok) {
+                    snapshot->in.open(snapshot->path, std::ios::binary | std::ios::ate);
+                    snapshot->size = static_cast<uint64_t>(snapshot->in.tellg());
+                    snapshot->in.seekg(0);
+                }
+                if (!ok || !snapshot->in) {
+                    boost::system::error_code ec;
+                    self->socket_.close(ec);
+                    return;
+                }
+                snapshots_sent.add();
+                self->snapshot_ = snapshot;
+                self->send_snapshot_chunk();
+            });
+        }).detach();
+    }
+
+    // Sends the next chunk; called again when the outbox drains, so one
+    // chunk is buffered at a time.
+    void send_snapshot_chunk() {
+        std::string data(static_cast<size_t>(std::min<uint64_t>(syncproto::kSnapshotChunkSize,
+                                                                snapshot_->size - snapshot_->offset)), '\0');
+        if (!snapshot_->in.read(&data[0], static_cast<std::streamsize>(data.size()))) {
+            LOG_WARN << "Error reading snapshot " << snapshot_->path;
+            snapshot_.reset();
+            boost::system::error_code ec;
+            socket_.close(ec);
+            return;
+        }
+        syncproto::SnapshotChunk chunk;
+        chunk.watermark = snapshot_->watermark;
+        chunk.total_size = snapshot_->size;
+        chunk.offset = snapshot_->offset;
+        chunk.data = data;
+        std::string frame;
+        syncproto::encode_snapshot_chunk(frame, chunk);
+        snapshot_->offset += data.size();
+        if (snapshot_->offset == snapshot_->size) {
+            LOG_INFO << "Sent snapshot of " << partition_->region << " (" << snapshot_->size << " bytes, seq "
+                     << snapshot_->watermark << ")";
+            snapshot_.reset();
+            read_next();
+        }
+        send(std::move(frame));
+    }
+
+    // Replies with the children of each queried node from the partition's
+    // committed trees. False (dropping the connection) if the query is
+    // malformed.
+    bool answer_merkle_query() {
+        syncproto::MerkleQuery query;
+        const syncproto::Table* table;
+        if (!syncproto::decode_merkle_query(frame_, query) || !(table = syncproto::find_table(query.table))
+            || query.level > merkle::kRoot) {
+            LOG_WARN << "Malformed merkle query from " << region_->id;
+            return false;
+        }
+        merkle_queries.add();
+        syncproto::MerkleReply reply;
+        reply.table = query.table;
+        reply.level = query.level;
+        reply.nodes.reserve(query.indexes.size());
+        {
+            const merkle::Tree& tree = partition_->trees[static_cast<size_t>(table - syncproto::kTables)];
+            std::lock_guard<contention::Mutex> lock(partition_->trees_mutex);
+            for (uint64_t index : query.indexes) reply.nodes.push_back(tree.children(query.level, index));
+        }
+        std::string frame;
+        syncproto::encode_merkle_reply(frame, reply);
+        send(std::move(frame));
+        return true;
+    }
+
+    // Starts pushing the other regions' catalogs from the versions the
+    // regional server has. False (dropping the connection) if malformed.
+    bool subscribe_catalog() {
+        syncproto::CatalogVersions versions;
+        if (!syncproto::decode_catalog_subscribe(frame_, versions)) {
+            LOG_WARN << "Malformed catalog subscribe from " << region_->id;
+            return false;
+        }
+        for (const auto& [origin, seq] : versions) catalog_sent_[std::string(origin)] = seq;
+        if (!catalog_subscribed_) catalog_hub.subscribe(shared_from_this());
+        catalog_subscribed_ = true;
+        catalog_pending_ = true;
+        if (outbox_.empty() && !snapshot_) push_catalog();
+        return true;
+    }
+
+    // Sends each origin's next changes. Stays pending while any origin had
+    // more than fit, to continue when the outbox drains.
+    void push_catalog() {
+        catalog_pending_ = false;
+        std::vector<Partition*> origins;
+        pipeline_.for_each_partition([&](Partition& partition) {
+            if (partition.region != region_->id) origins.push_back(&partition);
+        });
+        for (Partition* origin : origins) {
+            uint64_t& sent = catalog_sent_[origin->region];
+            syncproto::BatchWriter batch;
+            uint64_t first_seq = 0, last_seq = 0;
+            size_t rows = catalog_changes(*origin, sent, kCatalogPushRows, batch, first_seq, last_seq);
+            if (!rows) continue;
+            std::string frame;
+            batch.finish(frame, origin->region, first_seq, last_seq, {}, capabilities_ & syncproto::kCapCompression,
+                         syncproto::MessageType::catalog_update);
+            send(std::move(frame));
+            sent = last_seq;
+            catalog_rows_pushed.add(rows);
+            if (rows == kCatalogPushRows) catalog_pending_ = true;
+        }
+    }
+
+    // Queues a frame; writes go out one at a time, in order.
+    void send(std::string frame) {
+        outbox_.push_back(std::move(frame));
+        if (outbox_.size() == 1) write_next();
+    }
+
+    void write_next() {
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(outbox_.front()),
+            [self](const boost::system::error_code& error, std::size_t) {
+                self->outbox_.pop_front();
+                if (error) return;
+                if (!self->outbox_.empty()) {
+                    self->write_next();
+                } else if (self->snapshot_) {
+                    self->send_snapshot_chunk();
+                } else if (self->catalog_pending_) {
+                    self->push_catalog();
+                }
+            });
+    }
+
+    tcp::socket socket_;
+    boost::asio::steady_timer retry_timer_;
+    char header_[wire::kFrameHeaderSize];
+    std::string frame_;
+    std::deque<std::string> outbox_; // front is being written
+    SyncItemPtr pending_;            // waiting for room in the pipeline
+    std::chrono::milliseconds retry_delay_{0};
+    unsigned inflight_ = 0;          // batches in the pipeline
+    bool paused_ = false;            // stopped reading at kMaxInflightBatches
+    RegionRegistry& regions_;
+    Pipeline& pipeline_;
+    RegionRegistry::Region* region_ = nullptr; // set by the handshake
+    Partition* partition_ = nullptr;           // likewise
+    uint64_t capabilities_ = 0;                // likewise
+    std::shared_ptr<SnapshotStream> snapshot_; // being streamed
+    std::map<std::string, uint64_t> catalog_sent_; // catalog seq sent, per origin region
+    bool catalog_subscribed_ = false;
+    bool catalog_pending_ = false;             // changes may be waiting for the outbox
+    bool started_ = false;
 };
 
-void create_database(sqlite3* db) {
-    const char* create_table_sql =
-        "CREATE TABLE IF NOT EXISTS sync_data ("
-        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "server_id TEXT NOT NULL,"
-        "data TEXT NOT NULL,"
-        "timestamp TEXT NOT NULL);";
+void CatalogHub::publish(const std::string& region) {
+    std::lock_guard<contention::Mutex> lock(mutex_);
+    sessions_.erase(std::remove_if(sessions_.begin(), sessions_.end(), [&](const std::weak_ptr<Session>& weak) {
+        auto session = weak.lock();
+        if (session) session->catalog_changed(region);
+        return !session;
+    }), sessions_.end());
+}
 
-    char* err_msg = nullptr;
-    if (sqlite3_exec(db, create_table_sql, nullptr, nullptr, &err_msg) != SQLITE_OK) {
-        std::cerr << "Error creating table: " << err_msg << std::endl;
-        sqlite3_free(err_msg);
+// Parse stage: one thread per parser.
+void Pipeline::parse_loop(Parser& parser) {
+    static metrics::Counter& parsed = stage_items.with(metrics::label("stage", "parse"));
+    static metrics::Histogram& duration = stage_duration.with(metrics::label("stage", "parse"));
+    SyncItemPtr item;
+    for (;;) {
+        if (!parser.queue.try_pop(item)) {
+            parser.bell.wait([&] { return !parser.queue.empty(); });
+            continue;
+        }
+        bool ok;
+        {
+            auto running = parse_queue_stats.started(item->ticket);
+            metrics::ScopedTimer timer(duration);
+            ok = parse(*item);
+        }
+        parsed.add();
+        if (!ok) {
+            Session::complete(std::move(item), false);
+            continue;
+        }
+
+        // A full write queue blocks this parser, which in turn fills its own
+        // queue and stops the sessions feeding it.
+        Partition& partition = *item->partition;
+        item->ticket = write_queue_stats.enqueued();
+        while (!partition.queue.try_push(item)) {
+            partition.space.wait([&] { return partition.queue.size() < partition.queue.capacity(); });
+        }
+        partition.bell.ring();
     }
 }
 
-void insert_data(sqlite3* db, const std::string& sql, const std::string& server_id, const std::string& data) {
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, server_id.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 2, data.c_str(), -1, SQLITE_TRANSIENT);
+bool Pipeline::parse(SyncItem& item) {
+    const std::string& region = item.region->id;
+    if (!syncproto::decode_batch(item.frame, item.header, item.scratch)) {
+        LOG_WARN << "Malformed sync frame from " << region << " (" << item.frame.size() << " bytes)";
+        return false;
+    }
+    if (item.header.region_id != region) {
+        LOG_WARN << "Batch for region " << item.header.region_id << " on " << region << "'s connection";
+        return false;
+    }
+    LOG_DEBUG << "Received batch from " << region << " seq " << item.header.first_seq << "-" << item.header.last_seq;
 
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            std::cerr << "Error inserting data: " << sqlite3_errmsg(db) << std::endl;
+    syncproto::BatchReader reader(item.header.body);
+    syncproto::Row row;
+    while (reader.next(row)) item.rows.push_back(row);
+    if (reader.failed()) {
+        LOG_WARN << "Malformed sync batch from " << region;
+        return false;
+    }
+    return true;
+}
+
+// Write stage, one thread per partition: takes every batch already queued
+// (up to max_batch_rows rows) into one transaction, then acks them all.
+void Pipeline::write_loop(Partition& partition) {
+    std::vector<SyncItemPtr> group;
+    SyncItemPtr item;
+    for (;;) {
+        if (!partition.queue.try_pop(item)) {
+            partition.bell.wait([&] { return !partition.queue.empty(); });
+            continue;
         }
+        size_t rows = 0;
+        do {
+            write_queue_stats.started(item->ticket);
+            rows += item->rows.size();
+            group.push_back(std::move(item));
+        } while (rows < max_batch_rows && partition.queue.try_pop(item));
+        partition.space.ring();
+
+        bool ok = write_group(partition, group);
+        stage_items.with(metrics::label("stage", "write")).add(group.size());
+        for (auto& done : group) {
+            if (ok) {
+                done->region->batches.add();
+                uint64_t watermark = done->region->watermark.load();
+                if (done->header.last_seq > watermark) done->region->watermark = done->header.last_seq;
+            }
+            Session::complete(std::move(done), ok);
+        }
+        group.clear();
     }
-    sqlite3_finalize(stmt);
 }
 
-void insert_korisnici(sqlite3* db, const std::string& server_id, const std::string& data) {
-    insert_data(db, "INSERT INTO sync_data (server_id, data, timestamp) VALUES (?, ?, datetime('now'));", server_id, data);
+bool Pipeline::write_group(Partition& partition, std::vector<SyncItemPtr>& group) {
+    sqlite3* db = partition.db;
+    std::lock_guard<contention::Mutex> lock(partition.mutex);
+    auto started = std::chrono::steady_clock::now();
+    if (begin_transaction.exec(db) != SQLITE_DONE) {
+        LOG_WARN << "Cannot start sync transaction: " << sqlite3_errmsg(db);
+        return false;
+    }
+    size_t pending = 0;
+    for (auto& item : group) {
+        if (!store_batch(partition, *item, pending, started)) {
+            LOG_WARN << "Error storing sync batch from " << partition.region << ": " << sqlite3_errmsg(db);
+            rollback_transaction.exec(db);
+            partition.staged.clear();
+            return false;
+        }
+    }
+    if (!commit(partition, started)) {
+        LOG_WARN << "Error committing sync batch: " << sqlite3_errmsg(db);
+        rollback_transaction.exec(db);
+        partition.staged.clear();
+        return false;
+    }
+    return true;
 }
 
-void insert_usluge(sqlite3* db, const std::string& server_id, const std::string& data) {
-    insert_data(db, "INSERT INTO sync_data (server_id, data, timestamp) VALUES (?, ?, datetime('now'));", server_id, data);
+bool Pipeline::commit(Partition& partition, std::chrono::steady_clock::time_point started) {
+    static metrics::Histogram& duration = stage_duration.with(metrics::label("stage", "write"));
+    if (commit_transaction.exec(partition.db) != SQLITE_DONE) return false;
+    aggregates.apply(partition.region, partition.staged);
+    {
+        std::lock_guard<contention::Mutex> lock(partition.trees_mutex);
+        for (const HashChange& change : partition.staged.hashes) {
+            partition.trees[change.table].set(change.key, change.hash);
+        }
+    }
+    if (partition.staged.catalog) catalog_hub.publish(partition.region);
+    partition.staged.clear();
+    auto elapsed = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - started).count());
+    commit_duration.record(elapsed);
+    duration.record(elapsed);
+    transactions_committed.add();
+    return true;
 }
 
-void insert_narudzbe(sqlite3* db, const std::string& server_id, const std::string& data) {
-    insert_data(db, "INSERT INTO sync_data (server_id, data, timestamp) VALUES (?, ?, datetime('now'));", server_id, data);
+// Applies each row after the region's watermark to its replica table (and
+// the audit log) and moves the watermark to the batch's last seq. Past
+// max_batch_rows rows the transaction is committed and a new one started;
+// what was committed is skipped as duplicate if the batch is resent.
+bool Pipeline::store_batch(Partition& partition, SyncItem& item, size_t& pending,
+                           std::chrono::steady_clock::time_point& started) {
+    static const syncproto::Table* usluge = syncproto::find_table("usluge");
+    sqlite3* db = partition.db;
+    const std::string& region = partition.region;
+    // Rows at or below the watermark were stored before (the batch is a
+    // resend after a lost ack or a regional restart).
+    uint64_t watermark = load_watermark(db, region);
+    if (item.header.last_seq <= watermark) {
+        LOG_DEBUG << "Skipping resent batch from " << region << " (watermark " << watermark << ")";
+        rows_duplicate.add(item.rows.size());
+        return true;
+    }
+    tracing::Context parent;
+    tracing::parse_traceparent(item.header.traceparent, parent);
+    tracing::Span span("process", parent, tracing::now_us(), region);
+
+    std::string data;
+    for (const syncproto::Row& row : item.rows) {
+        if (row.seq <= watermark) {
+            rows_duplicate.add();
+            continue;
+        }
+        rows_received.with(metrics::label("table", row.table->name)).add();
+        item.region->rows.add();
+        if (!stage_change(db, region, row, partition.staged) || !store_row(db, region, row)) return false;
+        // Nothing changed when the seq guard skipped the row.
+        if (sqlite3_changes(db) > 0) {
+            std::optional<uint64_t> hash;
+            if (row.op == syncproto::Op::upsert) hash = merkle::row_hash(*row.table, row.values.data());
+            partition.staged.hashes.push_back({static_cast<size_t>(row.table - syncproto::kTables), row.key, hash});
+            if (row.table == usluge) {
+                partition.staged.catalog = true;
+                if (row.op == syncproto::Op::remove &&
+                    upsert_deleted_service.exec(db, region, row.key, static_cast<int64_t>(row.seq)) != SQLITE_DONE) {
+                    return false;
+                }
+            }
+        }
+        if (audit_log) {
+            format_row(row, data);
+            if (insert_sync_data.exec(db, region, data, static_cast<int64_t>(row.seq)) != SQLITE_DONE) return false;
+        }
+        if (++pending == max_batch_rows) {
+            if (!commit(partition, started)) return false;
+            pending = 0;
+            started = std::chrono::steady_clock::now();
+            if (begin_transaction.exec(db) != SQLITE_DONE) return false;
+        }
+    }
+    return upsert_watermark.exec(db, region, static_cast<int64_t>(item.header.last_seq)) == SQLITE_DONE;
 }
 
-void insert_loyalnost(sqlite3* db, const std::string& server_id, const std::string& data) {
-    insert_data(db, "INSERT INTO sync_data (server_id, data, timestamp) VALUES (?, ?, datetime('now'));", server_id, data);
+class Server {
+public:
+    Server(boost::asio::io_context& io_context, unsigned short port, PartitionStore& partitions,
+           size_t parse_threads, size_t queue_capacity)
+        : io_context_(io_context), acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
+          pipeline_(partitions, parse_threads, queue_capacity) {
+        pipeline_.start();
+        start_accept();
+    }
+
+    RegionRegistry& regions() { return regions_; }
+
+private:
+    // Keeps one accept pending, re-armed after every connection. Regions
+    // identify themselves in the handshake, so they all share the port.
+    void start_accept() {
+        auto new_session = std::make_shared<Session>(io_context_, regions_, pipeline_);
+        acceptor_.async_accept(new_session->socket(),
+            [this, new_session](const boost::system::error_code& error) {
+                if (error == boost::asio::error::operation_aborted) return;
+                if (!error) {
+                    connections_accepted.add();
+                    new_session->start();
+                } else {
+                    LOG_WARN << "Accept failed: " << error.message();
+                }
+                start_accept();
+            });
+    }
+
+    boost::asio::io_context& io_context_;
+    tcp::acceptor acceptor_;
+    RegionRegistry regions_;
+    Pipeline pipeline_;
+};
+
+// Serves GET /metrics, GET /regions (the region registry as JSON),
+// GET /tables (replica row counts across the partitions) and
+// GET /aggregates on its own port and thread, so scrapes never wait behind
+// sync traffic.
+void metrics_server(unsigned short port, RegionRegistry& regions, PartitionStore& partitions) {
+    try {
+        boost::asio::io_context io_context;
+        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), port));
+        for (;;) {
+            tcp::socket socket(io_context);
+            acceptor.accept(socket);
+            try {
+                beast::flat_buffer buffer;
+                http::request<http::string_body> req;
+                http::read(socket, buffer, req);
+
+                http::response<http::string_body> res{http::status::ok, req.version()};
+                if (req.method() == http::verb::get && req.target() == "/metrics") {
+                    res.set(http::field::content_type, "text/plain; version=0.0.4");
+                    metrics::Registry::global().render(res.body());
+                } else if (req.method() == http::verb::get && req.target() == "/regions") {
+                    res.set(http::field::content_type, "application/json");
+                    regions.render(res.body());
+                } else if (req.method() == http::verb::get && req.target() == "/tables") {
+                    res.set(http::field::content_type, "application/json");
+                    if (!partitions.render_counts(res.body())) {
+                        res.result(http::status::internal_server_error);
+                        res.set(http::field::content_type, "text/plain");
+                        res.body() = "Cannot read every partition";
+                    }
+                } else if (req.method() == http::verb::get && req.target() == "/aggregates") {
+                    res.set(http::field::content_type, "application/json");
+                    aggregates.render(res.body());
+                } else {
+                    res.result(http::status::not_found);
+                    res.set(http::field::content_type, "text/plain");
+                    res.body() = "Endpoint not found";
+                }
+                res.prepare_payload();
+                http::write(socket, res);
+            } catch (const std::exception& e) {
+                LOG_WARN << "Metrics request failed: " << e.what();
+            }
+        }
+    } catch (const std::exception& e) {
+        LOG_ERROR << "Metrics server error: " << e.what();
+    }
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        std::cerr << "Usage: ./central_server <start_port> <end_port> <database_file>" << std::endl;
+    if (argc < 3) {
+        std::cerr << "Usage: ./central_server <port> <database_file> [--metrics-port=N] [--log-file=PATH] [--log-level=debug|info|warn|error] [--trace-file=PATH] [--max-batch-rows=N] [--threads=N] [--parse-threads=N] [--queue-capacity=N] [--audit-log]" << std::endl;
         return 1;
     }
 
-    short start_port = std::atoi(argv[1]);
-    short end_port = std::atoi(argv[2]);
-    const std::string database_file = argv[3];
+    unsigned short port = static_cast<unsigned short>(std::atoi(argv[1]));
+    const std::string database_file = argv[2];
+
+    // Optional flags
+    std::string log_file;
+    std::string trace_file;
+    unsigned short metrics_port = 0;
+    unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+    size_t parse_threads = 2;
+    size_t queue_capacity = 64;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--metrics-port=", 0) == 0) {
+            metrics_port = static_cast<unsigned short>(std::atoi(arg.c_str() + 15));
+        } else if (arg.rfind("--log-file=", 0) == 0) {
+            log_file = arg.substr(11);
+        } else if (arg.rfind("--trace-file=", 0) == 0) {
+            trace_file = arg.substr(13);
+        } else if (arg.rfind("--parse-threads=", 0) == 0) {
+            parse_threads = static_cast<size_t>(std::max(1, std::atoi(arg.c_str() + 16)));
+        } else if (arg.rfind("--queue-capacity=", 0) == 0) {
+            queue_capacity = static_cast<size_t>(std::max(2, std::atoi(arg.c_str() + 17)));
+        } else if (arg == "--audit-log") {
+            audit_log = true;
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            threads = static_cast<unsigned>(std::max(1, std::atoi(arg.c_str() + 10)));
+        } else if (arg.rfind("--max-batch-rows=", 0) == 0) {
+            max_batch_rows = std::max(1, std::atoi(arg.c_str() + 17));
+        } else if (arg.rfind("--log-level=", 0) == 0) {
+            logger::Level level;
+            if (!logger::parse_level(arg.substr(12), level)) {
+                std::cerr << "Unknown log level: " << arg.substr(12) << std::endl;
+                return 1;
+            }
+            logger::set_level(level);
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (!logger::start(log_file)) {
+        std::cerr << "Cannot open log file: " << log_file << std::endl;
+        return 1;
+    }
+    if (!trace_file.empty() && !tracing::Recorder::instance().start(trace_file, "central")) {
+        LOG_ERROR << "Cannot open trace file: " << trace_file;
+        return 1;
+    }
 
     sqlite3* db;
     if (sqlite3_open(database_file.c_str(), &db) != SQLITE_OK) {
-        std::cerr << "Cannot open database: " << sqlite3_errmsg(db) << std::endl;
+        LOG_ERROR << "Cannot open database: " << sqlite3_errmsg(db);
         return 1;
     }
 
-    create_database(db); // Create the database table
+    init_replica_tables();
+    PartitionStore partitions(db, database_file, queue_capacity);
+    if (!partitions.load()) return 1;
 
-    boost::asio::io_context io_context;
-    Server server(io_context, start_port, end_port, db); // Use the specified port range
+    boost::asio::io_context io_context(static_cast<int>(threads));
+    Server server(io_context, port, partitions, parse_threads, queue_capacity);
+    LOG_INFO << "Central server listening on port " << port << " with " << threads << " threads";
+    if (metrics_port != 0) {
+        std::thread(metrics_server, metrics_port, std::ref(server.regions()), std::ref(partitions)).detach();
+    }
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; ++i) pool.emplace_back([&io_context] { io_context.run(); });
     io_context.run();
+    for (auto& thread : pool) thread.join();
 
     sqlite3_close(db);
     return 0;
@@ -1,17 +1,110 @@
 #include <iostream>
 #include <string>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
 
+#include "binary_protocol.hpp"
+#include "tracing.hpp"
+
 namespace beast = boost::beast;           // from <boost/beast.hpp>
 namespace http = beast::http;             // from <boost/beast/http.hpp>
 using tcp = boost::asio::ip::tcp;         // from <boost/asio/ip/tcp.hpp>
 
-// Function to send HTTP requests
+// Persistent connection to the regional server's binary listener (see
+// binary_protocol.hpp). Requests are tagged with an id; replies that arrive
+// for another caller are parked until that caller asks for them, so several
+// threads can share one connection with requests in flight concurrently.
+class BinaryTransport {
+public:
+    BinaryTransport(const std::string& host, int port) : socket_(io_context_) {
+        tcp::resolver resolver(io_context_);
+        boost::asio::connect(socket_, resolver.resolve(host, std::to_string(port)));
+    }
+
+    long call(const binproto::Route& route, const std::string& data, const std::string* token, std::string& response_data) {
+        std::string frame;
+        binproto::Request req;
+        req.opcode = route.opcode;
+        req.token = token ? std::string_view(*token) : std::string_view();
+        req.body = data;
+        std::string traceparent;
+        if (tracing::enabled() && tracing::current().valid()) {
+            traceparent = tracing::format_traceparent(tracing::current());
+            req.flags |= binproto::kFlagTrace;
+            req.traceparent = traceparent;
+        }
+
+        uint64_t id;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            id = req.id = next_id_++;
+            binproto::encode_request(frame, req);
+            boost::asio::write(socket_, boost::asio::buffer(frame));
+        }
+
+        std::lock_guard<std::mutex> lock(read_mutex_);
+        for (;;) {
+            auto parked = parked_.find(id);
+            if (parked != parked_.end()) {
+                long status = parked->second.first;
+                response_data = std::move(parked->second.second);
+                parked_.erase(parked);
+                return status;
+            }
+
+            char header[wire::kFrameHeaderSize];
+            boost::asio::read(socket_, boost::asio::buffer(header));
+            uint32_t length = wire::get_frame_length(header);
+            if (length > binproto::kMaxFrameSize) {
+                throw std::runtime_error("binary response frame too large");
+            }
+            std::string payload(length, '\0');
+            boost::asio::read(socket_, boost::asio::buffer(&payload[0], payload.size()));
+
+            binproto::Response res;
+            if (!binproto::decode_response(payload, res)) {
+                throw std::runtime_error("malformed binary response frame");
+            }
+            parked_[res.id] = {static_cast<long>(res.status), std::string(res.body)};
+        }
+    }
+
+private:
+    boost::asio::io_context io_context_;
+    tcp::socket socket_;
+    std::mutex write_mutex_;
+    std::mutex read_mutex_;
+    uint64_t next_id_ = 1;
+    std::map<uint64_t, std::pair<long, std::string>> parked_;
+};
+
+// Set in main() when --binary-port is given; send_request then prefers it for
+// every endpoint the binary protocol knows.
+std::unique_ptr<BinaryTransport> binary_transport;
+
 // Function to send HTTP requests
 long send_request(const std::string& host, int port, const std::string& endpoint, 
                   const std::string& data, std::string& response_data, 
                   const std::string* token = nullptr, bool is_get = true) {
+    // Each request starts a trace; the server continues it via traceparent.
+    std::string span_name;
+    if (tracing::enabled()) span_name = (is_get ? "GET " : "POST ") + endpoint;
+    tracing::Span span(span_name, tracing::Context{}, tracing::now_us());
+
+    if (binary_transport) {
+        if (const binproto::Route* route = binproto::find_route(!is_get, endpoint)) {
+            try {
+                return binary_transport->call(*route, data, token, response_data);
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << "\n";
+                return -1; // Indicate error
+            }
+        }
+    }
+
     try {
         boost::asio::io_context io_context;
         tcp::resolver resolver(io_context);
@@ -28,6 +121,9 @@ long send_request(const std::string& host, int port, const std::string& endpoint
         if (token) {
             req.set(http::field::authorization, "Bearer " + *token);
         }
+        if (tracing::enabled()) {
+            req.set("traceparent", tracing::format_traceparent(span.context()));
+        }
 
         if (!data.empty()) {
             req.set(http::field::content_type, "application/x-www-form-urlencoded");
@@ -555,9 +651,26 @@ void show_main_menu(const std::string& host, int port) {
     }
 }
 
-int main() {
-    std::string host = "localhost"; // Change to your server host
-    int port = 8080; // Change to your server port
+int main(int argc, char* argv[]) {
+    std::string host = argc > 1 ? argv[1] : "localhost"; // regional server host
+    int port = argc > 2 ? std::stoi(argv[2]) : 8080; // regional server HTTP port
+
+    // Optional: --binary-port=N switches to the binary transport,
+    // --trace-file=PATH records a span per request
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--binary-port=", 0) == 0) {
+            try {
+                binary_transport.reset(new BinaryTransport(host, std::stoi(arg.substr(14))));
+            } catch (const std::exception& e) {
+                std::cerr << "Binary transport unavailable, using HTTP: " << e.what() << "\n";
+            }
+        } else if (arg.rfind("--trace-file=", 0) == 0) {
+            if (!tracing::Recorder::instance().start(arg.substr(13), "client")) {
+                std::cerr << "Cannot open trace file: " << arg.substr(13) << "\n";
+            }
+        }
+    }
 
     show_main_menu(host, port);
 
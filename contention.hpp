@@ -0,0 +1,269 @@
+#pragma once
+
+// Lock and queue instrumentation for finding where threads wait.
+//
+//     contention::Mutex mutex_{"binary_write"};
+//     std::lock_guard<contention::Mutex> lock(mutex_);
+//
+// contention::Mutex is a drop-in std::mutex (use std::condition_variable_any
+// with it) that records, per lock name:
+//   - lock_acquisitions_total / lock_contended_total: every acquisition, and
+//     those that found the lock held;
+//   - lock_wait_seconds: time blocked in lock(). Every contended acquisition
+//     is timed, since it is already slow; uncontended ones are sampled and
+//     each sampled one is recorded as kSampleEvery zeros, so the quantiles
+//     estimate the distribution over all acquisitions;
+//   - lock_hold_seconds: time from lock() to unlock(), sampled for about 1
+//     in kSampleEvery acquisitions.
+//
+// QueueStats does the same for a work queue or thread pool: time from
+// enqueue to start (queue_wait_seconds), current depth and busy workers, and
+// a depth distribution sampled at every enqueue.
+//
+// All of it is in /metrics; summary() backs the /debug/contention dump with
+// percentiles per lock and queue.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio/post.hpp>
+
+#include "metrics.hpp"
+
+namespace contention {
+
+// On average one in this many acquisitions has its hold time measured, and
+// one in this many uncontended ones its (zero) wait.
+constexpr unsigned kSampleEvery = 16;
+
+struct LockStats {
+    metrics::Counter& acquisitions;
+    metrics::Counter& contended;
+    metrics::Histogram& wait;
+    metrics::Histogram& hold;
+};
+
+struct QueueCounters {
+    metrics::Histogram& wait;
+    metrics::Gauge& depth;
+    metrics::Gauge& busy;
+    metrics::Histogram depth_samples; // not exported; see summary()
+    std::atomic<int64_t> max_depth{0};
+};
+
+namespace detail {
+
+// Random rather than every Nth call, so a thread that takes the same few
+// locks in a fixed order doesn't always sample the same one.
+inline bool sample() {
+    thread_local uint32_t state = 0x9E3779B9u ^ static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&state));
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state % kSampleEvery == 0;
+}
+
+inline uint64_t since(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+// Stats by name, so every instance with the same name (e.g. one write lock
+// per connection) shares one set of metrics.
+class Directory {
+public:
+    static Directory& instance() {
+        static Directory directory;
+        return directory;
+    }
+
+    LockStats& lock(const std::string& name) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto& slot = locks_[name];
+        if (!slot) {
+            auto& registry = metrics::Registry::global();
+            std::string label = metrics::label("lock", name);
+            slot.reset(new LockStats{
+                registry.counter_family("lock_acquisitions_total", "Lock acquisitions, by lock").with(label),
+                registry.counter_family("lock_contended_total", "Lock acquisitions that had to wait, by lock").with(label),
+                registry.histogram_family("lock_wait_seconds", "Time spent waiting for a lock (uncontended acquisitions sampled, weighted)").with(label),
+                registry.histogram_family("lock_hold_seconds", "Time a lock was held (sampled)").with(label)});
+        }
+        return *slot;
+    }
+
+    QueueCounters& queue(const std::string& name) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto& slot = queues_[name];
+        if (!slot) {
+            auto& registry = metrics::Registry::global();
+            std::string label = metrics::label("queue", name);
+            slot.reset(new QueueCounters{
+                registry.histogram_family("queue_wait_seconds", "Time from enqueue until a worker picked the item up, by queue").with(label),
+                registry.gauge_family("queue_depth", "Items waiting, by queue").with(label),
+                registry.gauge_family("queue_busy_workers", "Items being worked on, by queue").with(label),
+                {}, {}});
+        }
+        return *slot;
+    }
+
+    template <typename F, typename G>
+    void for_each(F&& on_lock, G&& on_queue) const {
+        std::lock_guard<std::mutex> guard(mutex_);
+        for (const auto& [name, stats] : locks_) on_lock(name, *stats);
+        for (const auto& [name, stats] : queues_) on_queue(name, *stats);
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::map<std::string, std::unique_ptr<LockStats>> locks_;
+    std::map<std::string, std::unique_ptr<QueueCounters>> queues_;
+};
+
+} // namespace detail
+
+class Mutex {
+public:
+    explicit Mutex(const std::string& name) : stats_(detail::Directory::instance().lock(name)) {}
+    Mutex(const Mutex&) = delete;
+    Mutex& operator=(const Mutex&) = delete;
+
+    void lock() {
+        stats_.acquisitions.add();
+        bool sampled = detail::sample();
+        if (mutex_.try_lock()) {
+            if (sampled) stats_.wait.record(0, kSampleEvery);
+        } else {
+            stats_.contended.add();
+            auto start = std::chrono::steady_clock::now();
+            mutex_.lock();
+            stats_.wait.record(detail::since(start));
+        }
+        held_since_ = sampled ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+    }
+
+    bool try_lock() {
+        if (!mutex_.try_lock()) return false;
+        stats_.acquisitions.add();
+        held_since_ = {};
+        return true;
+    }
+
+    void unlock() {
+        // Read before unlocking; the next owner overwrites it.
+        auto held_since = held_since_;
+        mutex_.unlock();
+        if (held_since != std::chrono::steady_clock::time_point{}) stats_.hold.record(detail::since(held_since));
+    }
+
+private:
+    std::mutex mutex_;
+    LockStats& stats_;
+    std::chrono::steady_clock::time_point held_since_{}; // set only for sampled acquisitions
+};
+
+class QueueStats {
+public:
+    using Ticket = std::chrono::steady_clock::time_point;
+
+    explicit QueueStats(const std::string& name) : counters_(detail::Directory::instance().queue(name)) {}
+
+    // Call when an item is queued; pass the ticket to started().
+    Ticket enqueued() {
+        counters_.depth.add();
+        int64_t depth = counters_.depth.value();
+        counters_.depth_samples.record(static_cast<uint64_t>(depth > 0 ? depth : 0));
+        int64_t max = counters_.max_depth.load(std::memory_order_relaxed);
+        while (depth > max && !counters_.max_depth.compare_exchange_weak(max, depth, std::memory_order_relaxed)) {}
+        return std::chrono::steady_clock::now();
+    }
+
+    // Marks the item as picked up by a worker until the guard is destroyed.
+    class Running {
+    public:
+        explicit Running(QueueCounters& counters) : counters_(counters) { counters_.busy.add(); }
+        Running(const Running&) = delete;
+        Running& operator=(const Running&) = delete;
+        ~Running() { counters_.busy.sub(); }
+
+    private:
+        QueueCounters& counters_;
+    };
+
+    // Takes back an enqueued() whose item never made it into the queue.
+    void cancelled(Ticket) { counters_.depth.sub(); }
+
+    Running started(Ticket ticket) {
+        counters_.depth.sub();
+        counters_.wait.record(detail::since(ticket));
+        return Running(counters_);
+    }
+
+private:
+    QueueCounters& counters_;
+};
+
+// Posts `f` to an executor (e.g. boost::asio::thread_pool), accounting the
+// item against `stats`.
+template <typename Executor, typename F>
+void post(Executor& executor, QueueStats& stats, F&& f) {
+    auto ticket = stats.enqueued();
+    boost::asio::post(executor, [&stats, ticket, f = std::forward<F>(f)]() mutable {
+        auto running = stats.started(ticket);
+        f();
+    });
+}
+
+// One row of the /debug/contention dump. Times are in nanoseconds; for
+// queues, `acquisitions` counts items and `contended` is unused.
+struct Summary {
+    std::string kind; // "lock" or "queue"
+    std::string name;
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0;
+    uint64_t wait_p50 = 0, wait_p99 = 0, wait_max = 0;
+    uint64_t hold_p50 = 0, hold_p99 = 0; // locks only
+    uint64_t depth_p50 = 0, depth_p99 = 0, depth_max = 0; // queues only
+};
+
+inline std::vector<Summary> summary() {
+    std::vector<Summary> rows;
+    detail::Directory::instance().for_each(
+        [&](const std::string& name, const LockStats& s) {
+            Summary row;
+            row.kind = "lock";
+            row.name = name;
+            row.acquisitions = s.acquisitions.value();
+            row.contended = s.contended.value();
+            row.wait_p50 = s.wait.quantile(0.5);
+            row.wait_p99 = s.wait.quantile(0.99);
+            row.wait_max = s.wait.quantile(1.0);
+            row.hold_p50 = s.hold.quantile(0.5);
+            row.hold_p99 = s.hold.quantile(0.99);
+            rows.push_back(std::move(row));
+        },
+        [&](const std::string& name, const QueueCounters& q) {
+            Summary row;
+            row.kind = "queue";
+            row.name = name;
+            row.acquisitions = q.wait.count();
+            row.wait_p50 = q.wait.quantile(0.5);
+            row.wait_p99 = q.wait.quantile(0.99);
+            row.wait_max = q.wait.quantile(1.0);
+            // Bucket bounds round up; the exact maximum caps them.
+            row.depth_max = static_cast<uint64_t>(q.max_depth.load(std::memory_order_relaxed));
+            row.depth_p50 = std::min(q.depth_samples.quantile(0.5), row.depth_max);
+            row.depth_p99 = std::min(q.depth_samples.quantile(0.99), row.depth_max);
+            rows.push_back(std::move(row));
+        });
+    return rows;
+}
+
+} // namespace contention
@@ -0,0 +1,135 @@
+#pragma once
+
+// Streaming JSON writer that appends straight into a caller-owned buffer
+// (usually res.body()). No DOM is built: keys and values are escaped and
+// copied once, and numbers are formatted with std::to_chars.
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Appends a number formatted with std::to_chars. Doubles use the shortest
+// round-trip form unless a fixed precision is given (precision 6 matches the
+// "%f" output of std::to_string).
+inline void append_number(std::string& out, long long value) {
+    char buf[24];
+    auto r = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, r.ptr);
+}
+
+inline void append_number(std::string& out, unsigned long long value) {
+    char buf[24];
+    auto r = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, r.ptr);
+}
+
+inline void append_number(std::string& out, double value, int precision = -1) {
+    char buf[64];
+    auto r = precision < 0
+        ? std::to_chars(buf, buf + sizeof(buf), value)
+        : std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::fixed, precision);
+    if (r.ec != std::errc()) {
+        out += std::to_string(value);
+        return;
+    }
+    out.append(buf, r.ptr);
+}
+
+class JsonWriter {
+public:
+    explicit JsonWriter(std::string& out) : out_(out) {}
+
+    JsonWriter& begin_object() { open('{'); return *this; }
+    JsonWriter& end_object() { close('}'); return *this; }
+    JsonWriter& begin_array() { open('['); return *this; }
+    JsonWriter& end_array() { close(']'); return *this; }
+
+    JsonWriter& key(std::string_view k) {
+        separator();
+        write_string(k);
+        out_ += ':';
+        after_key_ = true;
+        return *this;
+    }
+
+    JsonWriter& value(std::string_view v) { separator(); write_string(v); return *this; }
+    JsonWriter& value(const char* v) { return value(std::string_view(v)); }
+    JsonWriter& value(bool v) { separator(); out_ += v ? "true" : "false"; return *this; }
+    JsonWriter& value(int v) { return value(static_cast<long long>(v)); }
+    JsonWriter& value(long v) { return value(static_cast<long long>(v)); }
+    JsonWriter& value(long long v) { separator(); append_number(out_, v); return *this; }
+    JsonWriter& value(unsigned v) { return value(static_cast<unsigned long long>(v)); }
+    JsonWriter& value(unsigned long v) { return value(static_cast<unsigned long long>(v)); }
+    JsonWriter& value(unsigned long long v) { separator(); append_number(out_, v); return *this; }
+    JsonWriter& value(double v) {
+        separator();
+        if (std::isfinite(v)) append_number(out_, v);
+        else out_ += "null";
+        return *this;
+    }
+    JsonWriter& null() { separator(); out_ += "null"; return *this; }
+
+    template <typename T>
+    JsonWriter& field(std::string_view k, const T& v) { key(k); return value(v); }
+
+    // Appends `s` as a quoted JSON string; runs without escapes are copied in
+    // one go.
+    static void append_string(std::string& out, std::string_view s) {
+        out += '"';
+        size_t run = 0;
+        for (size_t i = 0; i < s.size(); ++i) {
+            unsigned char c = static_cast<unsigned char>(s[i]);
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+            out.append(s.data() + run, i - run);
+            run = i + 1;
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                default: {
+                    static const char hex[] = "0123456789abcdef";
+                    char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                    out.append(esc, sizeof(esc));
+                }
+            }
+        }
+        out.append(s.data() + run, s.size() - run);
+        out += '"';
+    }
+
+private:
+    void open(char c) {
+        separator();
+        out_ += c;
+        ++depth_;
+        first_ |= uint64_t(1) << (depth_ & 63);
+    }
+
+    void close(char c) {
+        out_ += c;
+        --depth_;
+    }
+
+    void separator() {
+        if (after_key_) {
+            after_key_ = false;
+            return;
+        }
+        uint64_t bit = uint64_t(1) << (depth_ & 63);
+        if (first_ & bit) first_ &= ~bit;
+        else if (depth_ > 0) out_ += ',';
+    }
+
+    void write_string(std::string_view s) { append_string(out_, s); }
+
+    std::string& out_;
+    uint64_t first_ = 0;
+    unsigned depth_ = 0;
+    bool after_key_ = false;
+};
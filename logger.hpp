@@ -0,0 +1,376 @@
+#pragma once
+
+// Asynchronous leveled logger.
+//
+//     LOG_INFO << "Listening on port " << port;
+//     LOG_DEBUG << "Request body: " << logger::redacted_form(body);
+//
+// A log line is formatted into a fixed buffer on the caller's stack and
+// pushed onto a single-producer ring owned by the calling thread; no locks,
+// no allocation, no syscalls. A background thread drains every ring in
+// batches and writes them to a file or stdout. If a ring is full the line is
+// dropped and counted rather than blocking the request.
+//
+// Levels below LOG_MIN_LEVEL (compile time, default: info) compile to
+// nothing; set_level() raises the threshold further at run time.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 1
+#endif
+
+namespace logger {
+
+enum class Level : int { debug = 0, info = 1, warn = 2, error = 3 };
+
+constexpr Level kMinLevel = static_cast<Level>(LOG_MIN_LEVEL);
+
+inline const char* level_name(Level level) {
+    switch (level) {
+        case Level::debug: return "DEBUG";
+        case Level::info: return "INFO ";
+        case Level::warn: return "WARN ";
+        case Level::error: return "ERROR";
+    }
+    return "?    ";
+}
+
+// Parses "debug", "info", "warn" or "error".
+inline bool parse_level(std::string_view name, Level& level) {
+    if (name == "debug") level = Level::debug;
+    else if (name == "info") level = Level::info;
+    else if (name == "warn") level = Level::warn;
+    else if (name == "error") level = Level::error;
+    else return false;
+    return true;
+}
+
+namespace detail {
+
+constexpr size_t kMessageSize = 240;
+constexpr size_t kRingSize = 256; // records per thread, power of two
+
+struct Record {
+    int64_t time_us;
+    uint32_t thread;
+    Level level;
+    uint16_t length;
+    char text[kMessageSize];
+};
+
+// Single-producer/single-consumer ring. The owning thread pushes, the
+// flusher pops. Once the owner exits the ring is marked retired, and after
+// its last record is written the flusher puts it on a free list for the next
+// thread that logs, so short-lived threads (one per HTTP connection) don't
+// each allocate one.
+struct Ring {
+    Ring() {} // user-provided, so make_unique leaves the slots unzeroed
+
+    bool push(const Record& record) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == kRingSize) return false;
+        slots_[head & (kRingSize - 1)] = record;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <typename F>
+    size_t drain(F&& f) {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        uint64_t head = head_.load(std::memory_order_acquire);
+        for (uint64_t i = tail; i != head; ++i) f(slots_[i & (kRingSize - 1)]);
+        tail_.store(head, std::memory_order_release);
+        return static_cast<size_t>(head - tail);
+    }
+
+    uint32_t thread = 0; // set when a thread takes the ring
+    std::atomic<bool> retired{false};
+
+private:
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    std::array<Record, kRingSize> slots_;
+};
+
+class Sink {
+public:
+    static Sink& instance() {
+        static Sink sink;
+        return sink;
+    }
+
+    Ring* register_thread() {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        std::unique_ptr<Ring> ring;
+        if (!free_.empty()) {
+            ring = std::move(free_.back());
+            free_.pop_back();
+            ring->retired.store(false, std::memory_order_relaxed);
+        } else {
+            ring = std::make_unique<Ring>();
+        }
+        ring->thread = next_thread_++;
+        Ring* raw = ring.get();
+        rings_.push_back(std::move(ring));
+        return raw;
+    }
+
+    // Opens the destination ("" or "-" for stdout) and starts the flusher.
+    bool start(const std::string& path) {
+        if (path.empty() || path == "-") {
+            out_ = stdout;
+        } else {
+            out_ = std::fopen(path.c_str(), "a");
+            if (!out_) return false;
+            owns_out_ = true;
+        }
+        running_ = true;
+        flusher_ = std::thread([this] { run(); });
+        return true;
+    }
+
+    void wake() { wake_.notify_one(); }
+
+    std::atomic<int> level{static_cast<int>(kMinLevel)};
+    std::atomic<uint64_t> dropped{0};
+
+    ~Sink() {
+        if (flusher_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(wake_mutex_);
+                running_ = false;
+            }
+            wake_.notify_one();
+            flusher_.join();
+        }
+        if (owns_out_) std::fclose(out_);
+    }
+
+private:
+    Sink() = default;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        while (running_) {
+            wake_.wait_for(lock, std::chrono::milliseconds(50));
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
+        lock.unlock();
+        flush();
+    }
+
+    // Drains every ring into one buffer and writes it with a single fwrite.
+    // Rings whose thread has exited go to the free list once drained.
+    void flush() {
+        std::vector<Ring*> rings;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            rings.reserve(rings_.size());
+            for (auto& ring : rings_) rings.push_back(ring.get());
+        }
+
+        batch_.clear();
+        std::vector<Ring*> finished;
+        for (Ring* ring : rings) {
+            // Read the flag first: everything pushed before retiring is then
+            // guaranteed to be visible to this drain.
+            bool retired = ring->retired.load(std::memory_order_acquire);
+            ring->drain([this](const Record& record) { format(record); });
+            if (retired) finished.push_back(ring);
+        }
+        uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost) {
+            batch_ += "logger: dropped ";
+            batch_ += std::to_string(lost);
+            batch_ += " lines\n";
+        }
+        if (!batch_.empty()) {
+            std::fwrite(batch_.data(), 1, batch_.size(), out_);
+            std::fflush(out_);
+        }
+
+        if (!finished.empty()) {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            auto done = std::stable_partition(rings_.begin(), rings_.end(), [&](const std::unique_ptr<Ring>& ring) {
+                return std::find(finished.begin(), finished.end(), ring.get()) == finished.end();
+            });
+            std::move(done, rings_.end(), std::back_inserter(free_));
+            rings_.erase(done, rings_.end());
+        }
+    }
+
+    void format(const Record& record) {
+        std::time_t seconds = static_cast<std::time_t>(record.time_us / 1000000);
+        std::tm tm{};
+        gmtime_r(&seconds, &tm);
+        char stamp[40];
+        size_t n = std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        std::snprintf(stamp + n, sizeof(stamp) - n, ".%06dZ", static_cast<int>(record.time_us % 1000000));
+        batch_ += stamp;
+        batch_ += ' ';
+        batch_ += level_name(record.level);
+        batch_ += " [";
+        batch_ += std::to_string(record.thread);
+        batch_ += "] ";
+        batch_.append(record.text, record.length);
+        batch_ += '\n';
+    }
+
+    std::mutex rings_mutex_;
+    std::vector<std::unique_ptr<Ring>> rings_;
+    std::vector<std::unique_ptr<Ring>> free_; // drained, their threads gone
+    uint32_t next_thread_ = 1;
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool running_ = false;
+    std::thread flusher_;
+
+    std::FILE* out_ = stdout;
+    bool owns_out_ = false;
+    std::string batch_;
+};
+
+// The calling thread's ring, registered on first use and retired when the
+// thread exits.
+struct ThreadRing {
+    Ring* ring = Sink::instance().register_thread();
+    ~ThreadRing() { ring->retired.store(true, std::memory_order_release); }
+};
+
+inline Ring& thread_ring() {
+    thread_local ThreadRing local;
+    return *local.ring;
+}
+
+} // namespace detail
+
+inline bool start(const std::string& path) { return detail::Sink::instance().start(path); }
+
+inline void set_level(Level level) {
+    detail::Sink::instance().level.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+inline bool enabled(Level level) {
+    return level >= kMinLevel
+        && static_cast<int>(level) >= detail::Sink::instance().level.load(std::memory_order_relaxed);
+}
+
+// A form body ("a=1&password=secret") with the values of credential fields
+// masked. Only formatted if the line is actually logged.
+struct RedactedForm {
+    std::string_view body;
+};
+
+inline RedactedForm redacted_form(std::string_view body) { return {body}; }
+
+// One log line. Builds the message in place and hands it to the thread's
+// ring on destruction.
+class Line {
+public:
+    explicit Line(Level level) {
+        record_.level = level;
+        record_.length = 0;
+    }
+
+    Line(const Line&) = delete;
+    Line& operator=(const Line&) = delete;
+
+    ~Line() {
+        detail::Ring& ring = detail::thread_ring();
+        record_.thread = ring.thread;
+        record_.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        if (!ring.push(record_)) {
+            detail::Sink::instance().dropped.fetch_add(1, std::memory_order_relaxed);
+        } else if (record_.level >= Level::error) {
+            detail::Sink::instance().wake();
+        }
+    }
+
+    Line& operator<<(std::string_view s) {
+        size_t room = detail::kMessageSize - record_.length;
+        if (s.size() > room) {
+            // Truncate, marking the cut with "..."
+            append_raw(s.substr(0, room >= 3 ? room - 3 : 0));
+            append_raw(std::string_view("...").substr(0, std::min<size_t>(3, detail::kMessageSize - record_.length)));
+            return *this;
+        }
+        append_raw(s);
+        return *this;
+    }
+    Line& operator<<(const char* s) { return *this << std::string_view(s ? s : "(null)"); }
+    Line& operator<<(const std::string& s) { return *this << std::string_view(s); }
+    Line& operator<<(char c) { return *this << std::string_view(&c, 1); }
+    Line& operator<<(bool b) { return *this << (b ? "true" : "false"); }
+
+    template <typename T, typename std::enable_if<std::is_integral<T>::value || std::is_floating_point<T>::value, int>::type = 0>
+    Line& operator<<(T value) {
+        char buf[32];
+        auto r = std::to_chars(buf, buf + sizeof(buf), value);
+        return *this << std::string_view(buf, static_cast<size_t>(r.ptr - buf));
+    }
+
+    Line& operator<<(RedactedForm form) {
+        std::string_view body = form.body;
+        bool first = true;
+        while (!body.empty()) {
+            size_t amp = body.find('&');
+            std::string_view pair = body.substr(0, amp);
+            body = amp == std::string_view::npos ? std::string_view() : body.substr(amp + 1);
+            if (!first) *this << '&';
+            first = false;
+            size_t eq = pair.find('=');
+            std::string_view key = pair.substr(0, eq);
+            if (eq != std::string_view::npos && (key == "password" || key == "token")) {
+                *this << key << "=***";
+            } else {
+                *this << pair;
+            }
+        }
+        return *this;
+    }
+
+    // Anything else with a string-like view (e.g. beast::string_view).
+    template <typename T, typename std::enable_if<std::is_convertible<decltype(std::declval<const T&>().data()), const char*>::value, int>::type = 0>
+    Line& operator<<(const T& s) {
+        return *this << std::string_view(s.data(), s.size());
+    }
+
+private:
+    void append_raw(std::string_view s) {
+        std::copy(s.begin(), s.end(), record_.text + record_.length);
+        record_.length = static_cast<uint16_t>(record_.length + s.size());
+    }
+
+    detail::Record record_;
+};
+
+} // namespace logger
+
+#define LOG_AT(level) \
+    if (!::logger::enabled(level)) {} else ::logger::Line(level)
+
+#define LOG_DEBUG LOG_AT(::logger::Level::debug)
+#define LOG_INFO LOG_AT(::logger::Level::info)
+#define LOG_WARN LOG_AT(::logger::Level::warn)
+#define LOG_ERROR LOG_AT(::logger::Level::error)
@@ -0,0 +1,171 @@
+#pragma once
+
+// Hash trees over replicated tables, for checking that central holds what a
+// region has without shipping the rows (anti-entropy).
+//
+// Keys are bucketed by primary key: a leaf covers 2^kLeafBits consecutive
+// keys, and each level above groups 2^kFanoutBits nodes of the one below.
+// A node's hash is the XOR of the hashes of every row under it, so a write
+// updates one node per level (O(kLevels)) without rehashing siblings, and
+// only nodes with rows under them are stored.
+//
+// Both sides hash a row from its syncproto::Values, so a region and central
+// agree on a row exactly when they agree on every replicated column.
+// Comparing two trees walks down from the root, asking only for the
+// children of nodes that differ: one round trip per level, then the rows of
+// the differing leaves.
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "sync_protocol.hpp"
+
+namespace merkle {
+
+constexpr unsigned kLeafBits = 6;   // 64 keys per leaf
+constexpr unsigned kFanoutBits = 4; // 16 children per node
+constexpr unsigned kLevels = 8;     // levels 0 (leaves) .. 7
+constexpr unsigned kRoot = kLevels; // the single node above level 7
+
+namespace detail {
+
+constexpr uint64_t kFnvOffset = 0xcbf29ce484222325ull;
+constexpr uint64_t kFnvPrime = 0x100000001b3ull;
+
+inline void mix(uint64_t& h, const void* data, size_t size) {
+    const auto* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= kFnvPrime;
+    }
+}
+
+inline void mix_u64(uint64_t& h, uint64_t v) {
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; ++i) bytes[i] = static_cast<unsigned char>(v >> (8 * i));
+    mix(h, bytes, sizeof(bytes));
+}
+
+// splitmix64's finalizer, so XOR-combined hashes don't share FNV's weak
+// low bits.
+inline uint64_t finish(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+} // namespace detail
+
+// Hash of a row image (all of the table's columns, key included).
+inline uint64_t row_hash(const syncproto::Table& table, const syncproto::Value* values) {
+    uint64_t h = detail::kFnvOffset;
+    detail::mix_u64(h, table.id);
+    for (size_t i = 0; i < table.column_count; ++i) {
+        const syncproto::Value& v = values[i];
+        unsigned char tag = v.null ? 0 : 1;
+        detail::mix(h, &tag, 1);
+        if (v.null) continue;
+        switch (table.columns[i].type) {
+            case syncproto::ColumnType::integer: detail::mix_u64(h, static_cast<uint64_t>(v.integer)); break;
+            case syncproto::ColumnType::real: {
+                double d = v.real == 0 ? 0.0 : v.real; // -0.0 and 0.0 compare equal
+                uint64_t bits;
+                std::memcpy(&bits, &d, sizeof(bits));
+                detail::mix_u64(h, bits);
+                break;
+            }
+            case syncproto::ColumnType::text:
+                detail::mix_u64(h, v.text.size());
+                detail::mix(h, v.text.data(), v.text.size());
+                break;
+        }
+    }
+    return detail::finish(h);
+}
+
+// (child index, hash) pairs; for a leaf, (primary key, row hash).
+using Children = std::vector<std::pair<uint64_t, uint64_t>>;
+
+class Tree {
+public:
+    // Records the row's current hash, or its removal (nullopt).
+    void set(int64_t key, std::optional<uint64_t> hash) {
+        uint64_t delta = 0;
+        auto it = rows_.find(key);
+        if (it != rows_.end()) {
+            delta ^= it->second;
+            if (hash) {
+                it->second = *hash;
+            } else {
+                rows_.erase(it);
+            }
+        } else if (hash) {
+            rows_.emplace(key, *hash);
+        }
+        if (hash) delta ^= *hash;
+        if (delta == 0) return;
+
+        uint64_t index = static_cast<uint64_t>(key) >> kLeafBits;
+        for (unsigned level = 0; level < kLevels; ++level, index >>= kFanoutBits) {
+            auto& node = nodes_[level];
+            auto n = node.find(index);
+            if (n == node.end()) {
+                node.emplace(index, delta);
+            } else if ((n->second ^= delta) == 0) {
+                node.erase(n);
+            }
+        }
+    }
+
+    // The children of node `index` at `level` (kRoot for the root, index 0).
+    Children children(unsigned level, uint64_t index) const {
+        Children out;
+        if (level == kRoot) {
+            out.assign(nodes_[kLevels - 1].begin(), nodes_[kLevels - 1].end());
+        } else if (level == 0) {
+            uint64_t first = index << kLeafBits;
+            for (uint64_t key = first; key < first + (1u << kLeafBits); ++key) {
+                auto it = rows_.find(static_cast<int64_t>(key));
+                if (it != rows_.end()) out.emplace_back(key, it->second);
+            }
+        } else if (level < kLevels) {
+            const auto& below = nodes_[level - 1];
+            uint64_t first = index << kFanoutBits;
+            for (uint64_t child = first; child < first + (1u << kFanoutBits); ++child) {
+                auto it = below.find(child);
+                if (it != below.end()) out.emplace_back(child, it->second);
+            }
+        }
+        return out;
+    }
+
+    bool contains(int64_t key) const { return rows_.count(key) != 0; }
+    size_t size() const { return rows_.size(); }
+
+private:
+    std::unordered_map<int64_t, uint64_t> rows_;
+    std::array<std::unordered_map<uint64_t, uint64_t>, kLevels> nodes_;
+};
+
+// Indexes present on only one side or with different hashes, in no
+// particular order.
+inline std::vector<uint64_t> differing(const Children& ours, const Children& theirs) {
+    std::unordered_map<uint64_t, uint64_t> mine(ours.begin(), ours.end());
+    std::vector<uint64_t> out;
+    for (const auto& [index, hash] : theirs) {
+        auto it = mine.find(index);
+        if (it == mine.end() || it->second != hash) out.push_back(index);
+        if (it != mine.end()) mine.erase(it);
+    }
+    for (const auto& [index, hash] : mine) out.push_back(index);
+    return out;
+}
+
+} // namespace merkle
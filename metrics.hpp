@@ -0,0 +1,332 @@
+#pragma once
+
+// Process-wide metrics in the Prometheus text exposition format.
+//
+//     static metrics::Counter& accepted = metrics::Registry::global()
+//         .counter("regional_connections_accepted_total", "Accepted connections");
+//     accepted.add();
+//
+// Updates are relaxed atomic adds and never take a lock. Counters are
+// sharded per thread so busy threads don't fight over one cache line.
+// Histograms use log-linear buckets (8 per power of two, so any value is
+// within 12.5% of its bucket bound) and are folded into the fixed Prometheus
+// "le" boundaries only when scraped.
+//
+// Labelled metrics live in a Family; looking up a label set takes a shared
+// lock, so hot paths should keep the returned reference when the labels are
+// fixed.
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace metrics {
+
+namespace detail {
+
+constexpr size_t kShards = 8;
+
+inline size_t thread_shard() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return shard;
+}
+
+struct alignas(64) PaddedCounter {
+    std::atomic<uint64_t> value{0};
+};
+
+inline void append_double(std::string& out, double v) {
+    char buf[32];
+    int n = std::snprintf(buf, sizeof(buf), "%.9g", v);
+    out.append(buf, static_cast<size_t>(n));
+}
+
+} // namespace detail
+
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        shards_[detail::thread_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const auto& shard : shards_) total += shard.value.load(std::memory_order_relaxed);
+        return total;
+    }
+
+private:
+    std::array<detail::PaddedCounter, detail::kShards> shards_;
+};
+
+class Gauge {
+public:
+    void add(int64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    void sub(int64_t n = 1) { value_.fetch_sub(n, std::memory_order_relaxed); }
+    void set(int64_t n) { value_.store(n, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+// Log-linear histogram of non-negative integer samples (nanoseconds for the
+// latency histograms here).
+class Histogram {
+public:
+    static constexpr size_t kSubBuckets = 8;
+    static constexpr size_t kBuckets = 62 * kSubBuckets;
+
+    // `weight` > 1 stands for that many samples of `value`, for callers
+    // that record only one in `weight` of a kind of event.
+    void record(uint64_t value, uint64_t weight = 1) {
+        buckets_[bucket_index(value)].fetch_add(weight, std::memory_order_relaxed);
+        count_.add(weight);
+        sum_.add(value * weight);
+    }
+
+    uint64_t count() const { return count_.value(); }
+    uint64_t sum() const { return sum_.value(); }
+
+    // Number of samples whose bucket lies entirely at or below `bound`.
+    uint64_t count_at_or_below(uint64_t bound) const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < kBuckets && bucket_upper(i) <= bound; ++i) {
+            total += buckets_[i].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // Upper bound of the bucket holding the q-th quantile (0 <= q <= 1), so
+    // within 12.5% above the true value; 0 when empty.
+    uint64_t quantile(double q) const {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1, seen = 0;
+        size_t last = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            uint64_t n = buckets_[i].load(std::memory_order_relaxed);
+            if (n == 0) continue;
+            seen += n;
+            last = i;
+            if (seen >= rank) break;
+        }
+        return bucket_upper(last);
+    }
+
+    static size_t bucket_index(uint64_t v) {
+        if (v < kSubBuckets) return static_cast<size_t>(v);
+        unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(v));
+        size_t sub = static_cast<size_t>(v >> (exponent - 3)) & (kSubBuckets - 1);
+        size_t index = (exponent - 2) * kSubBuckets + sub;
+        return index < kBuckets ? index : kBuckets - 1;
+    }
+
+    static uint64_t bucket_upper(size_t index) {
+        if (index < kSubBuckets) return index;
+        unsigned exponent = static_cast<unsigned>(index / kSubBuckets) + 2;
+        uint64_t lower = static_cast<uint64_t>(kSubBuckets + index % kSubBuckets) << (exponent - 3);
+        return lower + (uint64_t(1) << (exponent - 3)) - 1;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+    Counter count_;
+    Counter sum_;
+};
+
+// Measures the time from construction to destruction into a histogram, in
+// nanoseconds.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        histogram_.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count()));
+    }
+
+private:
+    Histogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Renders `value` as a quoted label value, escaping \, " and newlines.
+inline std::string label(std::string_view name, std::string_view value) {
+    std::string out(name);
+    out += "=\"";
+    for (char c : value) {
+        if (c == '\\' || c == '"') out += '\\';
+        if (c == '\n') { out += "\\n"; continue; }
+        out += c;
+    }
+    out += '"';
+    return out;
+}
+
+// A metric with a set of label values, keyed by the rendered label string
+// (e.g. route="/login",status="200"). Members are never removed, so the
+// returned references stay valid.
+template <typename Metric>
+class Family {
+public:
+    Metric& with(const std::string& labels) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            auto it = members_.find(labels);
+            if (it != members_.end()) return *it->second;
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        auto& slot = members_[labels];
+        if (!slot) slot = std::make_unique<Metric>();
+        return *slot;
+    }
+
+    template <typename F>
+    void for_each(F&& f) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        for (const auto& [labels, metric] : members_) f(labels, *metric);
+    }
+
+private:
+    mutable std::shared_mutex mutex_;
+    std::map<std::string, std::unique_ptr<Metric>> members_;
+};
+
+class Registry {
+public:
+    static Registry& global() {
+        static Registry registry;
+        return registry;
+    }
+
+    Counter& counter(const std::string& name, const std::string& help) {
+        return counter_family(name, help).with("");
+    }
+    Gauge& gauge(const std::string& name, const std::string& help) {
+        return gauge_family(name, help).with("");
+    }
+    // `scale` converts recorded units to the exported unit (1e-9 for
+    // nanoseconds exported as seconds).
+    Histogram& histogram(const std::string& name, const std::string& help, double scale = 1e-9) {
+        return histogram_family(name, help, scale).with("");
+    }
+
+    Family<Counter>& counter_family(const std::string& name, const std::string& help) {
+        return entry(name, help, Type::counter).counters;
+    }
+    Family<Gauge>& gauge_family(const std::string& name, const std::string& help) {
+        return entry(name, help, Type::gauge).gauges;
+    }
+    Family<Histogram>& histogram_family(const std::string& name, const std::string& help, double scale = 1e-9) {
+        Entry& e = entry(name, help, Type::histogram);
+        e.scale = scale;
+        return e.histograms;
+    }
+
+    // Adds a callback that appends its own samples (with # HELP/# TYPE lines)
+    // at scrape time, for values that are read rather than counted.
+    void add_collector(std::function<void(std::string&)> collector) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        collectors_.push_back(std::move(collector));
+    }
+
+    // Renders everything in the Prometheus text format.
+    void render(std::string& out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& [name, e] : entries_) {
+            out += "# HELP " + name + " " + e->help + "\n";
+            switch (e->type) {
+                case Type::counter:
+                    out += "# TYPE " + name + " counter\n";
+                    e->counters.for_each([&](const std::string& labels, const Counter& c) {
+                        sample(out, name, labels, static_cast<double>(c.value()));
+                    });
+                    break;
+                case Type::gauge:
+                    out += "# TYPE " + name + " gauge\n";
+                    e->gauges.for_each([&](const std::string& labels, const Gauge& g) {
+                        sample(out, name, labels, static_cast<double>(g.value()));
+                    });
+                    break;
+                case Type::histogram:
+                    out += "# TYPE " + name + " histogram\n";
+                    e->histograms.for_each([&](const std::string& labels, const Histogram& h) {
+                        render_histogram(out, name, labels, h, e->scale);
+                    });
+                    break;
+            }
+        }
+        for (const auto& collector : collectors_) collector(out);
+    }
+
+    static void sample(std::string& out, const std::string& name, const std::string& labels, double value) {
+        out += name;
+        if (!labels.empty()) {
+            out += '{';
+            out += labels;
+            out += '}';
+        }
+        out += ' ';
+        detail::append_double(out, value);
+        out += '\n';
+    }
+
+private:
+    enum class Type { counter, gauge, histogram };
+
+    struct Entry {
+        std::string help;
+        Type type;
+        double scale = 1.0;
+        Family<Counter> counters;
+        Family<Gauge> gauges;
+        Family<Histogram> histograms;
+    };
+
+    Entry& entry(const std::string& name, const std::string& help, Type type) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& slot = entries_[name];
+        if (!slot) {
+            slot = std::make_unique<Entry>();
+            slot->help = help;
+            slot->type = type;
+        }
+        return *slot;
+    }
+
+    static void render_histogram(std::string& out, const std::string& name, const std::string& labels,
+                                 const Histogram& h, double scale) {
+        // Latency boundaries in seconds, 100us .. 10s.
+        static const double kBounds[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                         0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+        std::string prefix = labels.empty() ? std::string() : labels + ",";
+        for (double bound : kBounds) {
+            std::string le = prefix + "le=\"";
+            detail::append_double(le, bound);
+            le += '"';
+            sample(out, name + "_bucket", le, static_cast<double>(h.count_at_or_below(static_cast<uint64_t>(bound / scale))));
+        }
+        uint64_t count = h.count();
+        sample(out, name + "_bucket", prefix + "le=\"+Inf\"", static_cast<double>(count));
+        sample(out, name + "_sum", labels, static_cast<double>(h.sum()) * scale);
+        sample(out, name + "_count", labels, static_cast<double>(count));
+    }
+
+    mutable std::mutex mutex_;
+    std::map<std::string, std::unique_ptr<Entry>> entries_;
+    std::vector<std::function<void(std::string&)>> collectors_;
+};
+
+} // namespace metrics
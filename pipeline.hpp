@@ -0,0 +1,137 @@
+#pragma once
+
+// Building blocks for staged pipelines: a bounded lock-free queue between
+// stages and a doorbell that lets a consumer sleep while its queue is empty.
+//
+//     pipeline::BoundedQueue<std::unique_ptr<Item>> queue(64);
+//     pipeline::Doorbell bell;
+//
+//     // producer                            // consumer
+//     if (queue.try_push(item)) bell.ring();  for (;;) {
+//     else /* full: back off */                  if (queue.try_pop(item)) { ...; continue; }
+//                                                bell.wait([&] { return !queue.empty(); });
+//                                            }
+//
+// A full queue is never waited on inside the queue: try_push fails and the
+// producer decides how to back off, which is how backpressure reaches the
+// network stage (it stops reading its socket).
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace pipeline {
+
+// Multi-producer multi-consumer ring of fixed capacity (rounded up to a power
+// of two). Each cell carries a sequence number saying whose turn it is, so
+// push and pop are one CAS on their own index and never take a lock
+// (D. Vyukov's bounded MPMC queue).
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        mask_ = size - 1;
+        cells_.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i) cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // Moves `item` in and returns true, or returns false (leaving `item`
+    // untouched) when the queue is full.
+    bool try_push(T& item) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Moves the oldest item out, or returns false when the queue is empty.
+    bool try_pop(T& item) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(cell->value);
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate while other threads are pushing or popping.
+    size_t size() const {
+        size_t tail = tail_.load(std::memory_order_acquire), head = head_.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) std::atomic<size_t> head_{0};
+};
+
+// Wakes a consumer sleeping on an empty queue. Producers only take the mutex
+// when a consumer is actually asleep, so a busy pipeline never touches it.
+class Doorbell {
+public:
+    void ring() {
+        if (sleepers_.load() == 0) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        cv_.notify_all();
+    }
+
+    // Sleeps until `ready()` holds. The sleeper count is published before
+    // `ready()` is checked and producers check it after pushing, so a wakeup
+    // can't slip in between; the timeout is only a backstop.
+    template <typename Ready>
+    void wait(Ready&& ready) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        sleepers_.fetch_add(1);
+        while (!ready()) cv_.wait_for(lock, std::chrono::milliseconds(100));
+        sleepers_.fetch_sub(1);
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic<int> sleepers_{0};
+};
+
+} // namespace pipeline
@@ -1,6 +1,5 @@
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
-#include <boost/json/src.hpp>
 #include <sqlite3.h>
 #include <iostream>
 #include <string>
@@ -8,15 +7,77 @@
 #include <utility>
 #include <random>
 #include <sstream>
+#include <stdexcept>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+
+#include "binary_protocol.hpp"
+#include "contention.hpp"
+#include "json_writer.hpp"
+#include "logger.hpp"
+#include "merkle.hpp"
+#include "metrics.hpp"
+#include "row_writer.hpp"
+#include "sql_profiler.hpp"
+#include "sql_statement.hpp"
+#include "sync_protocol.hpp"
+#include "tracing.hpp"
+#include "url_decode.hpp"
 
 namespace beast = boost::beast;
 namespace http = beast::http;
 using tcp = boost::asio::ip::tcp;
-namespace json = boost::json;
 
 // SQLite database handler
 sqlite3* db;
 
+enum class ResponseFormat { text, json };
+
+// Picks the representation from the Accept header. The choice rides on the
+// response's Content-Type so handlers can see it without another parameter;
+// when the client doesn't ask, it stays unset and the handler's native format
+// wins.
+void negotiate_format(const http::request<http::string_body>& req, http::response<http::string_body>& res) {
+    beast::string_view accept = req[http::field::accept];
+    if (accept.find("application/json") != beast::string_view::npos) {
+        res.set(http::field::content_type, "application/json");
+    } else if (accept.find("text/plain") != beast::string_view::npos) {
+        res.set(http::field::content_type, "text/plain");
+    }
+}
+
+ResponseFormat response_format(http::response<http::string_body>& res, ResponseFormat native = ResponseFormat::text) {
+    beast::string_view content_type = res[http::field::content_type];
+    if (content_type.empty()) {
+        res.set(http::field::content_type, native == ResponseFormat::json ? "application/json" : "text/plain");
+        return native;
+    }
+    return content_type == "application/json" ? ResponseFormat::json : ResponseFormat::text;
+}
+
+// Sets the status and a message body: the plain message for text clients, or
+// {"success":...,"message"|"error":...} for JSON clients.
+void reply(http::response<http::string_body>& res, http::status status, beast::string_view message) {
+    res.result(status);
+    std::string& body = res.body();
+    body.clear();
+    if (response_format(res) == ResponseFormat::json) {
+        bool success = static_cast<unsigned>(status) < 400;
+        body.reserve(message.size() + 32);
+        JsonWriter(body).begin_object()
+            .field("success", success)
+            .field(success ? "message" : "error", std::string_view(message.data(), message.size()))
+            .end_object();
+    } else {
+        body.assign(message.data(), message.size());
+    }
+}
+
 // Generate a random string as a token
 std::string generate_token(size_t length) {
     static const char alphanum[] =
@@ -34,49 +95,40 @@ std::string generate_token(size_t length) {
     return token;
 }
 
-bool is_token_valid(const std::string& token) {
-    std::string sql = "SELECT user_id FROM Sessions WHERE auth_token = ?";
-    sqlite3_stmt* stmt;
-    
-    // Remove "Bearer " prefix if it exists
-    std::string clean_token = token;
-    if (clean_token.substr(0, 7) == "Bearer ") {
-        clean_token = clean_token.substr(7);
+// Remove a "Bearer " prefix from an Authorization header value
+std::string bearer_token(beast::string_view header) {
+    std::string token(header);
+    const std::string bearer_prefix = "Bearer ";
+    if (token.compare(0, bearer_prefix.size(), bearer_prefix) == 0) {
+        token.erase(0, bearer_prefix.size());
     }
+    return token;
+}
 
-    // Prepare the SQL statement
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        std::cerr << "Error preparing token validation query: " << sqlite3_errmsg(db) << std::endl;
-        return false;
-    }
+// Statement parameter/column lists used by more than one handler
+using TokenParam = sql::Params<std::string_view>;
+using ServiceColumns = sql::Columns<int, std::string_view, double, int, std::string_view, std::string_view, int, double>;
 
-    // Bind the token to the query
-    if (sqlite3_bind_text(stmt, 1, clean_token.c_str(), -1, SQLITE_STATIC) != SQLITE_OK) {
-        std::cerr << "Error binding token: " << sqlite3_errmsg(db) << std::endl;
-        sqlite3_finalize(stmt);
-        return false;
-    }
+static sql::Statement<TokenParam, sql::Columns<int>> select_session_user{
+    "SELECT user_id FROM Sessions WHERE auth_token = ?"};
 
-    // Execute the query and check if a row was returned
-    int result = sqlite3_step(stmt);
-    bool valid = (result == SQLITE_ROW);
+static sql::Statement<TokenParam, sql::Columns<std::string>> select_user_type{
+    "SELECT user_type FROM Korisnici WHERE user_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)"};
 
-    // Debug output
-    if (result == SQLITE_DONE) {
-        std::cerr << "TEST!! No matching rows found" << std::endl;
-    } else if (result != SQLITE_ROW && result != SQLITE_DONE) {
-        std::cerr << "TEST!! Error executing query: " << sqlite3_errmsg(db) << std::endl;
+bool is_token_valid(const std::string& token) {
+    tracing::Span span("auth");
+    auto cursor = select_session_user.query(db, token);
+    if (!cursor) {
+        LOG_ERROR << "Error preparing token validation query: " << sqlite3_errmsg(db);
+        return false;
     }
 
-    // Finalize the statement
-    sqlite3_finalize(stmt);
-
-    // More debug output
-    if (valid) {
-        std::cerr << "TEST!! VALIDNO" << std::endl;
-    } else {
-        std::cerr << "TEST!! NIJE VALIDNO" << std::endl;
+    // Execute the query and check if a row was returned
+    bool valid = cursor.step();
+    if (!valid && !cursor.done()) {
+        LOG_ERROR << "Error executing token validation query: " << sqlite3_errmsg(db);
     }
+    LOG_DEBUG << "Token " << (valid ? "valid" : "not valid");
 
     return valid;
 }
@@ -84,83 +136,76 @@ bool is_token_valid(const std::string& token) {
 
 // Function to get user ID from token
 int get_user_id_by_token(const std::string& token) {
-    // Remove "Bearer " prefix if present
-    std::string clean_token = token;
-    const std::string bearer_prefix = "Bearer ";
-    if (clean_token.find(bearer_prefix) == 0) {
-        clean_token.erase(0, bearer_prefix.length());
-    }
-
-    std::string sql = "SELECT user_id FROM Sessions WHERE auth_token = ?";
-    sqlite3_stmt* stmt;
-    int user_id = -1; // Default to -1 if token is not valid or not found
-
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, clean_token.c_str(), -1, SQLITE_STATIC);
-
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            user_id = sqlite3_column_int(stmt, 0);
-        }
-
-        sqlite3_finalize(stmt);
-    } else {
-        std::cerr << "Error preparing query: " << sqlite3_errmsg(db) << std::endl;
-    }
-
-    return user_id;
+    tracing::Span span("auth");
+    auto cursor = select_session_user.query(db, token);
+    if (!cursor) {
+        LOG_ERROR << "Error preparing query: " << sqlite3_errmsg(db);
+        return -1;
+    }
+    auto row = cursor.next();
+    return row ? std::get<0>(*row) : -1; // -1 if token is not valid or not found
 }
 
 
+static sql::Statement<sql::Params<int>, sql::Columns<int>> select_service_seller{
+    "SELECT seller_id FROM Usluge WHERE service_id = ?"};
+
 int get_seller_id_by_service_id(int service_id) {
-    std::string sql = "SELECT seller_id FROM Usluge WHERE service_id = ?";
-    sqlite3_stmt* stmt;
-    int seller_id = -1;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_int(stmt, 1, service_id);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            seller_id = sqlite3_column_int(stmt, 0);
-        }
-        sqlite3_finalize(stmt);
-    } else {
-        std::cerr << "Error retrieving seller_id: " << sqlite3_errmsg(db) << std::endl;
+    auto cursor = select_service_seller.query(db, service_id);
+    if (!cursor) {
+        LOG_ERROR << "Error retrieving seller_id: " << sqlite3_errmsg(db);
+        return -1;
     }
-    return seller_id;
+    auto row = cursor.next();
+    return row ? std::get<0>(*row) : -1;
 }
 
 
 
+static sql::Statement<TokenParam, sql::Columns<std::string_view, std::string_view>> select_profile{
+    "SELECT username, email FROM Korisnici WHERE user_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)"};
+
 void handle_get_profile(const std::string& token, http::response<http::string_body>& res) {
-    if (is_token_valid(token)) {
-        std::string sql = "SELECT username, email FROM Korisnici WHERE user_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)";
-        sqlite3_stmt* stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, token.c_str(), -1, SQLITE_STATIC);
-            if (sqlite3_step(stmt) == SQLITE_ROW) {
-                json::object response_body;
-                response_body["username"] = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-                response_body["email"] = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-                
-                std::string response_str = json::serialize(response_body);
-                res.result(http::status::ok);
-                res.body() = response_str;
-            } else {
-                res.result(http::status::not_found);
-                res.body() = "Profile not found";
-            }
-            sqlite3_finalize(stmt);
+    if (!is_token_valid(token)) {
+        reply(res, http::status::unauthorized, "Invalid or missing token");
+        return;
+    }
+    auto cursor = select_profile.query(db, token);
+    if (!cursor) {
+        reply(res, http::status::internal_server_error, "Database query error: " + std::string(sqlite3_errmsg(db)));
+    } else if (auto row = cursor.next()) {
+        auto [username, email] = *row;
+        res.result(http::status::ok);
+        if (response_format(res, ResponseFormat::json) == ResponseFormat::json) {
+            JsonWriter(res.body()).begin_object()
+                .field("username", username)
+                .field("email", email)
+                .end_object();
         } else {
-            res.result(http::status::internal_server_error);
-            res.body() = "Database query error: " + std::string(sqlite3_errmsg(db));
+            res.body().append("Username: ").append(username).append("\nEmail: ").append(email).append("\n");
         }
     } else {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::not_found, "Profile not found");
     }
 }
 
 
 
 
+// Stored passwords starting with this are placeholders that can't be typed
+// in (see import_snapshot); the account can't log in until a new password
+// is set for it.
+constexpr const char* kPasswordResetPrefix = "!reset:";
+
+static sql::Statement<sql::Params<std::string_view, std::string_view>, sql::Columns<int, std::string>> select_login{
+    "SELECT user_id, user_type FROM Korisnici WHERE username = ? AND password = ?"};
+static sql::Statement<sql::Params<std::string_view, std::string_view>, sql::Columns<int>> select_reset_required{
+    "SELECT 1 FROM Korisnici WHERE username = ? AND substr(password, 1, length(?2)) = ?2"};
+static sql::Statement<sql::Params<int>, sql::Columns<>> delete_user_sessions{
+    "DELETE FROM Sessions WHERE user_id = ?"};
+static sql::Statement<sql::Params<int, std::string_view>, sql::Columns<>> insert_session{
+    "INSERT INTO Sessions (user_id, auth_token) VALUES (?, ?)"};
+
 // Handle login request
 void handle_login(const std::string& body, http::response<http::string_body>& res) {
     std::string username, password;
@@ -171,274 +216,163 @@ void handle_login(const std::string& body, http::response<http::string_body>& re
         auto end_pos = body.find('&', pos);
         username = body.substr(pos + 9, end_pos == std::string::npos ? body.size() - pos - 9 : end_pos - pos - 9);
     } else {
-        res.result(http::status::bad_request);
-        res.body() = "Username not found in request";
+        reply(res, http::status::bad_request, "Username not found in request");
         return;
     }
     pos = body.find("password=");
     if (pos != std::string::npos) {
         password = body.substr(pos + 9);
     } else {
-        res.result(http::status::bad_request);
-        res.body() = "Password not found in request";
+        reply(res, http::status::bad_request, "Password not found in request");
         return;
     }
-
-    // SQL query to fetch user ID and type
-    std::string sql = "SELECT user_id, user_type FROM Korisnici WHERE username = ? AND password = ?";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        std::cerr << "Error preparing query: " << sqlite3_errmsg(db) << std::endl;
-        res.result(http::status::internal_server_error);
-        res.body() = "Database query error";
+    if (password.empty() || password.rfind(kPasswordResetPrefix, 0) == 0) {
+        reply(res, http::status::bad_request, "Invalid password");
         return;
     }
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, password.c_str(), -1, SQLITE_STATIC);
-
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        int user_id = sqlite3_column_int(stmt, 0);
-        std::string user_type = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        std::string token = generate_token(32);
-
-        // Remove all existing sessions for this user
-        std::string delete_sql = "DELETE FROM Sessions WHERE user_id = ?";
-        sqlite3_stmt* delete_stmt;
-        if (sqlite3_prepare_v2(db, delete_sql.c_str(), -1, &delete_stmt, nullptr) != SQLITE_OK) {
-            std::cerr << "Error preparing delete statement: " << sqlite3_errmsg(db) << std::endl;
-            res.result(http::status::internal_server_error);
-            res.body() = "Error preparing session delete";
-            sqlite3_finalize(stmt);
-            return;
-        }
-
-        sqlite3_bind_int(delete_stmt, 1, user_id);
-        if (sqlite3_step(delete_stmt) != SQLITE_DONE) {
-            std::cerr << "Error removing old sessions: " << sqlite3_errmsg(db) << std::endl;
-            res.result(http::status::internal_server_error);
-            res.body() = "Error removing old sessions";
-            sqlite3_finalize(delete_stmt);
-            sqlite3_finalize(stmt);
-            return;
-        }
-        sqlite3_finalize(delete_stmt);
-
-        // Insert the new session into the Sessions table
-        std::string insert_sql = "INSERT INTO Sessions (user_id, auth_token) VALUES (?, ?)";
-        sqlite3_stmt* insert_stmt;
-        if (sqlite3_prepare_v2(db, insert_sql.c_str(), -1, &insert_stmt, nullptr) != SQLITE_OK) {
-            std::cerr << "Error preparing insert statement: " << sqlite3_errmsg(db) << std::endl;
-            res.result(http::status::internal_server_error);
-            res.body() = "Error preparing session insert";
-            sqlite3_finalize(stmt);
-            return;
-        }
+    // Fetch user ID and type
+    auto cursor = select_login.query(db, username, password);
+    if (!cursor) {
+        LOG_ERROR << "Error preparing query: " << sqlite3_errmsg(db);
+        reply(res, http::status::internal_server_error, "Database query error");
+        return;
+    }
 
-        sqlite3_bind_int(insert_stmt, 1, user_id);
-        sqlite3_bind_text(insert_stmt, 2, token.c_str(), -1, SQLITE_STATIC);
-        if (sqlite3_step(insert_stmt) != SQLITE_DONE) {
-            std::cerr << "Error creating session: " << sqlite3_errmsg(db) << std::endl;
-            res.result(http::status::internal_server_error);
-            res.body() = "Error creating session";
-            sqlite3_finalize(insert_stmt);
-            sqlite3_finalize(stmt);
+    auto user = cursor.next();
+    if (!user) {
+        if (select_reset_required.one(db, username, kPasswordResetPrefix)) {
+            LOG_INFO << "Login for user " << username << " needs a password reset";
+            reply(res, http::status::forbidden, "Password reset required");
             return;
         }
-        sqlite3_finalize(insert_stmt);
+        LOG_INFO << "Failed login for user " << username;
+        reply(res, http::status::unauthorized, "Invalid username or password");
+        return;
+    }
+    auto [user_id, user_type] = *user;
+    std::string token = generate_token(32);
 
-        // Create JSON response
-        json::object response_body;
-        response_body["success"] = true;
-        response_body["token"] = token;
-        response_body["user_type"] = user_type;
+    // Remove all existing sessions for this user
+    if (delete_user_sessions.exec(db, user_id) != SQLITE_DONE) {
+        LOG_ERROR << "Error removing old sessions: " << sqlite3_errmsg(db);
+        reply(res, http::status::internal_server_error, "Error removing old sessions");
+        return;
+    }
 
-        std::string response_str;
-        try {
-            response_str = json::serialize(response_body);
-        } catch (const std::exception& e) {
-            std::cerr << "Error serializing JSON: " << e.what() << std::endl;
-            res.result(http::status::internal_server_error);
-            res.body() = "Error generating response";
-            sqlite3_finalize(stmt);
-            return;
-        }
+    // Insert the new session into the Sessions table
+    if (insert_session.exec(db, user_id, token) != SQLITE_DONE) {
+        LOG_ERROR << "Error creating session: " << sqlite3_errmsg(db);
+        reply(res, http::status::internal_server_error, "Error creating session");
+        return;
+    }
 
-        res.result(http::status::ok);
-        res.body() = response_str;
+    // JSON unless the client asked for text
+    res.result(http::status::ok);
+    res.body().reserve(96);
+    if (response_format(res, ResponseFormat::json) == ResponseFormat::json) {
+        JsonWriter(res.body()).begin_object()
+            .field("success", true)
+            .field("token", token)
+            .field("user_type", user_type)
+            .end_object();
     } else {
-        std::cerr << "Invalid username or password" << std::endl;
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid username or password";
+        res.body().append("Token: ").append(token).append("\nUser type: ").append(user_type).append("\n");
     }
-
-    sqlite3_finalize(stmt);
 }
 
 
 
-// URL-decode a string
+// URL-decode a string. Throws std::invalid_argument on a malformed escape or
+// invalid UTF-8 so handle_request can answer 400.
 std::string url_decode(const std::string& str) {
     std::string decoded;
-    decoded.reserve(str.size());
-
-    for (size_t i = 0; i < str.size(); ++i) {
-        if (str[i] == '%') {
-            if (i + 2 < str.size()) {
-                int value = std::stoi(str.substr(i + 1, 2), nullptr, 16);
-                decoded += static_cast<char>(value);
-                i += 2;
-            }
-        } else if (str[i] == '+') {
-            decoded += ' ';
-        } else {
-            decoded += str[i];
-        }
+    if (!urldecode::decode(str, decoded)) {
+        throw std::invalid_argument("malformed form encoding");
     }
-
     return decoded;
 }
 
-// Handle registration request
-void handle_register(const std::string& body, http::response<http::string_body>& res) {
-    std::string username, email, password;
-
-    auto get_field_value = [&](const std::string& field_name) {
-        auto pos = body.find(field_name + "=");
-        if (pos != std::string::npos) {
-            auto end_pos = body.find('&', pos);
-            return url_decode(body.substr(pos + field_name.size() + 1, end_pos == std::string::npos ? body.size() - pos - field_name.size() - 1 : end_pos - pos - field_name.size() - 1));
-        }
-        return std::string{};
-    };
+// Helper function to extract a field value from the request body
+std::string get_field_value(const std::string& field_name, const std::string& body) {
+    auto pos = body.find(field_name + "=");
+    if (pos != std::string::npos) {
+        auto end_pos = body.find('&', pos);
+        return url_decode(body.substr(pos + field_name.size() + 1, end_pos == std::string::npos ? body.size() - pos - field_name.size() - 1 : end_pos - pos - field_name.size() - 1));
+    }
+    return std::string{};
+}
 
-    username = get_field_value("username");
-    email = get_field_value("email");
-    password = get_field_value("password");
+static sql::Statement<sql::Params<std::string_view, std::string_view, std::string_view>, sql::Columns<>> insert_user{
+    "INSERT INTO Korisnici (username, email, password, user_type) VALUES (?, ?, ?, 'buyer')"};
 
-    std::string sql = "INSERT INTO Korisnici (username, email, password, user_type) VALUES (?, ?, ?, 'buyer')";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, email.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, password.c_str(), -1, SQLITE_STATIC);
-
-        if (sqlite3_step(stmt) == SQLITE_DONE) {
-            res.result(http::status::ok);
-            res.body() = "Registration successful";
-        } else {
-            res.result(http::status::internal_server_error);
-            res.body() = "Error registering user: " + std::string(sqlite3_errmsg(db));
-        }
-        sqlite3_finalize(stmt);
+// Handle registration request
+void handle_register(const std::string& body, http::response<http::string_body>& res) {
+    std::string username = get_field_value("username", body);
+    std::string email = get_field_value("email", body);
+    std::string password = get_field_value("password", body);
+
+    auto cursor = insert_user.query(db, username, email, password);
+    if (!cursor) {
+        reply(res, http::status::internal_server_error, "Database query error: " + std::string(sqlite3_errmsg(db)));
+    } else if (cursor.step(), cursor.done()) {
+        reply(res, http::status::ok, "Registration successful");
     } else {
-        res.result(http::status::internal_server_error);
-        res.body() = "Database query error: " + std::string(sqlite3_errmsg(db));
+        reply(res, http::status::internal_server_error, "Error registering user: " + std::string(sqlite3_errmsg(db)));
     }
 }
 
 // Handle profile request
 void handle_profile(const std::string& token, http::response<http::string_body>& res) {
     if (is_token_valid(token)) {
-        res.result(http::status::ok);
-        res.body() = "Profile access granted";
+        reply(res, http::status::ok, "Profile access granted");
     } else {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
     }
 }
 
-// Helper function to extract a field value from the request body
-std::string get_field_value(const std::string& field_name, const std::string& body) {
-    auto pos = body.find(field_name + "=");
-    if (pos != std::string::npos) {
-        auto end_pos = body.find('&', pos);
-        return url_decode(body.substr(pos + field_name.size() + 1, end_pos == std::string::npos ? body.size() - pos - field_name.size() - 1 : end_pos - pos - field_name.size() - 1));
-    }
-    return std::string{};
-}
+// Fields left empty in the request are bound as NULL and keep their value.
+static sql::Statement<sql::Params<std::optional<std::string_view>, std::optional<std::string_view>,
+                                  std::optional<std::string_view>, std::optional<std::string_view>,
+                                  std::string_view>,
+                      sql::Columns<>> update_profile{
+    "UPDATE Korisnici SET username = COALESCE(?, username), password = COALESCE(?, password), "
+    "email = COALESCE(?, email), user_type = COALESCE(?, user_type) "
+    "WHERE user_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)"};
 
 void handle_update_profile(const std::string& token, const std::string& body, http::response<http::string_body>& res) {
-    if (is_token_valid(token)) {
-        // Extract fields from body to update
-        std::string username = get_field_value("username", body);
-        std::string password = get_field_value("password", body);
-        std::string email = get_field_value("email", body);
-        std::string user_type = get_field_value("user_type", body);
-
-        // Log extracted values for debugging
-        std::cerr << "Extracted values - username: " << username 
-                  << ", password: " << password 
-                  << ", email: " << email 
-                  << ", user_type: " << user_type << std::endl;
-
-        // Validate user_type
-        if (!user_type.empty() && user_type != "buyer" && user_type != "seller") {
-            res.result(http::status::bad_request);
-            res.body() = "Invalid user_type value. Must be 'buyer' or 'seller'.";
-            return;
-        }
-
-        // Prepare SQL statement dynamically based on provided fields
-        std::string sql = "UPDATE Korisnici SET ";
-        bool first_field = true;
+    if (!is_token_valid(token)) {
+        reply(res, http::status::unauthorized, "Invalid or missing token");
+        return;
+    }
 
-        if (!username.empty()) {
-            sql += "username = ?";
-            first_field = false;
-        }
-        if (!password.empty()) {
-            if (!first_field) sql += ", ";
-            sql += "password = ?";
-            first_field = false;
-        }
-        if (!email.empty()) {
-            if (!first_field) sql += ", ";
-            sql += "email = ?";
-            first_field = false;
-        }
-        if (!user_type.empty()) {
-            if (!first_field) sql += ", ";
-            sql += "user_type = ?";
-        }
-        sql += " WHERE user_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)";
+    // Extract fields from body to update
+    std::string username = get_field_value("username", body);
+    std::string password = get_field_value("password", body);
+    std::string email = get_field_value("email", body);
+    std::string user_type = get_field_value("user_type", body);
 
-        sqlite3_stmt* stmt;
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-            std::cerr << "Error preparing update profile query: " << sqlite3_errmsg(db) << std::endl;
-            res.result(http::status::internal_server_error);
-            res.body() = "Error preparing update profile query: " + std::string(sqlite3_errmsg(db));
-            return;
-        }
+    LOG_DEBUG << "Update profile - username: " << username
+              << ", password: " << (password.empty() ? "" : "***")
+              << ", email: " << email
+              << ", user_type: " << user_type;
 
-        int bind_index = 1;
-        if (!username.empty()) {
-            sqlite3_bind_text(stmt, bind_index++, username.c_str(), -1, SQLITE_STATIC);
-        }
-        if (!password.empty()) {
-            sqlite3_bind_text(stmt, bind_index++, password.c_str(), -1, SQLITE_STATIC);
-        }
-        if (!email.empty()) {
-            sqlite3_bind_text(stmt, bind_index++, email.c_str(), -1, SQLITE_STATIC);
-        }
-        if (!user_type.empty()) {
-            sqlite3_bind_text(stmt, bind_index++, user_type.c_str(), -1, SQLITE_STATIC);
-        }
-        sqlite3_bind_text(stmt, bind_index, token.c_str(), -1, SQLITE_STATIC);
+    // Validate user_type
+    if (!user_type.empty() && user_type != "buyer" && user_type != "seller") {
+        reply(res, http::status::bad_request, "Invalid user_type value. Must be 'buyer' or 'seller'.");
+        return;
+    }
 
-        int rc = sqlite3_step(stmt);
-        if (rc == SQLITE_DONE) {
-            res.result(http::status::ok);
-            res.body() = "Profile updated successfully";
-        } else {
-            std::cerr << "Error updating profile: " << sqlite3_errmsg(db) << std::endl;
-            res.result(http::status::internal_server_error);
-            res.body() = "Error updating profile: " + std::string(sqlite3_errmsg(db));
-        }
-        sqlite3_finalize(stmt);
+    auto optional_field = [](const std::string& value) {
+        return value.empty() ? std::optional<std::string_view>() : std::optional<std::string_view>(value);
+    };
+    int rc = update_profile.exec(db, optional_field(username), optional_field(password),
+                                 optional_field(email), optional_field(user_type), token);
+    if (rc == SQLITE_DONE) {
+        reply(res, http::status::ok, "Profile updated successfully");
     } else {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        LOG_ERROR << "Error updating profile: " << sqlite3_errmsg(db);
+        reply(res, http::status::internal_server_error, "Error updating profile: " + std::string(sqlite3_errmsg(db)));
     }
 }
 
@@ -447,99 +381,99 @@ void handle_update_profile(const std::string& token, const std::string& body, ht
 
 
 
+static sql::Statement<TokenParam, sql::Columns<>> delete_session{
+    "DELETE FROM Sessions WHERE auth_token = ?"};
+
 // Handle logout request
 void handle_logout(const std::string& token, http::response<http::string_body>& res) {
-    // Remove "Bearer " prefix if it exists
-    std::string clean_token = token;
-    if (clean_token.substr(0, 7) == "Bearer ") {
-        clean_token = clean_token.substr(7);
-    }
-
-    if (is_token_valid(clean_token)) {
-        // Delete the session from the Sessions table
-        std::string delete_sql = "DELETE FROM Sessions WHERE auth_token = ?";
-        sqlite3_stmt* delete_stmt;
-        if (sqlite3_prepare_v2(db, delete_sql.c_str(), -1, &delete_stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(delete_stmt, 1, clean_token.c_str(), -1, SQLITE_STATIC);
-            if (sqlite3_step(delete_stmt) == SQLITE_DONE) {
-                res.result(http::status::ok);
-                res.body() = "Logged out successfully";
-            } else {
-                res.result(http::status::internal_server_error);
-                res.body() = "Error logging out: " + std::string(sqlite3_errmsg(db));
-            }
-            sqlite3_finalize(delete_stmt);
-        } else {
-            res.result(http::status::internal_server_error);
-            res.body() = "Error preparing logout: " + std::string(sqlite3_errmsg(db));
-        }
+    if (!is_token_valid(token)) {
+        reply(res, http::status::unauthorized, "Invalid or missing token");
+        return;
+    }
+
+    // Delete the session from the Sessions table
+    auto cursor = delete_session.query(db, token);
+    if (!cursor) {
+        reply(res, http::status::internal_server_error, "Error preparing logout: " + std::string(sqlite3_errmsg(db)));
+    } else if (cursor.step(), cursor.done()) {
+        reply(res, http::status::ok, "Logged out successfully");
     } else {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::internal_server_error, "Error logging out: " + std::string(sqlite3_errmsg(db)));
     }
 }
 
 
-// Function to handle services menu
-void handle_services(const std::string& token, const std::string& body, http::response<http::string_body>& res) {
-    std::cout << "Token: " << token << std::endl;
-    std::cout << "Request Body: " << body << std::endl;
+// Starts a 200 listing in the negotiated format (`native` if the client
+// didn't ask), with the body reserved from the endpoint's size estimate.
+RowWriter begin_rows(http::response<http::string_body>& res, ResponseFormat native, const ResponseSizeEstimate& estimate,
+                     std::string_view json_key, std::string_view heading = {}, const char* empty_text = nullptr) {
+    bool json = response_format(res, native) == ResponseFormat::json;
+    res.result(http::status::ok);
+    res.body().clear();
+    estimate.reserve(res.body());
+    return RowWriter(res.body(), json, json_key, heading, empty_text);
+}
+
+// Writes one ServiceColumns row.
+void write_service_row(RowWriter& rows, const ServiceColumns::Row& row) {
+    const auto& [service_id, service_name, price, capacity, working_hours, service_type, loyalty_requirement, loyalty_discount] = row;
+    rows.begin_row();
+    rows.field("service_id", "ID", service_id);
+    rows.field("service_name", "Service Name", service_name);
+    rows.field("price", "Price", price);
+    rows.field("capacity", "Capacity", capacity);
+    rows.field("working_hours", "Hours", working_hours);
+    rows.field("service_type", "Type", service_type);
+    rows.field("loyalty_requirement", "Loyalty Req", loyalty_requirement);
+    rows.field("loyalty_discount", "Loyalty Discount", loyalty_discount);
+    rows.end_row();
+}
+
+static ResponseSizeEstimate services_size{4096};
+static sql::Statement<sql::Params<>, ServiceColumns> select_services{
+    "SELECT service_id, service_name, price, capacity, working_hours, service_type, loyalty_requirement, loyalty_discount FROM Usluge"};
 
+// Function to handle services menu
+void handle_services(const std::string& token, http::response<http::string_body>& res) {
     if (!is_token_valid(token)) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
-    std::string user_type;
-    std::string sql = "SELECT user_type FROM Korisnici WHERE user_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, token.c_str(), -1, SQLITE_STATIC);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            user_type = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-        }
-        sqlite3_finalize(stmt);
-    } else {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error retrieving user type: " + std::string(sqlite3_errmsg(db));
+    auto type_cursor = select_user_type.query(db, token);
+    if (!type_cursor) {
+        reply(res, http::status::internal_server_error, "Error retrieving user type: " + std::string(sqlite3_errmsg(db)));
         return;
     }
+    auto type_row = type_cursor.next();
+    std::string user_type = type_row ? std::get<0>(*type_row) : std::string();
 
     if (user_type == "seller") {
-        res.result(http::status::ok);
-        res.body() = "Services Menu:\n1. Create Service\n2. View My Services\n3. Delete Service\n4. Update Service";
+        reply(res, http::status::ok, "Services Menu:\n1. Create Service\n2. View My Services\n3. Delete Service\n4. Update Service");
     } else if (user_type == "buyer") {
-        res.result(http::status::ok);
-        res.body() = "All Services:\n";
-        
-        sql = "SELECT service_id, service_name, price, capacity, working_hours, service_type, loyalty_requirement, loyalty_discount FROM Usluge";
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-            while (sqlite3_step(stmt) == SQLITE_ROW) {
-                res.body() += "ID: " + std::to_string(sqlite3_column_int(stmt, 0)) + ", "
-                              "Service Name: " + reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)) + ", "
-                              "Price: " + std::to_string(sqlite3_column_double(stmt, 2)) + ", "
-                              "Capacity: " + std::to_string(sqlite3_column_int(stmt, 3)) + ", "
-                              "Hours: " + reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4)) + ", "
-                              "Type: " + reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5)) + ", "
-                              "Loyalty Req: " + reinterpret_cast<const char*>(sqlite3_column_text(stmt, 6)) + ", "
-                              "Loyalty Discount: " + std::to_string(sqlite3_column_double(stmt, 7)) + "\n";
-            }
-            sqlite3_finalize(stmt);
+        auto cursor = select_services.query(db);
+        if (!cursor) {
+            reply(res, http::status::internal_server_error, "Error retrieving services: " + std::string(sqlite3_errmsg(db)));
         } else {
-            res.result(http::status::internal_server_error);
-            res.body() = "Error retrieving services: " + std::string(sqlite3_errmsg(db));
+            RowWriter rows = begin_rows(res, ResponseFormat::text, services_size, "services", "All Services:\n");
+            while (auto row = cursor.next()) {
+                write_service_row(rows, *row);
+            }
+            rows.finish();
+            services_size.record(res.body().size());
         }
     } else {
-        res.result(http::status::forbidden);
-        res.body() = "Unknown user type";
+        reply(res, http::status::forbidden, "Unknown user type");
     }
 }
 
+static sql::Statement<sql::Params<std::string_view, double, int, std::string_view, std::string_view, std::string_view, double, std::string_view>,
+                      sql::Columns<>> insert_service{
+    "INSERT INTO Usluge (service_name, price, capacity, working_hours, service_type, loyalty_requirement, loyalty_discount, seller_id) VALUES (?, ?, ?, ?, ?, ?, ?, (SELECT user_id FROM Sessions WHERE auth_token = ?))"};
+
 void handle_create_service(const std::string& token, const std::string& body, http::response<http::string_body>& res) {
     if (!is_token_valid(token)) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
@@ -550,7 +484,7 @@ void handle_create_service(const std::string& token, const std::string& body, ht
         auto delimiter_pos = segment.find('=');
         std::string key = segment.substr(0, delimiter_pos);
         std::string value = segment.substr(delimiter_pos + 1);
-        
+
         if (key == "service_name") service_name = value;
         else if (key == "price") price = value;
         else if (key == "capacity") capacity = value;
@@ -560,37 +494,24 @@ void handle_create_service(const std::string& token, const std::string& body, ht
         else if (key == "loyalty_discount") loyalty_discount = value;
     }
 
-    std::string sql = "INSERT INTO Usluge (service_name, price, capacity, working_hours, service_type, loyalty_requirement, loyalty_discount, seller_id) VALUES (?, ?, ?, ?, ?, ?, ?, (SELECT user_id FROM Sessions WHERE auth_token = ?))";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, service_name.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_double(stmt, 2, std::stod(price));
-        sqlite3_bind_int(stmt, 3, std::stoi(capacity));
-        sqlite3_bind_text(stmt, 4, working_hours.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 5, service_type.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 6, loyalty_requirement.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_double(stmt, 7, std::stod(loyalty_discount));
-        sqlite3_bind_text(stmt, 8, token.c_str(), -1, SQLITE_STATIC);
-
-        if (sqlite3_step(stmt) == SQLITE_DONE) {
-            res.result(http::status::ok);
-            res.body() = "Service created successfully";
-        } else {
-            res.result(http::status::internal_server_error);
-            res.body() = "Error creating service: " + std::string(sqlite3_errmsg(db));
-        }
-        sqlite3_finalize(stmt);
+    auto cursor = insert_service.query(db, service_name, std::stod(price), std::stoi(capacity), working_hours,
+                                       service_type, loyalty_requirement, std::stod(loyalty_discount), token);
+    if (!cursor) {
+        reply(res, http::status::internal_server_error, "Error preparing SQL statement: " + std::string(sqlite3_errmsg(db)));
+    } else if (cursor.step(), cursor.done()) {
+        reply(res, http::status::ok, "Service created successfully");
     } else {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error preparing SQL statement: " + std::string(sqlite3_errmsg(db));
+        reply(res, http::status::internal_server_error, "Error creating service: " + std::string(sqlite3_errmsg(db)));
     }
 }
 
+static sql::Statement<sql::Params<int, std::string_view>, sql::Columns<>> delete_service{
+    "DELETE FROM Usluge WHERE service_id = ? AND seller_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)"};
+
 void handle_delete_service(const std::string& token, const std::string& body, http::response<http::string_body>& res) {
     // Validate the token
     if (!is_token_valid(token)) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
@@ -600,53 +521,57 @@ void handle_delete_service(const std::string& token, const std::string& body, ht
     try {
         service_id = std::stoi(service_id_str);
     } catch (const std::invalid_argument&) {
-        res.result(http::status::bad_request);
-        res.body() = "Invalid service ID format";
+        reply(res, http::status::bad_request, "Invalid service ID format");
         return;
     }
 
-    // Prepare SQL statement for deleting the service
-    std::string sql = "DELETE FROM Usluge WHERE service_id = ? AND seller_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error preparing SQL statement: " + std::string(sqlite3_errmsg(db));
+    // Execute the delete
+    auto cursor = delete_service.query(db, service_id, token);
+    if (!cursor) {
+        reply(res, http::status::internal_server_error, "Error preparing SQL statement: " + std::string(sqlite3_errmsg(db)));
         return;
     }
-
-    // Bind parameters to the SQL statement
-    sqlite3_bind_int(stmt, 1, service_id);
-    sqlite3_bind_text(stmt, 2, token.c_str(), -1, SQLITE_STATIC);
-
-    // Execute the SQL statement
-    int rc = sqlite3_step(stmt);
-    if (rc == SQLITE_DONE) {
+    cursor.step();
+    if (cursor.done()) {
         if (sqlite3_changes(db) > 0) {
-            res.result(http::status::ok);
-            res.body() = "Service deleted successfully";
+            reply(res, http::status::ok, "Service deleted successfully");
         } else {
-            res.result(http::status::not_found);
-            res.body() = "Service not found or not owned by the user";
+            reply(res, http::status::not_found, "Service not found or not owned by the user");
         }
     } else {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error deleting service: " + std::string(sqlite3_errmsg(db));
+        reply(res, http::status::internal_server_error, "Error deleting service: " + std::string(sqlite3_errmsg(db)));
     }
-    sqlite3_finalize(stmt);
 }
 
+// One cached statement per column a seller may change; the column name can't
+// be a bound parameter, and only these are accepted from the request.
+using UpdateServiceStatement = sql::Statement<sql::Params<std::string_view, int, std::string_view>, sql::Columns<>>;
+#define UPDATE_SERVICE_SQL(column) \
+    "UPDATE Usluge SET " column " = ? WHERE service_id = ? AND seller_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)"
+static struct {
+    const char* field;
+    UpdateServiceStatement statement;
+} update_service_statements[] = {
+    {"service_name", UpdateServiceStatement{UPDATE_SERVICE_SQL("service_name")}},
+    {"price", UpdateServiceStatement{UPDATE_SERVICE_SQL("price")}},
+    {"capacity", UpdateServiceStatement{UPDATE_SERVICE_SQL("capacity")}},
+    {"working_hours", UpdateServiceStatement{UPDATE_SERVICE_SQL("working_hours")}},
+    {"service_type", UpdateServiceStatement{UPDATE_SERVICE_SQL("service_type")}},
+    {"loyalty_requirement", UpdateServiceStatement{UPDATE_SERVICE_SQL("loyalty_requirement")}},
+    {"loyalty_discount", UpdateServiceStatement{UPDATE_SERVICE_SQL("loyalty_discount")}},
+};
+#undef UPDATE_SERVICE_SQL
+
 void handle_update_service(const std::string& token, const std::string& body, http::response<http::string_body>& res) {
     if (!is_token_valid(token)) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
     // Parse the body to extract service_id and field_name=value
     auto delimiter_pos = body.find('&');
     if (delimiter_pos == std::string::npos) {
-        res.result(http::status::bad_request);
-        res.body() = "Invalid body format";
+        reply(res, http::status::bad_request, "Invalid body format");
         return;
     }
 
@@ -658,218 +583,147 @@ void handle_update_service(const std::string& token, const std::string& body, ht
     // Extract field name and new value
     auto field_delim_pos = field_and_value.find('=');
     if (field_delim_pos == std::string::npos) {
-        res.result(http::status::bad_request);
-        res.body() = "Invalid field_and_value format";
+        reply(res, http::status::bad_request, "Invalid field_and_value format");
         return;
     }
 
     std::string field_name = field_and_value.substr(0, field_delim_pos);
     std::string new_value = field_and_value.substr(field_delim_pos + 1);
 
-    // Prepare SQL statement
-    std::string sql = "UPDATE Usluge SET " + field_name + " = ? WHERE service_id = ? AND seller_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error preparing SQL statement: " + std::string(sqlite3_errmsg(db));
+    UpdateServiceStatement* statement = nullptr;
+    for (auto& candidate : update_service_statements) {
+        if (field_name == candidate.field) statement = &candidate.statement;
+    }
+    if (!statement) {
+        reply(res, http::status::bad_request, "Invalid field name");
         return;
     }
 
-    // Bind parameters
-    sqlite3_bind_text(stmt, 1, new_value.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, std::stoi(service_id_str));
-    sqlite3_bind_text(stmt, 3, token.c_str(), -1, SQLITE_STATIC);
-
-    // Execute the SQL statement
-    if (sqlite3_step(stmt) == SQLITE_DONE) {
-        res.result(http::status::ok);
-        res.body() = "Service updated successfully";
+    auto cursor = statement->query(db, new_value, std::stoi(service_id_str), token);
+    if (!cursor) {
+        reply(res, http::status::internal_server_error, "Error preparing SQL statement: " + std::string(sqlite3_errmsg(db)));
+    } else if (cursor.step(), cursor.done()) {
+        reply(res, http::status::ok, "Service updated successfully");
     } else {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error updating service: " + std::string(sqlite3_errmsg(db));
+        reply(res, http::status::internal_server_error, "Error updating service: " + std::string(sqlite3_errmsg(db)));
     }
-
-    // Finalize the statement
-    sqlite3_finalize(stmt);
 }
 
 
 
 
+static ResponseSizeEstimate my_services_size{1024};
+static sql::Statement<TokenParam, ServiceColumns> select_my_services{
+    "SELECT service_id, service_name, price, capacity, working_hours, service_type, loyalty_requirement, loyalty_discount "
+    "FROM Usluge WHERE seller_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)"};
+
 void handle_my_services(const std::string& token, http::response<http::string_body>& res) {
     // Validate the token
     if (!is_token_valid(token)) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
-    // Query to get the seller's services
-    std::string sql = "SELECT service_id, service_name, price, capacity, working_hours, service_type, loyalty_requirement, loyalty_discount "
-                      "FROM Usluge WHERE seller_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)";
-    sqlite3_stmt* stmt;
-    
-    // Prepare and execute the SQL query
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error preparing SQL statement: " + std::string(sqlite3_errmsg(db));
+    // Query the seller's services
+    auto cursor = select_my_services.query(db, token);
+    if (!cursor) {
+        reply(res, http::status::internal_server_error, "Error preparing SQL statement: " + std::string(sqlite3_errmsg(db)));
         return;
     }
 
-    sqlite3_bind_text(stmt, 1, token.c_str(), -1, SQLITE_STATIC);
-
-    std::string services_list;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        services_list += "ID: " + std::to_string(sqlite3_column_int(stmt, 0)) + ", "
-                        "Service Name: " + reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)) + ", "
-                        "Price: " + std::to_string(sqlite3_column_double(stmt, 2)) + ", "
-                        "Capacity: " + std::to_string(sqlite3_column_int(stmt, 3)) + ", "
-                        "Hours: " + reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4)) + ", "
-                        "Type: " + reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5)) + ", "
-                        "Loyalty Req: " + reinterpret_cast<const char*>(sqlite3_column_text(stmt, 6)) + ", "
-                        "Loyalty Discount: " + std::to_string(sqlite3_column_double(stmt, 7)) + "\n";
-    }
-    sqlite3_finalize(stmt);
-
-    if (!services_list.empty()) {
-        res.result(http::status::ok);
-        res.body() = "My Services:\n" + services_list;
-    } else {
-        res.result(http::status::ok);
-        res.body() = "No services found.";
+    RowWriter rows = begin_rows(res, ResponseFormat::text, my_services_size, "services", "My Services:\n", "No services found.");
+    while (auto row = cursor.next()) {
+        write_service_row(rows, *row);
     }
+    rows.finish();
+    my_services_size.record(res.body().size());
 }
 
 
+static sql::Statement<sql::Params<int>, sql::Columns<int, double, double, int>> select_order_terms{
+    "SELECT capacity, price, loyalty_discount, loyalty_requirement FROM Usluge WHERE service_id = ?"};
+static sql::Statement<sql::Params<int, int>, sql::Columns<int>> select_loyalty_points{
+    "SELECT loyalty_points FROM Lojalnosti WHERE seller_id = ? AND buyer_id = ?"};
+static sql::Statement<sql::Params<int, int, int, int, double>, sql::Columns<>> insert_order{
+    "INSERT INTO Narudzbe (service_id, buyer_id, seller_id, quantity, cost, order_status) VALUES (?, ?, ?, ?, ?, 'pending')"};
+
 void handle_make_order(const std::string& token, const std::string& body, http::response<http::string_body>& res) {
-    
-    std::cerr << "HANDLE MAKE ORDER INITIATED OK";
-    std::cerr << "TOKEN: " << token;
-    
+
     // Get the user ID from the token
     int user_id = get_user_id_by_token(token);
     if (user_id == -1) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
-    std::cerr << "USER ID:" << user_id;
-
     // Extract service ID and quantity from the request body
-    auto get_field_value = [&](const std::string& field_name) {
-        auto pos = body.find(field_name + "=");
-        if (pos != std::string::npos) {
-            auto end_pos = body.find('&', pos);
-            return url_decode(body.substr(pos + field_name.size() + 1, end_pos == std::string::npos ? body.size() - pos - field_name.size() - 1 : end_pos - pos - field_name.size() - 1));
-        }
-        return std::string{};
-    };
-
-    std::string service_id_str = get_field_value("service_id");
-    std::string quantity_str = get_field_value("quantity");
+    std::string service_id_str = get_field_value("service_id", body);
+    std::string quantity_str = get_field_value("quantity", body);
 
     if (service_id_str.empty() || quantity_str.empty()) {
-        res.result(http::status::bad_request);
-        res.body() = "Missing service_id or quantity";
+        reply(res, http::status::bad_request, "Missing service_id or quantity");
         return;
     }
 
     int service_id = std::stoi(service_id_str);
     int quantity = std::stoi(quantity_str);
 
-    std::cerr << "SERVICE ID:" << service_id << "\n";
-    std::cerr << "QUANTITY:" << quantity << "\n";
+    LOG_DEBUG << "Make order - user " << user_id << ", service " << service_id << ", quantity " << quantity;
 
     // Get the seller_id by service_id
     int seller_id = get_seller_id_by_service_id(service_id);
     if (seller_id == -1) {
-        res.result(http::status::bad_request);
-        res.body() = "Invalid service_id";
+        reply(res, http::status::bad_request, "Invalid service_id");
         return;
     }
 
     // Check service capacity and get price
-    std::string sql = "SELECT capacity, price, loyalty_discount, loyalty_requirement FROM Usluge WHERE service_id = ?";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_int(stmt, 1, service_id);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            int capacity = sqlite3_column_int(stmt, 0);
-            double price = sqlite3_column_double(stmt, 1);
-            double loyalty_discount = sqlite3_column_double(stmt, 2);
-            int loyalty_requirement = sqlite3_column_int(stmt, 3);
-
-            if (quantity > capacity) {
-                res.result(http::status::bad_request);
-                res.body() = "Requested quantity exceeds service capacity";
-                std::cerr << "Requested quantity exceeds service capacity" << "\n";
-                sqlite3_finalize(stmt);
-                return;
-            }
+    auto terms_cursor = select_order_terms.query(db, service_id);
+    if (!terms_cursor) {
+        reply(res, http::status::internal_server_error, "Error retrieving service details: " + std::string(sqlite3_errmsg(db)));
+        return;
+    }
+    auto terms = terms_cursor.next();
+    if (!terms) {
+        reply(res, http::status::bad_request, "Service not found");
+        return;
+    }
+    auto [capacity, price, loyalty_discount, loyalty_requirement] = *terms;
 
-            std::cerr << "All good so far" << "\n";
+    if (quantity > capacity) {
+        reply(res, http::status::bad_request, "Requested quantity exceeds service capacity");
+        return;
+    }
 
-            // Check buyer's loyalty points in the Lojalnosti table
-            sql = "SELECT loyalty_points FROM Lojalnosti WHERE seller_id = ? AND buyer_id = ?";
-            sqlite3_stmt* loyalty_stmt;
-            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &loyalty_stmt, nullptr) == SQLITE_OK) {
-                sqlite3_bind_int(loyalty_stmt, 1, seller_id);
-                sqlite3_bind_int(loyalty_stmt, 2, user_id);
-                if (sqlite3_step(loyalty_stmt) == SQLITE_ROW) {
-                    int buyer_loyalty_points = sqlite3_column_int(loyalty_stmt, 0);
+    // Check buyer's loyalty points in the Lojalnosti table
+    auto loyalty_cursor = select_loyalty_points.query(db, seller_id, user_id);
+    if (!loyalty_cursor) {
+        reply(res, http::status::internal_server_error, "Error retrieving buyer's loyalty points: " + std::string(sqlite3_errmsg(db)));
+        return;
+    }
+    auto loyalty = loyalty_cursor.next();
+    if (!loyalty) {
+        reply(res, http::status::internal_server_error, "Error retrieving buyer's loyalty points: " + std::string(sqlite3_errmsg(db)));
+        return;
+    }
+    int buyer_loyalty_points = std::get<0>(*loyalty);
 
-                    std::cerr << "BUYER LOYALTY POINTS: " << buyer_loyalty_points << "\n";
+    // Calculate cost
+    double total_cost = price * quantity;
+    if (buyer_loyalty_points >= loyalty_requirement) {
+        total_cost -= total_cost * loyalty_discount / 100;
+    }
 
-                    // Calculate cost
-                    double total_cost = price * quantity;
-                    if (buyer_loyalty_points >= loyalty_requirement) {
-                        total_cost -= total_cost * loyalty_discount / 100;
-                    }
+    LOG_DEBUG << "Make order - loyalty points " << buyer_loyalty_points << ", total cost " << total_cost;
 
-                    std::cerr << "TOTAL COST: " << total_cost << "\n";
-
-                    // Create the order
-                    std::string insert_sql = "INSERT INTO Narudzbe (service_id, buyer_id, seller_id, quantity, cost, order_status) VALUES (?, ?, ?, ?, ?, 'pending')";
-                    sqlite3_stmt* insert_stmt;
-                    if (sqlite3_prepare_v2(db, insert_sql.c_str(), -1, &insert_stmt, nullptr) == SQLITE_OK) {
-                        std::cerr << "if sqlite3 all good: " << total_cost << service_id << user_id << seller_id << quantity << "\n";
-                        sqlite3_bind_int(insert_stmt, 1, service_id);
-                        sqlite3_bind_int(insert_stmt, 2, user_id);
-                        sqlite3_bind_int(insert_stmt, 3, seller_id);
-                        sqlite3_bind_int(insert_stmt, 4, quantity);
-                        sqlite3_bind_double(insert_stmt, 5, total_cost);
-
-                        if (sqlite3_step(insert_stmt) == SQLITE_DONE) {
-                            res.result(http::status::ok);
-                            res.body() = "Order created successfully";
-                        } else {
-                            res.result(http::status::internal_server_error);
-                            res.body() = "Error creating order: " + std::string(sqlite3_errmsg(db));
-                        }
-                        sqlite3_finalize(insert_stmt);
-                    } else {
-                        res.result(http::status::internal_server_error);
-                        res.body() = "Error preparing create order query: " + std::string(sqlite3_errmsg(db));
-                    }
-                } else {
-                    res.result(http::status::internal_server_error);
-                    res.body() = "Error retrieving buyer's loyalty points: " + std::string(sqlite3_errmsg(db));
-                }
-                sqlite3_finalize(loyalty_stmt);
-            } else {
-                res.result(http::status::internal_server_error);
-                res.body() = "Error retrieving buyer's loyalty points: " + std::string(sqlite3_errmsg(db));
-            }
-        } else {
-            res.result(http::status::bad_request);
-            res.body() = "Service not found";
-        }
-        sqlite3_finalize(stmt);
+    // Create the order
+    auto insert_cursor = insert_order.query(db, service_id, user_id, seller_id, quantity, total_cost);
+    if (!insert_cursor) {
+        reply(res, http::status::internal_server_error, "Error preparing create order query: " + std::string(sqlite3_errmsg(db)));
+    } else if (insert_cursor.step(), insert_cursor.done()) {
+        reply(res, http::status::ok, "Order created successfully");
     } else {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error retrieving service details: " + std::string(sqlite3_errmsg(db));
+        reply(res, http::status::internal_server_error, "Error creating order: " + std::string(sqlite3_errmsg(db)));
     }
 }
 
@@ -877,383 +731,278 @@ void handle_make_order(const std::string& token, const std::string& body, http::
 
 
 
+using OrderColumns = sql::Columns<int, int, int, std::string_view>;
+
+// Writes one OrderColumns row.
+void write_order_row(RowWriter& rows, const OrderColumns::Row& row) {
+    const auto& [order_id, service_id, quantity, status] = row;
+    rows.begin_row();
+    rows.field("order_id", "Order ID", order_id);
+    rows.field("service_id", "Service ID", service_id);
+    rows.field("quantity", "Amount", quantity);
+    rows.field("order_status", "Status", status);
+    rows.end_row();
+}
+
+static ResponseSizeEstimate orders_size{1024};
+static sql::Statement<TokenParam, OrderColumns> select_orders_by_token{
+    "SELECT order_id, service_id, quantity, status FROM Narudzbe WHERE buyer_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)"};
+static sql::Statement<TokenParam, sql::Columns<int>> select_buyer_points{
+    "SELECT loyalty_points FROM Korisnici WHERE user_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)"};
+static sql::Statement<sql::Params<int, std::string_view, int, double>, sql::Columns<>> insert_legacy_order{
+    "INSERT INTO Orders (service_id, buyer_id, quantity, total_cost, status) VALUES (?, (SELECT user_id FROM Sessions WHERE auth_token = ?), ?, ?, 'pending')"};
+
 void handle_orders(const std::string& body, const std::string& token, http::response<http::string_body>& res) {
     if (!is_token_valid(token)) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
-    std::string user_type;
-    std::string sql = "SELECT user_type FROM Korisnici WHERE user_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, token.c_str(), -1, SQLITE_STATIC);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            user_type = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-        }
-        sqlite3_finalize(stmt);
-    } else {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error retrieving user type: " + std::string(sqlite3_errmsg(db));
+    auto type_cursor = select_user_type.query(db, token);
+    if (!type_cursor) {
+        reply(res, http::status::internal_server_error, "Error retrieving user type: " + std::string(sqlite3_errmsg(db)));
         return;
     }
+    auto type_row = type_cursor.next();
+    std::string user_type = type_row ? std::get<0>(*type_row) : std::string();
 
     if (user_type == "buyer") {
         if (body.find("view=true") != std::string::npos) {
             // View My Orders
-            sql = "SELECT order_id, service_id, quantity, status FROM Narudzbe WHERE buyer_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)";
-            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-                std::string orders_list;
-                while (sqlite3_step(stmt) == SQLITE_ROW) {
-                    orders_list += "Order ID: " + std::to_string(sqlite3_column_int(stmt, 0)) + ", "
-                                    "Service ID: " + std::to_string(sqlite3_column_int(stmt, 1)) + ", "
-                                    "Amount: " + std::to_string(sqlite3_column_int(stmt, 2)) + ", "
-                                    "Status: " + reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3)) + "\n";
-                }
-                sqlite3_finalize(stmt);
-
-                if (!orders_list.empty()) {
-                    res.result(http::status::ok);
-                    res.body() = "My Orders:\n" + orders_list;
-                } else {
-                    res.result(http::status::ok);
-                    res.body() = "No orders found.";
-                }
+            auto cursor = select_orders_by_token.query(db, token);
+            if (!cursor) {
+                reply(res, http::status::internal_server_error, "Error retrieving orders: " + std::string(sqlite3_errmsg(db)));
             } else {
-                res.result(http::status::internal_server_error);
-                res.body() = "Error retrieving orders: " + std::string(sqlite3_errmsg(db));
+                RowWriter rows = begin_rows(res, ResponseFormat::text, orders_size, "orders", "My Orders:\n", "No orders found.");
+                while (auto row = cursor.next()) {
+                    write_order_row(rows, *row);
+                }
+                rows.finish();
+                orders_size.record(res.body().size());
             }
         } else if (body.find("make") != std::string::npos) {
-            std::string service_id_str, quantity_str;
-            auto get_field_value = [&](const std::string& field_name) {
-                auto pos = body.find(field_name + "=");
-                if (pos != std::string::npos) {
-                    auto end_pos = body.find('&', pos);
-                    return url_decode(body.substr(pos + field_name.size() + 1, end_pos == std::string::npos ? body.size() - pos - field_name.size() - 1 : end_pos - pos - field_name.size() - 1));
-                }
-                return std::string{};
-            };
-
-            service_id_str = get_field_value("service_id");
-            quantity_str = get_field_value("quantity");
-
-            int service_id = std::stoi(service_id_str);
-            int quantity = std::stoi(quantity_str);
+            int service_id = std::stoi(get_field_value("service_id", body));
+            int quantity = std::stoi(get_field_value("quantity", body));
 
             // Check service capacity and get price
-            sql = "SELECT capacity, price, loyalty_discount, loyalty_requirement FROM Usluge WHERE service_id = ?";
-            if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-                sqlite3_bind_int(stmt, 1, service_id);
-                if (sqlite3_step(stmt) == SQLITE_ROW) {
-                    int capacity = sqlite3_column_int(stmt, 0);
-                    double price = sqlite3_column_double(stmt, 1);
-                    double loyalty_discount = sqlite3_column_double(stmt, 2);
-                    int loyalty_requirement = sqlite3_column_int(stmt, 3);
-
-                    if (quantity > capacity) {
-                        res.result(http::status::bad_request);
-                        res.body() = "Requested quantity exceeds service capacity";
-                        sqlite3_finalize(stmt);
-                        return;
-                    }
-
-                    // Check buyer's loyalty points
-                    sql = "SELECT loyalty_points FROM Korisnici WHERE user_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)";
-                    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-                        sqlite3_bind_text(stmt, 1, token.c_str(), -1, SQLITE_STATIC);
-                        if (sqlite3_step(stmt) == SQLITE_ROW) {
-                            int buyer_loyalty_points = sqlite3_column_int(stmt, 0);
-
-                            // Calculate cost
-                            double total_cost = price * quantity;
-                            if (buyer_loyalty_points >= loyalty_requirement) {
-                                total_cost -= total_cost * loyalty_discount / 100;
-                            }
-
-                            // Create the order
-                            std::string insert_sql = "INSERT INTO Orders (service_id, buyer_id, quantity, total_cost, status) VALUES (?, (SELECT user_id FROM Sessions WHERE auth_token = ?), ?, ?, 'pending')";
-                            sqlite3_stmt* insert_stmt;
-                            if (sqlite3_prepare_v2(db, insert_sql.c_str(), -1, &insert_stmt, nullptr) == SQLITE_OK) {
-                                sqlite3_bind_int(insert_stmt, 1, service_id);
-                                sqlite3_bind_text(insert_stmt, 2, token.c_str(), -1, SQLITE_STATIC);
-                                sqlite3_bind_int(insert_stmt, 3, quantity);
-                                sqlite3_bind_double(insert_stmt, 4, total_cost);
-
-                                if (sqlite3_step(insert_stmt) == SQLITE_DONE) {
-                                    res.result(http::status::ok);
-                                    res.body() = "Order created successfully";
-                                } else {
-                                    res.result(http::status::internal_server_error);
-                                    res.body() = "Error creating order: " + std::string(sqlite3_errmsg(db));
-                                }
-                                sqlite3_finalize(insert_stmt);
-                            } else {
-                                res.result(http::status::internal_server_error);
-                                res.body() = "Error preparing create order query: " + std::string(sqlite3_errmsg(db));
-                            }
-                        } else {
-                            res.result(http::status::internal_server_error);
-                            res.body() = "Error retrieving buyer's loyalty points: " + std::string(sqlite3_errmsg(db));
-                        }
-                        sqlite3_finalize(stmt);
-                    } else {
-                        res.result(http::status::internal_server_error);
-                        res.body() = "Error retrieving buyer's loyalty points: " + std::string(sqlite3_errmsg(db));
-                    }
-                } else {
-                    res.result(http::status::bad_request);
-                    res.body() = "Service not found";
-                }
-                sqlite3_finalize(stmt);
-            } else {
-                res.result(http::status::internal_server_error);
-                res.body() = "Error retrieving service details: " + std::string(sqlite3_errmsg(db));
+            auto terms_cursor = select_order_terms.query(db, service_id);
+            if (!terms_cursor) {
+                reply(res, http::status::internal_server_error, "Error retrieving service details: " + std::string(sqlite3_errmsg(db)));
+                return;
+            }
+            auto terms = terms_cursor.next();
+            if (!terms) {
+                reply(res, http::status::bad_request, "Service not found");
+                return;
+            }
+            auto [capacity, price, loyalty_discount, loyalty_requirement] = *terms;
+
+            if (quantity > capacity) {
+                reply(res, http::status::bad_request, "Requested quantity exceeds service capacity");
+                return;
+            }
+
+            // Check buyer's loyalty points
+            auto points_cursor = select_buyer_points.query(db, token);
+            auto points = points_cursor ? points_cursor.next() : std::nullopt;
+            if (!points) {
+                reply(res, http::status::internal_server_error, "Error retrieving buyer's loyalty points: " + std::string(sqlite3_errmsg(db)));
+                return;
+            }
+            int buyer_loyalty_points = std::get<0>(*points);
+
+            // Calculate cost
+            double total_cost = price * quantity;
+            if (buyer_loyalty_points >= loyalty_requirement) {
+                total_cost -= total_cost * loyalty_discount / 100;
+            }
+
+            // Create the order
+            auto insert_cursor = insert_legacy_order.query(db, service_id, token, quantity, total_cost);
+            if (!insert_cursor) {
+                reply(res, http::status::internal_server_error, "Error preparing create order query: " + std::string(sqlite3_errmsg(db)));
+            } else if (insert_cursor.step(), insert_cursor.done()) {
+                reply(res, http::status::ok, "Order created successfully");
+            } else {
+                reply(res, http::status::internal_server_error, "Error creating order: " + std::string(sqlite3_errmsg(db)));
             }
         } else {
-            res.result(http::status::bad_request);
-            res.body() = "Invalid request format";
+            reply(res, http::status::bad_request, "Invalid request format");
         }
     } else if (user_type == "seller") {
-        res.result(http::status::forbidden);
-        res.body() = "Sellers cannot access this feature";
+        reply(res, http::status::forbidden, "Sellers cannot access this feature");
     } else {
-        res.result(http::status::forbidden);
-        res.body() = "Unknown user type";
+        reply(res, http::status::forbidden, "Unknown user type");
     }
 }
 
-void handle_loyalty_buyers(const std::string& token, http::response<http::string_body>& res) {
-    // Get the user ID from the token
-    int user_id = get_user_id_by_token(token);
-    if (user_id == -1) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
-        return;
-    }
+using LoyaltyColumns = sql::Columns<int, std::string_view, int>;
+
+// Writes one LoyaltyColumns row; the id/name columns are the seller's or the
+// buyer's depending on `seller`.
+void write_loyalty_row(RowWriter& rows, const LoyaltyColumns::Row& row, bool seller) {
+    const auto& [user_id, username, loyalty_points] = row;
+    rows.begin_row();
+    rows.field(seller ? "seller_id" : "buyer_id", seller ? "Seller ID" : "Buyer ID", user_id);
+    rows.field(seller ? "seller_name" : "buyer_name", seller ? "Seller" : "Buyer", username);
+    rows.field("loyalty_points", "Loyalty Points", loyalty_points);
+    rows.end_row();
+}
 
-    // Query to retrieve seller_id, seller_name, and loyalty points for the buyer
-    std::string sql = R"(
+static ResponseSizeEstimate loyalty_size{1024};
+
+static sql::Statement<sql::Params<int>, LoyaltyColumns> select_loyalty_for_buyer{R"(
         SELECT L.seller_id, K.username, L.loyalty_points
         FROM Lojalnosti L
         JOIN Korisnici K ON L.seller_id = K.user_id
         WHERE L.buyer_id = ?
-    )";
-    
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        std::cerr << "Error preparing query: " << sqlite3_errmsg(db) << std::endl;
-        res.result(http::status::internal_server_error);
-        res.body() = "Database query error";
+    )"};
+
+void handle_loyalty_buyers(const std::string& token, http::response<http::string_body>& res) {
+    // Get the user ID from the token
+    int user_id = get_user_id_by_token(token);
+    if (user_id == -1) {
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
-    sqlite3_bind_int(stmt, 1, user_id);
-
-    // Create JSON response object
-    json::array sellers_array;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        json::object seller_info;
-        seller_info["seller_id"] = sqlite3_column_int(stmt, 0);
-        seller_info["seller_name"] = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        seller_info["loyalty_points"] = sqlite3_column_int(stmt, 2);
-        sellers_array.push_back(seller_info);
-    }
-    sqlite3_finalize(stmt);
-
-    // Create the JSON response
-    json::object response_body;
-    response_body["sellers"] = sellers_array;
-
-    std::string response_str;
-    try {
-        response_str = json::serialize(response_body);
-    } catch (const std::exception& e) {
-        std::cerr << "Error serializing JSON: " << e.what() << std::endl;
-        res.result(http::status::internal_server_error);
-        res.body() = "Error generating response";
+    // Retrieve seller_id, seller_name, and loyalty points for the buyer
+    auto cursor = select_loyalty_for_buyer.query(db, user_id);
+    if (!cursor) {
+        LOG_ERROR << "Error preparing query: " << sqlite3_errmsg(db);
+        reply(res, http::status::internal_server_error, "Database query error");
         return;
     }
 
-    res.result(http::status::ok);
-    res.body() = response_str;
+    // Write the response row by row
+    RowWriter rows = begin_rows(res, ResponseFormat::json, loyalty_size, "sellers");
+    while (auto row = cursor.next()) {
+        write_loyalty_row(rows, *row, true);
+    }
+    rows.finish();
+    loyalty_size.record(res.body().size());
 }
 
+static sql::Statement<sql::Params<int>, LoyaltyColumns> select_loyalty_for_seller{R"(
+        SELECT L.buyer_id, K.username, L.loyalty_points
+        FROM Lojalnosti L
+        JOIN Korisnici K ON L.buyer_id = K.user_id
+        WHERE L.seller_id = ?
+    )"};
+
 void handle_loyalty_sellers(const std::string& token, http::response<http::string_body>& res) {
     // Get the seller ID from the token
     int seller_id = get_user_id_by_token(token);
     if (seller_id == -1) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
-    // Query to retrieve buyer_id, buyer_name, and loyalty points for the seller
-    std::string sql = R"(
-        SELECT L.buyer_id, K.username, L.loyalty_points
-        FROM Lojalnosti L
-        JOIN Korisnici K ON L.buyer_id = K.user_id
-        WHERE L.seller_id = ?
-    )";
-    
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        std::cerr << "Error preparing query: " << sqlite3_errmsg(db) << std::endl;
-        res.result(http::status::internal_server_error);
-        res.body() = "Database query error";
+    // Retrieve buyer_id, buyer_name, and loyalty points for the seller
+    auto cursor = select_loyalty_for_seller.query(db, seller_id);
+    if (!cursor) {
+        LOG_ERROR << "Error preparing query: " << sqlite3_errmsg(db);
+        reply(res, http::status::internal_server_error, "Database query error");
         return;
     }
 
-    sqlite3_bind_int(stmt, 1, seller_id);
-
-    // Create JSON response object
-    json::array buyers_array;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        json::object buyer_info;
-        buyer_info["buyer_id"] = sqlite3_column_int(stmt, 0);
-        buyer_info["buyer_name"] = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        buyer_info["loyalty_points"] = sqlite3_column_int(stmt, 2);
-        buyers_array.push_back(buyer_info);
-    }
-    sqlite3_finalize(stmt);
-
-    // Create the JSON response
-    json::object response_body;
-    response_body["buyers"] = buyers_array;
-
-    std::string response_str;
-    try {
-        response_str = json::serialize(response_body);
-    } catch (const std::exception& e) {
-        std::cerr << "Error serializing JSON: " << e.what() << std::endl;
-        res.result(http::status::internal_server_error);
-        res.body() = "Error generating response";
-        return;
+    // Write the response row by row
+    RowWriter rows = begin_rows(res, ResponseFormat::json, loyalty_size, "buyers");
+    while (auto row = cursor.next()) {
+        write_loyalty_row(rows, *row, false);
     }
-
-    res.result(http::status::ok);
-    res.body() = response_str;
+    rows.finish();
+    loyalty_size.record(res.body().size());
 }
 
 
 
+static ResponseSizeEstimate my_orders_size{1024};
+static sql::Statement<sql::Params<int>, OrderColumns> select_my_orders{
+    "SELECT order_id, service_id, quantity, order_status FROM Narudzbe WHERE buyer_id = ?"};
+
 // Handle "View My Orders" request
 void handle_my_orders(const std::string& token, http::response<http::string_body>& res) {
-    
-    std::cerr << "TEST!! HANDLE MY ORDERS" << std::endl;
     // Retrieve the user ID from the token
     int user_id = get_user_id_by_token(token);
-    std::cerr << "TEST!! USER ID:" << user_id << std::endl;
-
 
     if (user_id == -1) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
-    // Query to retrieve orders for the logged-in user
-    std::string sql = "SELECT order_id, service_id, quantity, order_status FROM Narudzbe WHERE buyer_id = ?";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        std::cerr << "Error preparing query: " << sqlite3_errmsg(db) << std::endl;
-        res.result(http::status::internal_server_error);
-        res.body() = "Database query error";
+    // Retrieve orders for the logged-in user
+    auto cursor = select_my_orders.query(db, user_id);
+    if (!cursor) {
+        LOG_ERROR << "Error preparing query: " << sqlite3_errmsg(db);
+        reply(res, http::status::internal_server_error, "Database query error");
         return;
     }
 
-    sqlite3_bind_int(stmt, 1, user_id);
-
-    // Create JSON response object
-    json::array orders_array;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        json::object order;
-        order["order_id"] = sqlite3_column_int(stmt, 0);
-        order["service_id"] = sqlite3_column_int(stmt, 1);
-        order["quantity"] = sqlite3_column_int(stmt, 2);
-        order["order_status"] = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-        orders_array.push_back(order);
+    // Write the response row by row
+    RowWriter rows = begin_rows(res, ResponseFormat::json, my_orders_size, "orders");
+    while (auto row = cursor.next()) {
+        write_order_row(rows, *row);
     }
-    sqlite3_finalize(stmt);
-
-    // Create the JSON response
-    json::object response_body;
-    response_body["orders"] = orders_array;
-
-    std::string response_str;
-    try {
-        response_str = json::serialize(response_body);
-    } catch (const std::exception& e) {
-        std::cerr << "Error serializing JSON: " << e.what() << std::endl;
-        res.result(http::status::internal_server_error);
-        res.body() = "Error generating response";
-        return;
-    }
-
-    res.result(http::status::ok);
-    res.body() = response_str;
+    rows.finish();
+    my_orders_size.record(res.body().size());
 }
 
 
-void handle_all_services(const std::string& token, http::response<http::string_body>& res) {
-    // Query to retrieve all services
-    std::string sql = "SELECT service_id, service_name, price, capacity, working_hours, service_type FROM Usluge";
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        std::cerr << "Error preparing query: " << sqlite3_errmsg(db) << std::endl;
-        res.result(http::status::internal_server_error);
-        res.body() = "Database query error";
-        return;
-    }
-
-    // Create JSON response object
-    json::array services_array;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        json::object service;
-        service["service_id"] = sqlite3_column_int(stmt, 0);
-        service["service_name"] = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        service["price"] = sqlite3_column_double(stmt, 2);
-        service["capacity"] = sqlite3_column_int(stmt, 3);
-        service["working_hours"] = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4));
-        service["service_type"] = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5));
-        services_array.push_back(service);
-    }
-    sqlite3_finalize(stmt);
+static ResponseSizeEstimate all_services_size{4096};
+// This region's services, then the other regions' (pushed by central, see
+// "foreign services"), which carry their region id.
+static sql::Statement<sql::Params<>, sql::Columns<int, std::string_view, double, int, std::string_view, std::string_view,
+                                                  std::optional<std::string_view>>> select_all_services{
+    R"(SELECT service_id, service_name, price, capacity, working_hours, service_type, NULL FROM Usluge
+       UNION ALL
+       SELECT service_id, service_name, price, capacity, working_hours, service_type, region_id
+       FROM catalog.ForeignServices)"};
 
-    // Create the JSON response
-    json::object response_body;
-    response_body["services"] = services_array;
-
-    std::string response_str;
-    try {
-        response_str = json::serialize(response_body);
-    } catch (const std::exception& e) {
-        std::cerr << "Error serializing JSON: " << e.what() << std::endl;
-        res.result(http::status::internal_server_error);
-        res.body() = "Error generating response";
+void handle_all_services(const std::string& token, http::response<http::string_body>& res) {
+    // Retrieve all services
+    auto cursor = select_all_services.query(db);
+    if (!cursor) {
+        LOG_ERROR << "Error preparing query: " << sqlite3_errmsg(db);
+        reply(res, http::status::internal_server_error, "Database query error");
         return;
     }
 
-    res.result(http::status::ok);
-    res.body() = response_str;
+    // Write the response row by row
+    RowWriter rows = begin_rows(res, ResponseFormat::json, all_services_size, "services");
+    while (auto row = cursor.next()) {
+        auto [service_id, service_name, price, capacity, working_hours, service_type, region] = *row;
+        rows.begin_row();
+        rows.field("service_id", "ID", service_id);
+        rows.field("service_name", "Service Name", service_name);
+        rows.field("price", "Price", price);
+        rows.field("capacity", "Capacity", capacity);
+        rows.field("working_hours", "Hours", working_hours);
+        rows.field("service_type", "Type", service_type);
+        if (region) rows.field("region", "Region", *region);
+        rows.end_row();
+    }
+    rows.finish();
+    all_services_size.record(res.body().size());
 }
 
+static sql::Statement<sql::Params<std::string_view, int, std::string_view>, sql::Columns<>> update_order_status{
+    "UPDATE Orders SET status = ? WHERE order_id = ? AND buyer_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)"};
+
 void handle_update_order_status(
     const std::string& token,
     const std::string& body,
     http::response<http::string_body>& res
 ) {
     if (!is_token_valid(token)) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
     // Parse the body to extract order_id and status
     auto delimiter_pos = body.find('&');
     if (delimiter_pos == std::string::npos) {
-        res.result(http::status::bad_request);
-        res.body() = "Invalid body format";
+        reply(res, http::status::bad_request, "Invalid body format");
         return;
     }
 
@@ -1262,38 +1011,24 @@ void handle_update_order_status(
     // Extract status
     std::string status = body.substr(delimiter_pos + 1);
 
-    // Prepare SQL statement
-    std::string sql = "UPDATE Orders SET status = ? WHERE order_id = ? AND buyer_id = (SELECT user_id FROM Sessions WHERE auth_token = ?)";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error preparing SQL statement: " + std::string(sqlite3_errmsg(db));
-        return;
-    }
-
-    // Bind parameters
-    sqlite3_bind_text(stmt, 1, status.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, std::stoi(order_id_str));
-    sqlite3_bind_text(stmt, 3, token.c_str(), -1, SQLITE_STATIC);
-
-    // Execute the SQL statement
-    if (sqlite3_step(stmt) == SQLITE_DONE) {
-        res.result(http::status::ok);
-        res.body() = "Order status updated successfully";
+    auto cursor = update_order_status.query(db, status, std::stoi(order_id_str), token);
+    if (!cursor) {
+        reply(res, http::status::internal_server_error, "Error preparing SQL statement: " + std::string(sqlite3_errmsg(db)));
+    } else if (cursor.step(), cursor.done()) {
+        reply(res, http::status::ok, "Order status updated successfully");
     } else {
-        res.result(http::status::internal_server_error);
-        res.body() = "Error updating order status: " + std::string(sqlite3_errmsg(db));
+        reply(res, http::status::internal_server_error, "Error updating order status: " + std::string(sqlite3_errmsg(db)));
     }
-
-    // Finalize the statement
-    sqlite3_finalize(stmt);
 }
 
+static sql::Statement<sql::Params<std::string_view>, sql::Columns<>> complete_order{
+    "UPDATE Orders SET status = 'completed' WHERE order_id = ?"};
+static sql::Statement<sql::Params<std::string_view>, sql::Columns<>> cancel_order{
+    "UPDATE Orders SET status = 'cancelled' WHERE order_id = ?"};
+
 void handle_order_actions(const std::string& body, const std::string& token, http::response<http::string_body>& res) {
     if (!is_token_valid(token)) {
-        res.result(http::status::unauthorized);
-        res.body() = "Invalid or missing token";
+        reply(res, http::status::unauthorized, "Invalid or missing token");
         return;
     }
 
@@ -1310,59 +1045,118 @@ void handle_order_actions(const std::string& body, const std::string& token, htt
     }
 
     if (action == "complete") {
-        std::string update_sql = "UPDATE Orders SET status = 'completed' WHERE order_id = ?";
-        sqlite3_stmt* stmt;
-        if (sqlite3_prepare_v2(db, update_sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, order_id.c_str(), -1, SQLITE_STATIC);
-
-            if (sqlite3_step(stmt) == SQLITE_DONE) {
-                res.result(http::status::ok);
-                res.body() = "Order completed successfully";
-            } else {
-                res.result(http::status::internal_server_error);
-                res.body() = "Error completing order: " + std::string(sqlite3_errmsg(db));
-            }
-            sqlite3_finalize(stmt);
+        auto cursor = complete_order.query(db, order_id);
+        if (!cursor) {
+            reply(res, http::status::internal_server_error, "Error preparing complete order query: " + std::string(sqlite3_errmsg(db)));
+        } else if (cursor.step(), cursor.done()) {
+            reply(res, http::status::ok, "Order completed successfully");
         } else {
-            res.result(http::status::internal_server_error);
-            res.body() = "Error preparing complete order query: " + std::string(sqlite3_errmsg(db));
+            reply(res, http::status::internal_server_error, "Error completing order: " + std::string(sqlite3_errmsg(db)));
         }
     } else if (action == "cancel") {
-        std::string update_sql = "UPDATE Orders SET status = 'cancelled' WHERE order_id = ?";
-        sqlite3_stmt* stmt;
-        if (sqlite3_prepare_v2(db, update_sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, order_id.c_str(), -1, SQLITE_STATIC);
-
-            if (sqlite3_step(stmt) == SQLITE_DONE) {
-                res.result(http::status::ok);
-                res.body() = "Order cancelled successfully";
-            } else {
-                res.result(http::status::internal_server_error);
-                res.body() = "Error cancelling order: " + std::string(sqlite3_errmsg(db));
-            }
-            sqlite3_finalize(stmt);
+        auto cursor = cancel_order.query(db, order_id);
+        if (!cursor) {
+            reply(res, http::status::internal_server_error, "Error preparing cancel order query: " + std::string(sqlite3_errmsg(db)));
+        } else if (cursor.step(), cursor.done()) {
+            reply(res, http::status::ok, "Order cancelled successfully");
         } else {
-            res.result(http::status::internal_server_error);
-            res.body() = "Error preparing cancel order query: " + std::string(sqlite3_errmsg(db));
+            reply(res, http::status::internal_server_error, "Error cancelling order: " + std::string(sqlite3_errmsg(db)));
         }
     } else {
-        res.result(http::status::bad_request);
-        res.body() = "Invalid action specified";
+        reply(res, http::status::bad_request, "Invalid action specified");
     }
 }
 
 
 
 
+// SQLite page cache hits and misses for the shared connection, read at
+// scrape time.
+void render_page_cache_metrics(std::string& out) {
+    int hits = 0, misses = 0, unused = 0;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &hits, &unused, 0);
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &misses, &unused, 0);
+    out += "# HELP sqlite_page_cache_total SQLite page cache lookups, by result\n"
+           "# TYPE sqlite_page_cache_total counter\n";
+    metrics::Registry::sample(out, "sqlite_page_cache_total", "result=\"hit\"", hits);
+    metrics::Registry::sample(out, "sqlite_page_cache_total", "result=\"miss\"", misses);
+}
+
+// Prometheus scrape endpoint. Always text, whatever the Accept header says.
+void handle_metrics(http::response<http::string_body>& res) {
+    res.result(http::status::ok);
+    res.set(http::field::content_type, "text/plain; version=0.0.4");
+    res.body().clear();
+    res.body().reserve(64 * 1024);
+    metrics::Registry::global().render(res.body());
+}
+
+// Set by --sql-profile / --slow-query-ms
+sql::Profiler sql_profiler;
+bool sql_profiling = false;
+
+static ResponseSizeEstimate sql_profile_size{4096};
+
+// Per-statement aggregates from the SQLite profiler, busiest first.
+void handle_sql_profile(http::response<http::string_body>& res) {
+    if (!sql_profiling) {
+        reply(res, http::status::not_found, "SQL profiling is not enabled (start with --sql-profile)");
+        return;
+    }
+    RowWriter rows = begin_rows(res, ResponseFormat::text, sql_profile_size, "statements", "SQL profile:\n", "No statements recorded.");
+    for (const sql::Profiler::Entry& entry : sql_profiler.snapshot()) {
+        rows.begin_row();
+        rows.field("calls", "Calls", static_cast<long long>(entry.calls));
+        rows.field("total_ms", "Total ms", entry.total_ns / 1e6);
+        rows.field("max_ms", "Max ms", entry.max_ns / 1e6);
+        rows.field("rows", "Rows", static_cast<long long>(entry.rows));
+        rows.field("statement", "SQL", entry.statement);
+        rows.end_row();
+    }
+    rows.finish();
+    sql_profile_size.record(res.body().size());
+}
+
+static ResponseSizeEstimate contention_size(1024);
+
+// GET /debug/contention: wait/hold percentiles per instrumented lock and
+// queue-wait/depth percentiles per worker queue (see contention.hpp).
+void handle_contention(http::response<http::string_body>& res) {
+    RowWriter rows = begin_rows(res, ResponseFormat::text, contention_size, "contention", "Contention (times in us):\n");
+    for (const contention::Summary& s : contention::summary()) {
+        rows.begin_row();
+        rows.field("kind", "Kind", s.kind);
+        rows.field("name", "Name", s.name);
+        if (s.kind == "lock") {
+            rows.field("acquisitions", "Acquisitions", static_cast<long long>(s.acquisitions));
+            rows.field("contended", "Contended", static_cast<long long>(s.contended));
+        } else {
+            rows.field("items", "Items", static_cast<long long>(s.acquisitions));
+        }
+        rows.field("wait_p50_us", "Wait p50", s.wait_p50 / 1e3);
+        rows.field("wait_p99_us", "Wait p99", s.wait_p99 / 1e3);
+        rows.field("wait_max_us", "Wait max", s.wait_max / 1e3);
+        if (s.kind == "lock") {
+            rows.field("hold_p50_us", "Hold p50", s.hold_p50 / 1e3);
+            rows.field("hold_p99_us", "Hold p99", s.hold_p99 / 1e3);
+        } else {
+            rows.field("depth_p50", "Depth p50", static_cast<long long>(s.depth_p50));
+            rows.field("depth_p99", "Depth p99", static_cast<long long>(s.depth_p99));
+            rows.field("depth_max", "Depth max", static_cast<long long>(s.depth_max));
+        }
+        rows.end_row();
+    }
+    rows.finish();
+    contention_size.record(res.body().size());
+}
+
 // Main request handler function
-void handle_request(http::request<http::string_body> req, http::response<http::string_body>& res) {
+void handle_request(const http::request<http::string_body>& req, http::response<http::string_body>& res) {
     std::string body = req.body();
-    std::string token = std::string(req[http::field::authorization]);
-    std::cerr << "HANDLE REQUEST TEST TARGET: " << req.target() << "\n";
-    std::cerr << "HANDLE REQUEST TEST METHOD: " << req.method() << "\n";
-    std::cerr << "HANDLE REQUEST BODY: " << req.body() << "\n";
+    std::string token = bearer_token(req[http::field::authorization]);
+    LOG_DEBUG << req.method_string() << ' ' << req.target() << " body: " << logger::redacted_form(body);
 
-    std::cerr << "TOKEN: " << token;
+    negotiate_format(req, res);
 
     if (req.method() == http::verb::post) {
         if (req.target() == "/login") {
@@ -1386,12 +1180,10 @@ void handle_request(http::request<http::string_body> req, http::response<http::s
         } else if (req.target() == "/update_order_status") {
             handle_update_order_status(token, body, res);
         } else {
-            res.result(http::status::not_found);
-            res.body() = "Endpoint not found";
+            reply(res, http::status::not_found, "Endpoint not found");
         }
     } else if (req.method() == http::verb::get) {
         if (req.target() == "/my_orders") {
-            std::cerr << "HANDLE REQUEST OK\n";
             handle_my_orders(token, res);
         } else if (req.target() == "/all_services") {
             handle_all_services(token, res);
@@ -1401,87 +1193,1291 @@ void handle_request(http::request<http::string_body> req, http::response<http::s
             handle_loyalty_sellers(token, res);
         } else if (req.target() == "/my_services") {
             handle_my_services(token, res);
+        } else {
+            reply(res, http::status::not_found, "Endpoint not found");
         }
     } else {
-        res.result(http::status::method_not_allowed);
-        res.body() = "Method not allowed";
+        reply(res, http::status::method_not_allowed, "Method not allowed");
     }
 }
 
+// Runs a request through handle_request and settles the Content-Type. Shared
+// by the HTTP and binary transports.
+// Route label for request metrics: the endpoint path for known routes, so
+// arbitrary targets can't grow the label set.
+std::string_view route_label(const http::request<http::string_body>& req) {
+    std::string_view target(req.target().data(), req.target().size());
+    if (const binproto::Route* route = binproto::find_route(req.method() == http::verb::post, target)) {
+        return route->target;
+    }
+    return "other";
+}
+
+static metrics::Family<metrics::Counter>& requests_total = metrics::Registry::global()
+    .counter_family("regional_http_requests_total", "Requests handled, by route and status");
+static metrics::Family<metrics::Histogram>& request_duration = metrics::Registry::global()
+    .histogram_family("regional_http_request_duration_seconds", "Request handling time, by route");
+static metrics::Gauge& requests_in_flight = metrics::Registry::global()
+    .gauge("regional_http_requests_in_flight", "Requests currently being handled");
+
+void dispatch(const http::request<http::string_body>& req, http::response<http::string_body>& res) {
+    auto start = std::chrono::steady_clock::now();
+    requests_in_flight.add();
+    try {
+        handle_request(req, res);
+    } catch (const std::invalid_argument&) {
+        // Malformed form encoding or a non-numeric id/quantity
+        reply(res, http::status::bad_request, "Malformed request");
+    } catch (const std::out_of_range&) {
+        reply(res, http::status::bad_request, "Malformed request");
+    }
+    response_format(res); // text/plain unless a handler or the client chose JSON
+    requests_in_flight.sub();
+
+    std::string route = metrics::label("route", route_label(req));
+    request_duration.with(route).record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    requests_total.with(route + ",status=\"" + std::to_string(res.result_int()) + "\"").add();
+}
+
+// Trace span name for a request: method and route label.
+std::string span_name(const http::request<http::string_body>& req) {
+    std::string name(req.method_string());
+    name += ' ';
+    name += route_label(req);
+    return name;
+}
+
 void session(tcp::socket socket) {
     try {
         beast::flat_buffer buffer;
         http::request<http::string_body> req;
+        int64_t read_start = tracing::enabled() ? tracing::now_us() : 0;
         http::read(socket, buffer, req);
 
-        http::response<http::string_body> res{http::status::ok, req.version()};
-        handle_request(req, res);
+        // The request's root span continues the caller's trace when it sent
+        // a traceparent, and starts where reading the request began.
+        tracing::Context parent;
+        std::string name;
+        if (tracing::enabled()) {
+            auto traceparent = req["traceparent"];
+            tracing::parse_traceparent(std::string_view(traceparent.data(), traceparent.size()), parent);
+            name = span_name(req);
+        }
+        tracing::Span request_span(name, parent, read_start);
+        tracing::record_child("parse", read_start, tracing::now_us());
 
-        res.set(http::field::content_type, "text/plain");
+        http::response<http::string_body> res{http::status::ok, req.version()};
+        dispatch(req, res);
+        tracing::Span serialize_span("serialize");
         res.prepare_payload();
         http::write(socket, res);
     } catch (std::exception& e) {
-        std::cerr << "Exception in session: " << e.what() << "\n";
+        LOG_WARN << "Exception in session: " << e.what();
     }
 }
 
+static metrics::Family<metrics::Counter>& connections_accepted = metrics::Registry::global()
+    .counter_family("regional_connections_accepted_total", "Accepted client connections, by listener");
+
 void server(boost::asio::io_context& io_context, unsigned short port) {
+    static metrics::Counter& accepted = connections_accepted.with(metrics::label("listener", "http"));
     tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), port));
     for (;;) {
         tcp::socket socket(io_context);
         acceptor.accept(socket);
+        accepted.add();
         std::thread(session, std::move(socket)).detach();
     }
 }
 
-// Adjusted sync_with_central_server function
-void sync_with_central_server(const std::string& central_server_address, unsigned short central_server_port, const std::string& regional_server_id, int sync_interval) {
+// Serves GET /metrics, GET /admin/sql_profile and GET /debug/contention on
+// their own port and thread (--metrics-port), off the public user port: they
+// expose SQL text, slow-query parameters and lock names.
+void metrics_server(unsigned short port) {
     try {
         boost::asio::io_context io_context;
-
-        while (true) {
-            // Create a TCP socket
+        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), port));
+        for (;;) {
             tcp::socket socket(io_context);
-            tcp::resolver resolver(io_context);
-            auto endpoints = resolver.resolve(central_server_address, std::to_string(central_server_port));
-            boost::asio::connect(socket, endpoints);
+            acceptor.accept(socket);
+            try {
+                beast::flat_buffer buffer;
+                http::request<http::string_body> req;
+                http::read(socket, buffer, req);
+
+                http::response<http::string_body> res{http::status::ok, req.version()};
+                if (req.method() == http::verb::get && req.target() == "/metrics") {
+                    handle_metrics(res);
+                } else if (req.method() == http::verb::get && req.target() == "/admin/sql_profile") {
+                    handle_sql_profile(res);
+                } else if (req.method() == http::verb::get && req.target() == "/debug/contention") {
+                    handle_contention(res);
+                } else {
+                    reply(res, http::status::not_found, "Endpoint not found");
+                }
+                response_format(res);
+                res.prepare_payload();
+                http::write(socket, res);
+            } catch (const std::exception& e) {
+                LOG_WARN << "Metrics request failed: " << e.what();
+            }
+        }
+    } catch (const std::exception& e) {
+        LOG_ERROR << "Metrics server error: " << e.what();
+    }
+}
 
-            // Prepare synchronization data
-            std::string sync_data = "Sync data from " + regional_server_id; // Replace with actual data retrieval logic
-            std::cout << "Syncing data: " << sync_data << "\n"; // Display the data being synced
+// One connection on the binary listener (see binary_protocol.hpp). A reader
+// thread pulls frames off the socket and hands each request to the shared
+// worker pool, so many requests can be in flight at once; replies are written
+// back in completion order, tagged with their request id.
+class BinaryConnection : public std::enable_shared_from_this<BinaryConnection> {
+public:
+    // Requests a single connection may have queued or running before the
+    // reader stops pulling frames off the socket.
+    static constexpr unsigned kMaxInFlight = 64;
 
-            // Create HTTP request for synchronization
-            http::request<http::string_body> req{http::verb::post, "/sync", 11};
-            req.set(http::field::host, central_server_address);
-            req.set(http::field::content_type, "application/json");
-            req.body() = sync_data; // Set the body of the request with the sync data
-            req.prepare_payload();
+    explicit BinaryConnection(tcp::socket socket) : socket_(std::move(socket)) {}
 
-            // Send the request to the central server
-            http::write(socket, req);
+    void run(boost::asio::thread_pool& workers, contention::QueueStats& worker_queue) {
+        try {
+            for (;;) {
+                char header[wire::kFrameHeaderSize];
+                boost::asio::read(socket_, boost::asio::buffer(header));
+                uint32_t length = wire::get_frame_length(header);
+                if (length > binproto::kMaxFrameSize) {
+                    LOG_WARN << "Binary frame too large: " << length;
+                    break;
+                }
+                std::string frame(length, '\0');
+                boost::asio::read(socket_, boost::asio::buffer(&frame[0], frame.size()));
 
-            // Handle response (optional)
-            beast::flat_buffer buffer;
-            http::response<http::string_body> res;
-            http::read(socket, buffer, res);
+                {
+                    std::unique_lock<contention::Mutex> lock(inflight_mutex_);
+                    inflight_cv_.wait(lock, [this] { return inflight_ < kMaxInFlight; });
+                    ++inflight_;
+                }
+                auto self = shared_from_this();
+                contention::post(workers, worker_queue, [self, frame = std::move(frame)] {
+                    self->handle_frame(frame);
+                    std::lock_guard<contention::Mutex> lock(self->inflight_mutex_);
+                    --self->inflight_;
+                    self->inflight_cv_.notify_one();
+                });
+            }
+        } catch (const boost::system::system_error& e) {
+            // EOF just means the client hung up
+            if (e.code() != boost::asio::error::eof) {
+                LOG_WARN << "Exception in binary session: " << e.what();
+            }
+        }
+    }
 
-            std::cout << "Response from central server: " << res.body() << "\n";
+private:
+    void handle_frame(const std::string& frame) {
+        binproto::Request breq;
+        binproto::Response bres;
+        http::response<http::string_body> res{http::status::ok, 11};
+        int64_t decode_start = tracing::enabled() ? tracing::now_us() : 0;
+        bool decoded = binproto::decode_request(frame, breq);
+        tracing::Context parent;
+        if (decoded && (breq.flags & binproto::kFlagTrace)) tracing::parse_traceparent(breq.traceparent, parent);
+        const binproto::Route* route = decoded ? binproto::find_route(breq.opcode) : nullptr;
+        tracing::Span request_span(route ? route->target : "binary", parent, decode_start);
+        tracing::record_child("parse", decode_start, tracing::now_us());
+
+        if (!decoded) {
+            reply(res, http::status::bad_request, "Malformed frame");
+        } else if (route) {
+            http::request<http::string_body> req{route->post ? http::verb::post : http::verb::get, route->target, 11};
+            if (!breq.token.empty()) {
+                req.set(http::field::authorization, beast::string_view(breq.token.data(), breq.token.size()));
+            }
+            if (breq.flags & binproto::kFlagJson) {
+                req.set(http::field::accept, "application/json");
+            }
+            req.body().assign(breq.body.data(), breq.body.size());
+            dispatch(req, res);
+        } else {
+            reply(res, http::status::not_found, "Unknown opcode");
+        }
+        response_format(res);
+
+        tracing::Span serialize_span("serialize");
+        bres.id = breq.id;
+        bres.status = res.result_int();
+        bres.flags = res[http::field::content_type] == "application/json" ? binproto::kFlagJson : 0;
+        bres.body = res.body();
+        std::string out;
+        out.reserve(res.body().size() + 16);
+        binproto::encode_response(out, bres);
+
+        std::lock_guard<contention::Mutex> lock(write_mutex_);
+        boost::system::error_code ec;
+        boost::asio::write(socket_, boost::asio::buffer(out), ec);
+    }
+
+    tcp::socket socket_;
+    contention::Mutex write_mutex_{"binary_write"};
+    contention::Mutex inflight_mutex_{"binary_inflight"};
+    std::condition_variable_any inflight_cv_;
+    unsigned inflight_ = 0;
+};
+
+void binary_server(boost::asio::io_context& io_context, unsigned short port) {
+    boost::asio::thread_pool workers(std::max(2u, std::thread::hardware_concurrency()));
+    static contention::QueueStats worker_queue("binary_workers");
+    static metrics::Counter& accepted = connections_accepted.with(metrics::label("listener", "binary"));
+    tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), port));
+    for (;;) {
+        tcp::socket socket(io_context);
+        acceptor.accept(socket);
+        accepted.add();
+        auto connection = std::make_shared<BinaryConnection>(std::move(socket));
+        std::thread([connection, &workers] { connection->run(workers, worker_queue); }).detach();
+    }
+}
 
-            // Close the socket
-            socket.close();
+// ---- change data capture ----------------------------------------------------
+//
+// Triggers on the replicated tables append (table, primary key, op) to
+// Changelog, whose AUTOINCREMENT seq is the replication position. A sync
+// cycle ships the current image of every key changed since the last seq
+// central acknowledged, so its cost follows the number of changed rows, not
+// the size of the database. Keys changed several times go out once.
+
+struct ReplicatedTable {
+    const char* table; // SQLite table
+    const syncproto::Table& wire;
+};
+
+static const ReplicatedTable replicated_tables[] = {
+    {"Korisnici", syncproto::kTables[0]},
+    {"Usluge", syncproto::kTables[1]},
+    {"Narudzbe", syncproto::kTables[2]},
+    {"Lojalnosti", syncproto::kTables[3]},
+};
+
+// Row image per replicated table, in the same order, with the columns of
+// syncproto::schema. Passwords never leave the region.
+using RowImageStatement = sql::Statement<sql::Params<int64_t>, sql::Columns<>>;
+static RowImageStatement select_row_image[] = {
+    RowImageStatement{"SELECT user_id, username, email, user_type FROM Korisnici WHERE user_id = ?"},
+    RowImageStatement{R"(SELECT service_id, seller_id, service_name, price, capacity, working_hours, service_type,
+                                loyalty_requirement, loyalty_discount FROM Usluge WHERE service_id = ?)"},
+    RowImageStatement{"SELECT order_id, buyer_id, seller_id, service_id, quantity, cost, order_status FROM Narudzbe WHERE order_id = ?"},
+    RowImageStatement{"SELECT loyalty_id, buyer_id, seller_id, loyalty_points FROM Lojalnosti WHERE loyalty_id = ?"},
+};
+
+// Hash tree per replicated table, in the same order, of the row images
+// central was last sent (see anti_entropy). Built at startup from the tables,
+// then updated by the sync thread only, as it ships changes.
+static std::array<merkle::Tree, std::size(replicated_tables)> hash_trees;
+
+// Reads a row image (the wire columns, from column 0) into `values`; text
+// views are valid until the statement steps on.
+void read_row_image(sqlite3_stmt* stmt, const syncproto::Table& wire, syncproto::Value* values) {
+    for (size_t i = 0; i < wire.column_count; ++i) {
+        int col = static_cast<int>(i);
+        syncproto::Value& v = values[i];
+        v = {};
+        v.null = sqlite3_column_type(stmt, col) == SQLITE_NULL;
+        if (v.null) continue;
+        switch (wire.columns[i].type) {
+            case syncproto::ColumnType::integer: v.integer = sqlite3_column_int64(stmt, col); break;
+            case syncproto::ColumnType::real: v.real = sqlite3_column_double(stmt, col); break;
+            case syncproto::ColumnType::text: v.text = sql::column<std::string_view>::get(stmt, col); break;
+        }
+    }
+}
 
-            // Wait for the specified interval (in minutes) before the next sync
-            std::this_thread::sleep_for(std::chrono::minutes(sync_interval)); // Wait based on minutes
+// Hashes every replicated row into hash_trees. Pending changelog entries
+// don't matter: anti-entropy only runs once they have been shipped.
+bool load_hash_trees() {
+    auto start = std::chrono::steady_clock::now();
+    size_t rows = 0;
+    for (size_t t = 0; t < std::size(replicated_tables); ++t) {
+        const syncproto::Table& wire = replicated_tables[t].wire;
+        std::string sql = "SELECT ";
+        for (size_t i = 0; i < wire.column_count; ++i) sql += std::string(i ? ", " : "") + wire.columns[i].name;
+        sql += std::string(" FROM ") + replicated_tables[t].table;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            LOG_ERROR << "Failed to read " << replicated_tables[t].table << ": " << sqlite3_errmsg(db);
+            return false;
+        }
+        std::array<syncproto::Value, syncproto::kMaxColumns> values;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            read_row_image(stmt, wire, values.data());
+            hash_trees[t].set(values[0].integer, merkle::row_hash(wire, values.data()));
+            ++rows;
+        }
+        sqlite3_finalize(stmt);
+    }
+    LOG_INFO << "Hash trees: " << rows << " rows in "
+             << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+             << " ms";
+    return true;
+}
+
+// current_traceparent(): the calling thread's span as a traceparent, or NULL
+// outside a traced request.
+void current_traceparent(sqlite3_context* context, int, sqlite3_value**) {
+    const tracing::Context& ctx = tracing::current();
+    if (!ctx.valid()) {
+        sqlite3_result_null(context);
+        return;
+    }
+    std::string traceparent = tracing::format_traceparent(ctx);
+    sqlite3_result_text(context, traceparent.data(), static_cast<int>(traceparent.size()), SQLITE_TRANSIENT);
+}
+
+// Creates Changelog, SyncState and the capture triggers. The first time, every
+// existing row is queued so central receives a full initial copy.
+bool init_change_capture() {
+    std::string sql = R"(
+        CREATE TABLE IF NOT EXISTS Changelog (
+            seq INTEGER PRIMARY KEY AUTOINCREMENT,
+            table_name TEXT NOT NULL,
+            row_id INTEGER NOT NULL,
+            op TEXT NOT NULL,
+            changed_at INTEGER NOT NULL DEFAULT (CAST((julianday('now') - 2440587.5) * 86400000 AS INTEGER)), -- unix ms
+            traceparent TEXT -- of the request that wrote the change, when tracing
+        );
+        CREATE TABLE IF NOT EXISTS SyncState (
+            id INTEGER PRIMARY KEY CHECK (id = 1),
+            acked_seq INTEGER NOT NULL
+        );
+    )";
+    for (const ReplicatedTable& t : replicated_tables) {
+        std::string tag = t.wire.name, key = t.wire.columns[0].name;
+        std::string prefix = "CREATE TRIGGER IF NOT EXISTS " + tag + "_cdc_";
+        std::string insert = " BEGIN INSERT INTO Changelog (table_name, row_id, op) VALUES ('" + tag + "', ";
+        sql += prefix + "insert AFTER INSERT ON " + t.table + insert + "NEW." + key + ", 'upsert'); END;\n";
+        sql += prefix + "update AFTER UPDATE ON " + t.table + insert + "NEW." + key + ", 'upsert'); END;\n";
+        sql += prefix + "delete AFTER DELETE ON " + t.table + insert + "OLD." + key + ", 'delete'); END;\n";
+    }
+
+    // Seed on first run (no SyncState row yet)
+    sql += "BEGIN;\n";
+    for (const ReplicatedTable& t : replicated_tables) {
+        sql += std::string("INSERT INTO Changelog (table_name, row_id, op) SELECT '") + t.wire.name + "', " +
+               t.wire.columns[0].name + ", 'upsert' FROM " + t.table + " WHERE NOT EXISTS (SELECT 1 FROM SyncState);\n";
+    }
+    sql += "INSERT OR IGNORE INTO SyncState (id, acked_seq) VALUES (1, 0);\nCOMMIT;\n";
+
+    char* err_msg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        LOG_ERROR << "Failed to set up change capture: " << err_msg;
+        sqlite3_free(err_msg);
+        return false;
+    }
+
+    // Changelogs from before tracing lack the traceparent column.
+    sqlite3_stmt* stmt;
+    bool has_traceparent = false;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('Changelog') WHERE name = 'traceparent'", -1, &stmt,
+                           nullptr) == SQLITE_OK) {
+        has_traceparent = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    std::string trace = has_traceparent ? "" : "ALTER TABLE Changelog ADD COLUMN traceparent TEXT;\n";
+    // The writing request's context is filled in by a TEMP trigger, which
+    // exists only on this connection: the persistent triggers stay free of
+    // current_traceparent(), so other programs can still write the tables.
+    if (tracing::enabled()) {
+        if (sqlite3_create_function(db, "current_traceparent", 0, SQLITE_UTF8, nullptr, current_traceparent, nullptr,
+                                    nullptr) != SQLITE_OK) {
+            LOG_ERROR << "Failed to register current_traceparent: " << sqlite3_errmsg(db);
+            return false;
+        }
+        trace += R"(
+            CREATE TEMP TRIGGER IF NOT EXISTS changelog_traceparent AFTER INSERT ON main.Changelog
+            WHEN current_traceparent() IS NOT NULL
+            BEGIN UPDATE Changelog SET traceparent = current_traceparent() WHERE seq = NEW.seq; END;
+        )";
+    }
+    if (!trace.empty() && sqlite3_exec(db, trace.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        LOG_ERROR << "Failed to set up change tracing: " << err_msg;
+        sqlite3_free(err_msg);
+        return false;
+    }
+    return true;
+}
+
+static sql::Statement<sql::Params<>, sql::Columns<int64_t>> select_acked_seq{
+    "SELECT acked_seq FROM SyncState WHERE id = 1"};
+// One entry per changed key, positioned at its latest change (SQLite takes
+// the bare columns from the MAX(seq) row), with the traceparents of every
+// traced request that changed it, comma-separated.
+static sql::Statement<sql::Params<int64_t, int>,
+                      sql::Columns<int64_t, std::string, int64_t, std::string, std::string_view>> select_changes{
+    R"(SELECT MAX(seq), table_name, row_id, op, group_concat(DISTINCT traceparent) FROM Changelog WHERE seq > ?
+       GROUP BY table_name, row_id ORDER BY 1 LIMIT ?)"};
+static sql::Statement<sql::Params<int64_t>, sql::Columns<>> update_acked_seq{
+    "UPDATE SyncState SET acked_seq = ? WHERE id = 1"};
+static sql::Statement<sql::Params<int64_t>, sql::Columns<>> prune_changelog{
+    "DELETE FROM Changelog WHERE seq <= ?"};
+
+// Adds the current image of a row to the batch, and its hash to the table's
+// hash tree. Returns false if the row no longer exists (it was deleted after
+// the change being shipped).
+bool add_row_image(syncproto::BatchWriter& batch, size_t table, uint64_t seq, int64_t row_id) {
+    auto cursor = select_row_image[table].query(db, row_id);
+    if (!cursor || !cursor.step()) return false;
+    const syncproto::Table& wire = replicated_tables[table].wire;
+    std::array<syncproto::Value, syncproto::kMaxColumns> values;
+    read_row_image(cursor.get(), wire, values.data());
+    batch.upsert(wire, seq, values.data()); // copies the text before the cursor steps on
+    hash_trees[table].set(row_id, merkle::row_hash(wire, values.data()));
+    return true;
+}
+
+static metrics::Counter& sync_changes_shipped = metrics::Registry::global()
+    .counter("regional_sync_changes_shipped_total", "Changed rows shipped to the central server");
+static metrics::Gauge& sync_acked_seq = metrics::Registry::global()
+    .gauge("regional_sync_acked_seq", "Last changelog position acknowledged by the central server");
+
+static metrics::Counter& sync_bytes_sent = metrics::Registry::global()
+    .counter("regional_sync_bytes_sent_total", "Encoded (and possibly compressed) sync batch bodies sent");
+
+// Changes shipped per batch; a backlog drains over several pipelined batches.
+constexpr int kSyncBatchSize = 500;
+
+// A persistent connection to central's sync port. Asio's blocking calls
+// can't time out, so each operation runs the async form on a private
+// io_context for at most `timeout` and closes the socket if it expires.
+class SyncConnection {
+public:
+    explicit SyncConnection(std::chrono::milliseconds timeout) : socket_(io_context_), timeout_(timeout) {}
+
+    void connect(const std::string& host, unsigned short port) {
+        tcp::resolver resolver(io_context_);
+        auto endpoints = resolver.resolve(host, std::to_string(port));
+        run([&](auto handler) {
+            boost::asio::async_connect(socket_, endpoints,
+                [handler](const boost::system::error_code& ec, const tcp::endpoint&) { handler(ec, 0); });
+        });
+    }
+
+    void send(const std::string& frame) {
+        run([&](auto handler) { boost::asio::async_write(socket_, boost::asio::buffer(frame), handler); });
+    }
+
+    // Frames central sends unprompted (CatalogUpdate) go to `handler` as
+    // they turn up, between the replies receive() returns.
+    void on_push(std::function<void(std::string_view)> handler) { on_push_ = std::move(handler); }
+
+    // Reads the next reply, handing pushed frames read on the way to the
+    // push handler.
+    std::string receive() {
+        for (;;) {
+            std::string payload = read_frame();
+            syncproto::MessageType type;
+            if (!on_push_ || !syncproto::decode_type(payload, type) || type != syncproto::MessageType::catalog_update) {
+                return payload;
+            }
+            on_push_(payload);
+        }
+    }
+
+    // Handles pushed frames that have arrived while idle, without waiting
+    // for more.
+    void poll() {
+        while (socket_.available() > 0) {
+            std::string payload = read_frame();
+            syncproto::MessageType type;
+            if (!on_push_ || !syncproto::decode_type(payload, type) || type != syncproto::MessageType::catalog_update) {
+                throw std::runtime_error("unexpected frame from central server");
+            }
+            on_push_(payload);
+        }
+    }
+
+private:
+    std::string read_frame() {
+        char header[wire::kFrameHeaderSize];
+        run([&](auto handler) { boost::asio::async_read(socket_, boost::asio::buffer(header), handler); });
+        uint32_t length = wire::get_frame_length(header);
+        if (length > syncproto::kMaxFrameSize) throw std::runtime_error("sync reply frame too large");
+        std::string payload(length, '\0');
+        run([&](auto handler) { boost::asio::async_read(socket_, boost::asio::buffer(&payload[0], length), handler); });
+        return payload;
+    }
+
+    template <typename Start>
+    void run(Start&& start) {
+        boost::system::error_code result = boost::asio::error::would_block;
+        start([&result](const boost::system::error_code& ec, std::size_t) { result = ec; });
+        io_context_.restart();
+        io_context_.run_for(timeout_);
+        if (result == boost::asio::error::would_block) {
+            socket_.close(); // cancels the operation
+            io_context_.restart();
+            io_context_.run();
+            throw std::runtime_error("sync connection timed out");
+        }
+        if (result) throw boost::system::system_error(result);
+    }
+
+    boost::asio::io_context io_context_;
+    tcp::socket socket_;
+    std::chrono::milliseconds timeout_;
+    std::function<void(std::string_view)> on_push_;
+};
+
+// Batches sent ahead of central's acks. Central answers in order, so the
+// window only has to cover one round trip plus central's insert time.
+constexpr size_t kSyncWindow = 4;
+
+// Encodes the changes after `after_seq` (at most kSyncBatchSize keys) into a
+// Batch frame and returns its row count. `last_seq` is set to the batch's
+// last seq, or left at `after_seq` when there is nothing to ship. When
+// tracing, `writers` gets the contexts of the requests that wrote them.
+size_t build_batch(std::string& frame, const std::string& regional_server_id, const std::string& traceparent,
+                   bool compress, int64_t after_seq, int64_t& last_seq, std::vector<tracing::Context>& writers) {
+    syncproto::BatchWriter batch;
+    int64_t first_seq = 0;
+    last_seq = after_seq;
+    {
+        auto cursor = select_changes.query(db, after_seq, kSyncBatchSize);
+        while (auto row = cursor.next()) {
+            auto& [seq, table_name, row_id, op, traceparents] = *row;
+            if (!first_seq) first_seq = seq;
+            last_seq = seq;
+            for (std::string_view rest = traceparents; !rest.empty();) {
+                size_t comma = std::min(rest.find(','), rest.size());
+                tracing::Context writer;
+                if (tracing::parse_traceparent(rest.substr(0, comma), writer)) writers.push_back(writer);
+                rest.remove_prefix(std::min(comma + 1, rest.size()));
+            }
+            size_t table = 0;
+            while (table < std::size(replicated_tables) && table_name != replicated_tables[table].wire.name) ++table;
+            if (table == std::size(replicated_tables)) continue;
+
+            if (op != "upsert" || !add_row_image(batch, table, static_cast<uint64_t>(seq), row_id)) {
+                batch.remove(replicated_tables[table].wire, static_cast<uint64_t>(seq), row_id);
+                hash_trees[table].set(row_id, std::nullopt);
+            }
+        }
+    }
+    if (last_seq == after_seq) return 0;
+    sync_bytes_sent.add(batch.finish(frame, regional_server_id, static_cast<uint64_t>(first_seq),
+                                     static_cast<uint64_t>(last_seq), traceparent, compress));
+    return batch.rows();
+}
+
+// Ships every change after `acked_seq` (see sync_protocol.hpp), keeping up to
+// kSyncWindow batches unacknowledged. Each ack is persisted in SyncState and
+// the acknowledged prefix of Changelog dropped, so a restart resumes right
+// after it; whatever was in flight is resent and central skips what it
+// already stored. Returns the number of changes shipped.
+size_t ship_changes(SyncConnection& connection, const std::string& regional_server_id, const std::string& traceparent,
+                    uint64_t capabilities, int64_t& acked_seq) {
+    struct Sent {
+        int64_t last_seq;
+        size_t rows;
+        int64_t sent_us;                       // when tracing
+        std::vector<tracing::Context> writers; // likewise
+    };
+    const tracing::Context sync_pass = tracing::current(); // the caller's sync span
+    std::deque<Sent> inflight;
+    int64_t sent_seq = acked_seq;
+    size_t total = 0;
+    for (;;) {
+        while (inflight.size() < kSyncWindow) {
+            std::string frame;
+            int64_t last_seq;
+            std::vector<tracing::Context> writers;
+            size_t rows = build_batch(frame, regional_server_id, traceparent,
+                                      capabilities & syncproto::kCapCompression, sent_seq, last_seq, writers);
+            if (last_seq == sent_seq) break;
+            int64_t sent_us = tracing::enabled() ? tracing::now_us() : 0;
+            connection.send(frame);
+            inflight.push_back({last_seq, rows, sent_us, std::move(writers)});
+            sent_seq = last_seq;
+        }
+        if (inflight.empty()) return total;
+
+        uint64_t acked;
+        if (!syncproto::decode_ack(connection.receive(), acked) || acked != static_cast<uint64_t>(inflight.front().last_seq)) {
+            throw std::runtime_error("unexpected reply from central server");
+        }
+        if (update_acked_seq.exec(db, inflight.front().last_seq) != SQLITE_DONE
+            || prune_changelog.exec(db, inflight.front().last_seq) != SQLITE_DONE) {
+            LOG_ERROR << "Error recording sync position: " << sqlite3_errmsg(db);
+        }
+        acked_seq = inflight.front().last_seq;
+        sync_acked_seq.set(acked_seq);
+        if (!inflight.front().writers.empty()) {
+            int64_t acked_us = tracing::now_us();
+            std::string note = "up to seq " + std::to_string(acked_seq);
+            for (const tracing::Context& writer : inflight.front().writers) {
+                tracing::record_linked("replicate", writer, inflight.front().sent_us, acked_us, sync_pass, note);
+            }
+        }
+        sync_changes_shipped.add(inflight.front().rows);
+        total += inflight.front().rows;
+        inflight.pop_front();
+    }
+}
+
+static sql::Statement<sql::Params<>, sql::Columns<int64_t>> select_last_seq{
+    "SELECT COALESCE(MAX(seq), 0) FROM sqlite_sequence WHERE name = 'Changelog'"};
+
+// Opens the sync session (Hello/Welcome, see sync_protocol.hpp) and returns
+// the capabilities central granted. If central already stored changes past
+// SyncState (their ack was lost), the position moves up to its watermark so
+// they aren't resent.
+uint64_t handshake(SyncConnection& connection, const std::string& regional_server_id) {
+    syncproto::Hello hello;
+    hello.region_id = regional_server_id;
+    hello.capabilities = syncproto::kCapAll;
+    std::string frame;
+    syncproto::encode_hello(frame, hello);
+    connection.send(frame);
+
+    syncproto::Welcome welcome;
+    if (!syncproto::decode_welcome(connection.receive(), welcome)) {
+        throw std::runtime_error("unexpected reply to hello");
+    }
+
+    int64_t acked_seq = 0, last_seq = 0;
+    if (auto row = select_acked_seq.one(db)) acked_seq = std::get<0>(*row);
+    if (auto row = select_last_seq.one(db)) last_seq = std::get<0>(*row);
+    auto watermark = static_cast<int64_t>(welcome.watermark);
+    if (watermark > last_seq) {
+        // Another database sent changes under this region id.
+        LOG_WARN << "Central's watermark for " << regional_server_id << " (" << watermark
+                 << ") is past this database's changelog (" << last_seq << "); changes up to it will be skipped";
+    } else if (watermark > acked_seq) {
+        LOG_INFO << "Central already has changes up to seq " << watermark << " (acked " << acked_seq << ")";
+        if (update_acked_seq.exec(db, watermark) != SQLITE_DONE || prune_changelog.exec(db, watermark) != SQLITE_DONE) {
+            LOG_ERROR << "Error recording sync position: " << sqlite3_errmsg(db);
+        }
+        sync_acked_seq.set(watermark);
+    } else if (watermark < acked_seq) {
+        LOG_WARN << "Central's watermark for " << regional_server_id << " (" << watermark
+                 << ") is behind the acknowledged seq " << acked_seq << "; changes in between are not resent";
+    }
+    return welcome.capabilities;
+}
+
+// Sends a heartbeat and waits for central to echo it.
+void heartbeat(SyncConnection& connection) {
+    std::string frame;
+    syncproto::encode_heartbeat(frame);
+    connection.send(frame);
+    syncproto::MessageType type;
+    if (!syncproto::decode_type(connection.receive(), type) || type != syncproto::MessageType::heartbeat) {
+        throw std::runtime_error("unexpected reply to heartbeat");
+    }
+}
+
+// ---- anti-entropy -----------------------------------------------------------
+//
+// Acks say central stored a change, not that it still has it: a partition
+// restored from an old backup, a hand edit or a lost write leaves central
+// different from the region with nothing left in the changelog to fix it.
+// Every --anti-entropy-minutes, once the outbox is drained, the sync thread
+// compares its hash trees with central's (MerkleQuery, see merkle.hpp),
+// descending only into nodes whose hashes differ, and queues the rows that
+// differ in Changelog so the next cycle reships them with new seqs. In sync
+// this costs one round trip per table.
+
+// Set by --anti-entropy-minutes; zero turns it off.
+static std::chrono::minutes anti_entropy_interval{10};
+
+static metrics::Counter& anti_entropy_runs = metrics::Registry::global()
+    .counter("regional_anti_entropy_runs_total", "Hash tree comparisons with the central server");
+static metrics::Counter& anti_entropy_repairs = metrics::Registry::global()
+    .counter("regional_anti_entropy_repairs_total", "Rows found different on the central server and queued for resending");
+
+// Queues the keys as changes to ship: upserts for rows this region has, and
+// deletes for rows only central has. One statement per chunk, so each chunk
+// is a single commit.
+void queue_repairs(size_t table, const std::vector<int64_t>& keys) {
+    constexpr size_t kChunk = 1000;
+    const merkle::Tree& tree = hash_trees[table];
+    for (size_t first = 0; first < keys.size(); first += kChunk) {
+        std::string sql = "INSERT INTO Changelog (table_name, row_id, op) VALUES ";
+        for (size_t i = first; i < std::min(keys.size(), first + kChunk); ++i) {
+            int64_t key = keys[i];
+            sql += std::string(i > first ? ", " : "") + "('" + replicated_tables[table].wire.name + "', " +
+                   std::to_string(key) + (tree.contains(key) ? ", 'upsert')" : ", 'delete')");
+        }
+        char* err_msg = nullptr;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
+            LOG_ERROR << "Error queueing repairs: " << err_msg;
+            sqlite3_free(err_msg);
+            return;
+        }
+    }
+}
+
+// Compares every table's hash tree with central's and queues what differs.
+// Returns the number of rows queued.
+size_t anti_entropy(SyncConnection& connection) {
+    anti_entropy_runs.add();
+    size_t repairs = 0;
+    for (size_t t = 0; t < std::size(replicated_tables); ++t) {
+        const merkle::Tree& tree = hash_trees[t];
+        const syncproto::Table& wire = replicated_tables[t].wire;
+        std::vector<uint64_t> nodes{0}; // the root
+        std::vector<int64_t> keys;
+        for (unsigned level = merkle::kRoot; !nodes.empty(); --level) {
+            std::vector<uint64_t> next;
+            for (size_t first = 0; first < nodes.size(); first += syncproto::kMerkleMaxNodes) {
+                syncproto::MerkleQuery query;
+                query.table = wire.id;
+                query.level = level;
+                query.indexes.assign(nodes.begin() + first,
+                                     nodes.begin() + std::min(nodes.size(), first + syncproto::kMerkleMaxNodes));
+                std::string frame;
+                syncproto::encode_merkle_query(frame, query);
+                connection.send(frame);
+                syncproto::MerkleReply reply;
+                if (!syncproto::decode_merkle_reply(connection.receive(), query.indexes.size(), reply)
+                    || reply.table != query.table || reply.level != level) {
+                    throw std::runtime_error("unexpected reply to merkle query");
+                }
+                for (size_t i = 0; i < query.indexes.size(); ++i) {
+                    for (uint64_t child : merkle::differing(tree.children(level, query.indexes[i]), reply.nodes[i])) {
+                        if (level == 0) {
+                            keys.push_back(static_cast<int64_t>(child));
+                        } else {
+                            next.push_back(child);
+                        }
+                    }
+                }
+            }
+            nodes = std::move(next);
+            if (level == 0) break;
+        }
+        if (!keys.empty()) {
+            LOG_WARN << "Central differs from " << replicated_tables[t].table << " in " << keys.size()
+                     << " rows; resending them";
+            queue_repairs(t, keys);
+            repairs += keys.size();
+        }
+    }
+    anti_entropy_repairs.add(repairs);
+    return repairs;
+}
+
+// ---- foreign services -------------------------------------------------------
+//
+// Central pushes the other regions' services over the sync connection
+// (CatalogSubscribe / CatalogUpdate in sync_protocol.hpp), so /all_services
+// can list every region's services from local data. They are kept in a file
+// of their own, <database minus .db>.catalog.db:
+//   - ForeignServices: usluge rows keyed by (region_id, service_id);
+//   - ForeignVersions: the seq applied per origin region, sent with the
+//     subscribe so central only pushes what is new.
+// The sync thread writes it through its own connection, in one transaction
+// per update; the server's connection ATTACHes it as "catalog" and only
+// reads it. Nothing here goes into Changelog, so it is never synced back.
+
+static sqlite3* catalog_db = nullptr; // sync thread only
+
+static metrics::Counter& catalog_rows_applied = metrics::Registry::global()
+    .counter("regional_catalog_rows_applied_total", "Other regions' service changes applied from central");
+
+static sql::Statement<sql::Params<>, sql::Columns<std::string, int64_t>> select_catalog_versions{
+    "SELECT region_id, seq FROM ForeignVersions"};
+static sql::Statement<sql::Params<std::string_view, int64_t>, sql::Columns<>> upsert_catalog_version{
+    R"(INSERT INTO ForeignVersions (region_id, seq) VALUES (?, ?)
+       ON CONFLICT (region_id) DO UPDATE SET seq = MAX(seq, excluded.seq))"};
+static sql::Statement<sql::Params<std::string_view, int64_t>, sql::Columns<>> delete_foreign_service{
+    "DELETE FROM ForeignServices WHERE region_id = ? AND service_id = ?"};
+static sql::StatementPool upsert_foreign_service{
+    R"(INSERT OR REPLACE INTO ForeignServices (region_id, service_id, seller_id, service_name, price, capacity,
+                                               working_hours, service_type, loyalty_requirement, loyalty_discount)
+       VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?))"};
+
+// Opens (creating if needed) the catalog file next to `database_path` and
+// attaches it to the server's connection.
+bool open_catalog(const std::string& database_path) {
+    std::string file = database_path;
+    if (file.size() > 3 && file.compare(file.size() - 3, 3, ".db") == 0) file.resize(file.size() - 3);
+    file += ".catalog.db";
+    if (sqlite3_open(file.c_str(), &catalog_db) != SQLITE_OK) {
+        LOG_ERROR << "Failed to open " << file << ": " << sqlite3_errmsg(catalog_db);
+        return false;
+    }
+    sqlite3_busy_timeout(catalog_db, 5000);
+    // WAL, so the server's reads and the sync thread's writes don't block
+    // each other.
+    const char* schema = R"(
+        PRAGMA journal_mode = WAL;
+        CREATE TABLE IF NOT EXISTS ForeignServices (
+            region_id TEXT NOT NULL,
+            service_id INTEGER NOT NULL,
+            seller_id INTEGER,
+            service_name TEXT,
+            price REAL,
+            capacity INTEGER,
+            working_hours TEXT,
+            service_type TEXT,
+            loyalty_requirement INTEGER,
+            loyalty_discount REAL,
+            PRIMARY KEY (region_id, service_id)
+        );
+        CREATE TABLE IF NOT EXISTS ForeignVersions (
+            region_id TEXT PRIMARY KEY,
+            seq INTEGER NOT NULL
+        );
+    )";
+    char* err_msg = nullptr;
+    if (sqlite3_exec(catalog_db, schema, nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        LOG_ERROR << "Failed to set up " << file << ": " << err_msg;
+        sqlite3_free(err_msg);
+        return false;
+    }
+    sqlite3_stmt* stmt = nullptr;
+    int rc = sqlite3_prepare_v2(db, "ATTACH DATABASE ? AS catalog", -1, &stmt, nullptr);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, file.c_str(), -1, SQLITE_TRANSIENT);
+        rc = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        LOG_ERROR << "Failed to attach " << file << ": " << sqlite3_errmsg(db);
+        return false;
+    }
+    return true;
+}
+
+// Asks central for the other regions' services changed past what is stored.
+void subscribe_catalog(SyncConnection& connection) {
+    std::vector<std::pair<std::string, int64_t>> stored;
+    auto cursor = select_catalog_versions.query(catalog_db);
+    while (auto row = cursor.next()) stored.emplace_back(std::get<0>(*row), std::get<1>(*row));
+    syncproto::CatalogVersions versions;
+    for (const auto& [region, seq] : stored) versions.emplace_back(region, static_cast<uint64_t>(seq));
+    std::string frame;
+    syncproto::encode_catalog_subscribe(frame, versions);
+    connection.send(frame);
+}
+
+bool store_foreign_service(std::string_view region, const syncproto::Row& row) {
+    sqlite3_stmt* stmt = upsert_foreign_service.acquire(catalog_db);
+    if (!stmt) return false;
+    sql::bind(stmt, 1, region);
+    for (size_t i = 0; i < row.table->column_count; ++i) {
+        int index = static_cast<int>(i) + 2;
+        const syncproto::Value& v = row.values[i];
+        if (v.null) {
+            sql::bind(stmt, index, nullptr);
+            continue;
         }
+        switch (row.table->columns[i].type) {
+            case syncproto::ColumnType::integer: sql::bind(stmt, index, v.integer); break;
+            case syncproto::ColumnType::real: sql::bind(stmt, index, v.real); break;
+            case syncproto::ColumnType::text: sql::bind(stmt, index, v.text); break;
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+    int rc = sqlite3_step(stmt);
+    upsert_foreign_service.release(stmt, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count()));
+    return rc == SQLITE_DONE;
+}
+
+// Applies a CatalogUpdate and records its seq, in one transaction.
+void apply_catalog_update(std::string_view payload) {
+    static const syncproto::Table* usluge = syncproto::find_table("usluge");
+    syncproto::BatchHeader header;
+    std::string scratch;
+    if (!syncproto::decode_batch(payload, header, scratch, syncproto::MessageType::catalog_update)) {
+        throw std::runtime_error("malformed catalog update");
+    }
+    sqlite3_exec(catalog_db, "BEGIN", nullptr, nullptr, nullptr);
+    syncproto::BatchReader reader(header.body);
+    syncproto::Row row;
+    size_t rows = 0;
+    bool ok = true;
+    while (ok && reader.next(row)) {
+        if (row.table != usluge) continue;
+        ok = row.op == syncproto::Op::remove
+            ? delete_foreign_service.exec(catalog_db, header.region_id, row.key) == SQLITE_DONE
+            : store_foreign_service(header.region_id, row);
+        ++rows;
+    }
+    ok = ok && !reader.failed()
+        && upsert_catalog_version.exec(catalog_db, header.region_id, static_cast<int64_t>(header.last_seq)) == SQLITE_DONE
+        && sqlite3_exec(catalog_db, "COMMIT", nullptr, nullptr, nullptr) == SQLITE_OK;
+    if (!ok) {
+        // Reconnecting resubscribes from the last stored seq.
+        std::string error = sqlite3_errmsg(catalog_db);
+        sqlite3_exec(catalog_db, "ROLLBACK", nullptr, nullptr, nullptr);
+        throw std::runtime_error("cannot apply catalog update: " + error);
+    }
+    catalog_rows_applied.add(rows);
+    LOG_DEBUG << "Applied " << rows << " catalog changes from " << header.region_id << " up to seq " << header.last_seq;
+}
+
+// While central is unreachable the changelog is the outbox. Past this many
+// entries it is compacted to the latest entry per key, which bounds it by
+// the number of replicated rows however long the outage lasts.
+constexpr int64_t kOutboxCompactThreshold = 100000;
+
+static sql::Statement<sql::Params<>, sql::Columns<int64_t, std::optional<int64_t>>> select_outbox{
+    R"(SELECT COUNT(*), MIN(changed_at) FROM Changelog
+       WHERE seq > (SELECT acked_seq FROM SyncState WHERE id = 1))"};
+static sql::Statement<sql::Params<>, sql::Columns<>> compact_changelog{
+    "DELETE FROM Changelog WHERE seq NOT IN (SELECT MAX(seq) FROM Changelog GROUP BY table_name, row_id)"};
+
+void compact_outbox() {
+    auto outbox = select_outbox.one(db);
+    if (!outbox || std::get<0>(*outbox) < kOutboxCompactThreshold) return;
+    if (compact_changelog.exec(db) != SQLITE_DONE) {
+        LOG_ERROR << "Error compacting changelog: " << sqlite3_errmsg(db);
+        return;
+    }
+    LOG_INFO << "Compacted sync outbox: dropped " << sqlite3_changes(db) << " of " << std::get<0>(*outbox) << " entries";
+}
+
+static metrics::Gauge& sync_connected = metrics::Registry::global()
+    .gauge("regional_sync_connected", "1 while the sync connection to central is up");
+static metrics::Counter& sync_reconnects = metrics::Registry::global()
+    .counter("regional_sync_connect_failures_total", "Failed or dropped sync connections");
+
+// Outbox size and replication lag (age of the oldest unacknowledged change),
+// read from the changelog at scrape time so they stay current while the sync
+// thread is backing off.
+void render_sync_metrics(std::string& out) {
+    auto outbox = select_outbox.one(db);
+    if (!outbox) return;
+    auto& [pending, oldest] = *outbox;
+    int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    out += "# HELP regional_sync_outbox_changes Changes not yet acknowledged by central\n"
+           "# TYPE regional_sync_outbox_changes gauge\n";
+    metrics::Registry::sample(out, "regional_sync_outbox_changes", "", static_cast<double>(pending));
+    out += "# HELP regional_sync_lag_seconds Age of the oldest change not yet acknowledged by central\n"
+           "# TYPE regional_sync_lag_seconds gauge\n";
+    metrics::Registry::sample(out, "regional_sync_lag_seconds", "", oldest ? std::max<int64_t>(0, now_ms - *oldest) / 1e3 : 0.0);
+}
+
+// Wakes the sync thread when local writes add to the changelog. Changes are
+// batched: the sync starts once writes have paused for the debounce window,
+// or once the oldest unsynced write is max_latency old, whichever is first.
+class ChangeSignal {
+public:
+    void notify() {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!pending_) first_ = now;
+        pending_ = true;
+        last_ = now;
+        cv_.notify_one();
+    }
+
+    // Blocks until a batch of changes is ready (true, and the signal is
+    // consumed) or `deadline` passes (false).
+    bool wait_until(std::chrono::steady_clock::time_point deadline, std::chrono::milliseconds debounce,
+                    std::chrono::milliseconds max_latency) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            auto now = std::chrono::steady_clock::now();
+            auto ready = std::min(last_ + debounce, first_ + max_latency);
+            if (pending_ && now >= ready) {
+                pending_ = false;
+                return true;
+            }
+            if (now >= deadline) return false;
+            cv_.wait_until(lock, pending_ ? std::min(ready, deadline) : deadline);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool pending_ = false;
+    std::chrono::steady_clock::time_point first_, last_;
+};
+
+static ChangeSignal changelog_signal;
+
+// Set by --sync-debounce-ms / --sync-max-latency-ms
+static std::chrono::milliseconds sync_debounce{50};
+static std::chrono::milliseconds sync_max_latency{500};
+
+// SQLite hooks on the server's connection: a transaction that inserted into
+// Changelog signals the sync thread once it commits. The hooks run on the
+// writing thread, inside SQLite, so they only flip a flag and notify.
+thread_local bool changelog_written = false;
+
+void on_row_change(void*, int op, const char*, const char* table, sqlite3_int64) {
+    if (op == SQLITE_INSERT && std::strcmp(table, "Changelog") == 0) changelog_written = true;
+}
+
+int on_commit(void*) {
+    if (changelog_written) {
+        changelog_written = false;
+        changelog_signal.notify();
+    }
+    return 0; // let the commit proceed
+}
+
+void on_rollback(void*) {
+    changelog_written = false;
+}
+
+// Sync I/O deadline, idle heartbeat period and reconnect backoff bounds.
+constexpr std::chrono::seconds kSyncTimeout{10};
+constexpr std::chrono::seconds kHeartbeatInterval{15};
+constexpr std::chrono::milliseconds kPushPollInterval{500}; // idle check for catalog pushes
+constexpr std::chrono::milliseconds kBackoffMin{500};
+constexpr std::chrono::milliseconds kBackoffMax{60000};
+
+// Keeps one connection to central open and drains the changelog whenever
+// local writes add to it (debounced), or every `sync_interval` minutes as a
+// fallback, heartbeating while idle. Any failure drops the connection and
+// reconnects after a jittered exponential backoff; changes pile up in the
+// changelog meanwhile.
+void sync_with_central_server(const std::string& central_server_address, unsigned short central_server_port, const std::string& regional_server_id, int sync_interval) {
+    std::mt19937 rng(std::random_device{}());
+    std::chrono::milliseconds backoff = kBackoffMin;
+
+    for (;;) {
+        try {
+            SyncConnection connection(kSyncTimeout);
+            connection.connect(central_server_address, central_server_port);
+            uint64_t capabilities = handshake(connection, regional_server_id);
+            bool catalog = capabilities & syncproto::kCapCatalog;
+            if (catalog) {
+                connection.on_push(apply_catalog_update);
+                subscribe_catalog(connection);
+            }
+            sync_connected.set(1);
+            backoff = kBackoffMin;
+            LOG_INFO << "Connected to central server " << central_server_address << ":" << central_server_port;
+
+            // First check right after connecting, when central is likeliest
+            // to have been restored or replaced.
+            bool check_trees = anti_entropy_interval.count() > 0 && (capabilities & syncproto::kCapMerkle);
+            auto next_check = std::chrono::steady_clock::now();
+            for (;;) {
+                int64_t acked_seq = 0;
+                if (auto row = select_acked_seq.one(db)) acked_seq = std::get<0>(*row);
+
+                // Drain the changelog in batches. The pass is a trace of its
+                // own; the requests whose changes it ships get a "replicate"
+                // span linked to it (see tracing.hpp).
+                tracing::Span sync_span("sync", tracing::Context{}, tracing::now_us());
+                std::string traceparent = tracing::enabled() && (capabilities & syncproto::kCapTracing)
+                    ? tracing::format_traceparent(sync_span.context()) : std::string();
+                size_t total = ship_changes(connection, regional_server_id, traceparent, capabilities, acked_seq);
+                if (total) {
+                    LOG_INFO << "Synced " << total << " changes up to seq " << acked_seq;
+                }
+                sync_span.end();
+
+                // With the outbox drained, central should match the trees;
+                // repairs go out on the next pass.
+                auto now = std::chrono::steady_clock::now();
+                if (check_trees && now >= next_check) {
+                    next_check = now + anti_entropy_interval;
+                    if (anti_entropy(connection)) continue;
+                }
+
+                // Wait for local changes or the fallback interval (in minutes),
+                // heartbeating while idle and picking up catalog pushes
+                auto next_sync = now + std::chrono::minutes(sync_interval);
+                auto next_heartbeat = now + kHeartbeatInterval;
+                auto wake = check_trees ? std::min(next_sync, next_check) : next_sync;
+                for (;;) {
+                    auto deadline = std::min(wake, next_heartbeat);
+                    if (catalog) deadline = std::min(deadline, std::chrono::steady_clock::now() + kPushPollInterval);
+                    if (changelog_signal.wait_until(deadline, sync_debounce, sync_max_latency)) break;
+                    now = std::chrono::steady_clock::now();
+                    if (now >= wake) break;
+                    if (catalog) connection.poll();
+                    if (now >= next_heartbeat) {
+                        heartbeat(connection);
+                        next_heartbeat = now + kHeartbeatInterval;
+                    }
+                }
+            }
+        } catch (const std::exception& e) {
+            LOG_WARN << "Sync connection to central lost: " << e.what() << "; retrying in " << backoff.count() << " ms";
+        }
+        sync_connected.set(0);
+        sync_reconnects.add();
+        compact_outbox();
+
+        // Jitter over the upper half of the backoff, so regions that lost
+        // central together don't reconnect in lockstep.
+        std::uniform_int_distribution<long long> jitter(backoff.count() / 2, backoff.count());
+        std::this_thread::sleep_for(std::chrono::milliseconds(jitter(rng)));
+        backoff = std::min(backoff * 2, kBackoffMax);
+    }
+}
+
+// ---- bootstrap from central ------------------------------------------------
+//
+// --bootstrap-from-central provisions this database from central's copy of
+// the region instead of a file copied by hand: it streams a snapshot of the
+// region's partition (see sync_protocol.hpp), replaces the replicated tables
+// with its rows, and positions change capture at the snapshot's seq, so the
+// sync thread continues from there with only new changes.
+
+// The regional schema, for bootstrapping into a new, empty file.
+static const char* const kBaseSchema = R"(
+    CREATE TABLE IF NOT EXISTS Korisnici (
+        user_id INTEGER PRIMARY KEY AUTOINCREMENT,
+        username TEXT NOT NULL UNIQUE,
+        email TEXT NOT NULL UNIQUE,
+        password TEXT NOT NULL,
+        user_type TEXT CHECK(user_type IN ('buyer', 'seller')) NOT NULL
+    );
+    CREATE TABLE IF NOT EXISTS Usluge (
+        service_id INTEGER PRIMARY KEY AUTOINCREMENT,
+        seller_id INTEGER NOT NULL,
+        service_name TEXT NOT NULL,
+        price REAL NOT NULL,
+        capacity INTEGER NOT NULL,
+        working_hours TEXT,
+        service_type TEXT,
+        loyalty_requirement INTEGER,
+        loyalty_discount REAL,
+        FOREIGN KEY (seller_id) REFERENCES Korisnici(user_id)
+    );
+    CREATE TABLE IF NOT EXISTS Narudzbe (
+        order_id INTEGER PRIMARY KEY AUTOINCREMENT,
+        buyer_id INTEGER NOT NULL,
+        seller_id INTEGER NOT NULL,
+        service_id INTEGER NOT NULL,
+        quantity INTEGER NOT NULL,
+        cost REAL NOT NULL,
+        order_status TEXT CHECK(order_status IN ('pending', 'cancelled', 'delivered')) NOT NULL,
+        FOREIGN KEY (buyer_id) REFERENCES Korisnici(user_id),
+        FOREIGN KEY (seller_id) REFERENCES Korisnici(user_id),
+        FOREIGN KEY (service_id) REFERENCES Usluge(service_id)
+    );
+    CREATE TABLE IF NOT EXISTS Lojalnosti (
+        loyalty_id INTEGER PRIMARY KEY AUTOINCREMENT,
+        buyer_id INTEGER NOT NULL,
+        seller_id INTEGER NOT NULL,
+        loyalty_points INTEGER NOT NULL,
+        FOREIGN KEY (buyer_id) REFERENCES Korisnici(user_id),
+        FOREIGN KEY (seller_id) REFERENCES Korisnici(user_id)
+    );
+)";
+
+// Streams the region's snapshot into `path`. Returns the snapshot's seq.
+uint64_t download_snapshot(const std::string& host, unsigned short port, const std::string& regional_server_id,
+                           const std::string& path) {
+    SyncConnection connection(std::chrono::seconds(60));
+    connection.connect(host, port);
+    syncproto::Hello hello;
+    hello.region_id = regional_server_id;
+    hello.capabilities = syncproto::kCapAll;
+    std::string frame;
+    syncproto::encode_hello(frame, hello);
+    connection.send(frame);
+    syncproto::Welcome welcome;
+    if (!syncproto::decode_welcome(connection.receive(), welcome)) {
+        throw std::runtime_error("unexpected reply to hello");
+    }
+    if (!(welcome.capabilities & syncproto::kCapSnapshot)) {
+        throw std::runtime_error("central server does not serve snapshots");
+    }
+    frame.clear();
+    syncproto::encode_snapshot_request(frame);
+    connection.send(frame);
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    syncproto::SnapshotChunk chunk;
+    uint64_t received = 0;
+    do {
+        std::string payload = connection.receive();
+        if (!syncproto::decode_snapshot_chunk(payload, chunk) || chunk.offset != received) {
+            throw std::runtime_error("unexpected snapshot chunk");
+        }
+        out.write(chunk.data.data(), static_cast<std::streamsize>(chunk.data.size()));
+        received += chunk.data.size();
+    } while (received < chunk.total_size);
+    if (!out.flush()) throw std::runtime_error("cannot write " + path);
+    return chunk.watermark;
+}
+
+// Replaces the replicated tables with the snapshot's rows in one
+// transaction. The triggers log every imported row; that log is dropped and
+// the changelog restarts after `seq`, which is also recorded as acknowledged.
+bool import_snapshot(const std::string& path, uint64_t seq) {
+    std::string quoted = "'";
+    for (char c : path) quoted += c == '\'' ? std::string("''") : std::string(1, c);
+    quoted += "'";
+    std::string position = std::to_string(seq);
+
+    std::string sql = "ATTACH DATABASE " + quoted + " AS snapshot;\nBEGIN;\nDELETE FROM Sessions;\n";
+    for (const ReplicatedTable& t : replicated_tables) {
+        std::string columns, source;
+        for (size_t i = 0; i < t.wire.column_count; ++i) {
+            columns += std::string(i ? ", " : "") + t.wire.columns[i].name;
+        }
+        source = columns;
+        if (std::string(t.table) == "Korisnici") {
+            // Passwords never leave the region, so central has none. Each
+            // user gets a random one nobody knows, marked as needing a reset.
+            columns += ", password";
+            source += std::string(", '") + kPasswordResetPrefix + "' || lower(hex(randomblob(16)))";
+        }
+        sql += std::string("DELETE FROM ") + t.table + ";\nINSERT INTO " + t.table + " (" + columns + ") SELECT " +
+               source + " FROM snapshot." + t.wire.name + ";\n";
+    }
+    sql += "DELETE FROM Changelog;\n"
+           "UPDATE sqlite_sequence SET seq = " + position + " WHERE name = 'Changelog';\n"
+           "INSERT INTO sqlite_sequence (name, seq) SELECT 'Changelog', " + position +
+           " WHERE NOT EXISTS (SELECT 1 FROM sqlite_sequence WHERE name = 'Changelog');\n"
+           "UPDATE SyncState SET acked_seq = " + position + " WHERE id = 1;\n"
+           "COMMIT;\nDETACH DATABASE snapshot;\n";
+
+    char* err_msg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        LOG_ERROR << "Failed to import snapshot: " << err_msg;
+        sqlite3_free(err_msg);
+        sqlite3_exec(db, "ROLLBACK; DETACH DATABASE snapshot;", nullptr, nullptr, nullptr);
+        return false;
+    }
+    return true;
+}
+
+// Runs before the sync thread starts. A region central has no data for
+// (watermark 0) is refused rather than wiping the local tables.
+bool bootstrap_from_central(const std::string& host, unsigned short port, const std::string& regional_server_id,
+                            const std::string& database_path) {
+    auto start = std::chrono::steady_clock::now();
+    std::string path = database_path + ".snapshot";
+    uint64_t seq;
+    try {
+        seq = download_snapshot(host, port, regional_server_id, path);
     } catch (const std::exception& e) {
-        std::cerr << "Synchronization error: " << e.what() << "\n";
+        LOG_ERROR << "Bootstrap from central failed: " << e.what();
+        std::remove(path.c_str());
+        return false;
     }
+    bool ok = seq != 0;
+    if (!ok) {
+        LOG_ERROR << "Central has no data for " << regional_server_id << "; not bootstrapping";
+    } else if ((ok = import_snapshot(path, seq))) {
+        LOG_INFO << "Bootstrapped " << regional_server_id << " from central at seq " << seq << " in "
+                 << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+                 << " ms";
+        sync_acked_seq.set(static_cast<int64_t>(seq));
+    }
+    std::remove(path.c_str());
+    return ok;
 }
 
 int main(int argc, char* argv[]) {
     try {
-        if (argc != 7) { // Adjusted to check for 6 arguments (program name + 6 args)
-            std::cerr << "Usage: regional_server <user_port> <central_server_address> <central_server_port> <regional_server_id> <database> <sync_interval>\n";
+        if (argc < 7) { // program name + 6 positional args, then optional --name=value flags
+            std::cerr << "Usage: regional_server <user_port> <central_server_address> <central_server_port> <regional_server_id> <database> <sync_interval> [--binary-port=N] [--metrics-port=N] [--log-file=PATH] [--log-level=debug|info|warn|error] [--sql-profile] [--slow-query-ms=N] [--trace-file=PATH] [--sync-debounce-ms=N] [--sync-max-latency-ms=N] [--bootstrap-from-central] [--anti-entropy-minutes=N]\n";
             return 1;
         }
 
@@ -1493,9 +2489,70 @@ int main(int argc, char* argv[]) {
         std::string database_path = argv[5];
         int sync_interval = std::stoi(argv[6]); // interval in minutes
 
+        // Optional flags
+        unsigned short binary_port = 0;
+        unsigned short metrics_port = 0;
+        std::string log_file;
+        long slow_query_ms = 100;
+        std::string trace_file;
+        bool bootstrap = false;
+        for (int i = 7; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg.rfind("--binary-port=", 0) == 0) {
+                binary_port = static_cast<unsigned short>(std::stoi(arg.substr(14)));
+            } else if (arg.rfind("--metrics-port=", 0) == 0) {
+                metrics_port = static_cast<unsigned short>(std::stoi(arg.substr(15)));
+            } else if (arg.rfind("--log-file=", 0) == 0) {
+                log_file = arg.substr(11);
+            } else if (arg == "--sql-profile") {
+                sql_profiling = true;
+            } else if (arg.rfind("--slow-query-ms=", 0) == 0) {
+                sql_profiling = true;
+                slow_query_ms = std::stol(arg.substr(16));
+            } else if (arg.rfind("--trace-file=", 0) == 0) {
+                trace_file = arg.substr(13);
+            } else if (arg.rfind("--sync-debounce-ms=", 0) == 0) {
+                sync_debounce = std::chrono::milliseconds(std::stol(arg.substr(19)));
+            } else if (arg.rfind("--sync-max-latency-ms=", 0) == 0) {
+                sync_max_latency = std::chrono::milliseconds(std::stol(arg.substr(22)));
+            } else if (arg == "--bootstrap-from-central") {
+                bootstrap = true;
+            } else if (arg.rfind("--anti-entropy-minutes=", 0) == 0) {
+                anti_entropy_interval = std::chrono::minutes(std::stol(arg.substr(23)));
+            } else if (arg.rfind("--log-level=", 0) == 0) {
+                logger::Level level;
+                if (!logger::parse_level(arg.substr(12), level)) {
+                    std::cerr << "Unknown log level: " << arg.substr(12) << "\n";
+                    return 1;
+                }
+                logger::set_level(level);
+            } else {
+                std::cerr << "Unknown option: " << arg << "\n";
+                return 1;
+            }
+        }
+
+        if (!logger::start(log_file)) {
+            std::cerr << "Cannot open log file: " << log_file << "\n";
+            return 1;
+        }
+        if (!trace_file.empty() && !tracing::Recorder::instance().start(trace_file, "regional " + regional_server_id)) {
+            LOG_ERROR << "Cannot open trace file: " << trace_file;
+            return 1;
+        }
+
         // Initialize SQLite
         if (sqlite3_open(database_path.c_str(), &db) != SQLITE_OK) {
-            std::cerr << "Failed to open database: " << sqlite3_errmsg(db) << "\n";
+            LOG_ERROR << "Failed to open database: " << sqlite3_errmsg(db);
+            return 1;
+        }
+
+        if (sql_profiling) {
+            sql_profiler.attach(db, static_cast<uint64_t>(slow_query_ms) * 1000000);
+        }
+
+        if (bootstrap && sqlite3_exec(db, kBaseSchema, nullptr, nullptr, nullptr) != SQLITE_OK) {
+            LOG_ERROR << "Failed to create tables: " << sqlite3_errmsg(db);
             return 1;
         }
 
@@ -1510,17 +2567,35 @@ int main(int argc, char* argv[]) {
         )";
         char* err_msg = nullptr;
         if (sqlite3_exec(db, create_table_sql, nullptr, nullptr, &err_msg) != SQLITE_OK) {
-            std::cerr << "Failed to create Sessions table: " << err_msg << "\n";
+            LOG_ERROR << "Failed to create Sessions table: " << err_msg;
             sqlite3_free(err_msg);
             return 1;
         }
+        if (!init_change_capture()) return 1;
+        if (bootstrap && !bootstrap_from_central(central_server_address, central_server_port, regional_server_id, database_path)) {
+            return 1;
+        }
+        if (!load_hash_trees() || !open_catalog(database_path)) return 1;
+        sqlite3_update_hook(db, on_row_change, nullptr);
+        sqlite3_commit_hook(db, on_commit, nullptr);
+        sqlite3_rollback_hook(db, on_rollback, nullptr);
+
+        metrics::Registry::global().add_collector(render_page_cache_metrics);
+        metrics::Registry::global().add_collector(render_sync_metrics);
 
         // Start the synchronization thread
         std::thread sync_thread(sync_with_central_server, central_server_address, central_server_port, regional_server_id, sync_interval);
         sync_thread.detach(); // Detach the thread to run independently
 
         // Start the server to handle user requests
+        LOG_INFO << "Regional server " << regional_server_id << " listening on port " << user_port;
         boost::asio::io_context io_context;
+        if (binary_port != 0) {
+            std::thread(binary_server, std::ref(io_context), binary_port).detach();
+        }
+        if (metrics_port != 0) {
+            std::thread(metrics_server, metrics_port).detach();
+        }
         server(io_context, user_port); // Function to start the user-facing server
 
         sqlite3_close(db);
@@ -0,0 +1,125 @@
+#pragma once
+
+// Writes result rows straight into a response buffer in either the plain-text
+// listing format or JSON. Column values come in as ints, doubles and
+// string_views read off the statement, so a row costs no allocations of its
+// own; the buffer is reserved up front from ResponseSizeEstimate.
+//
+// Text output is one line per row, "Label: value, Label: value\n", under an
+// optional heading. JSON output is {"<key>":[{...},{...}]}.
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "json_writer.hpp"
+
+// Running estimate of an endpoint's response size, used to reserve the body
+// before serializing. Moves 1/8 of the way towards each observed size.
+class ResponseSizeEstimate {
+public:
+    explicit ResponseSizeEstimate(size_t initial) : estimate_(initial) {}
+
+    void reserve(std::string& out) const {
+        size_t n = estimate_.load(std::memory_order_relaxed);
+        out.reserve(out.size() + n + n / 4);
+    }
+
+    void record(size_t size) {
+        size_t current = estimate_.load(std::memory_order_relaxed);
+        size_t next = size >= current ? current + (size - current) / 8 : current - (current - size) / 8;
+        estimate_.store(next, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<size_t> estimate_;
+};
+
+class RowWriter {
+public:
+    // `json_key` names the array in JSON output; `heading` is written before
+    // the rows in text output, and `empty_text` (if given) replaces the whole
+    // text body when there are no rows.
+    RowWriter(std::string& out, bool json, std::string_view json_key,
+              std::string_view heading = {}, const char* empty_text = nullptr)
+        : out_(out), json_(out), is_json_(json), start_(out.size()), empty_text_(empty_text) {
+        if (is_json_) {
+            json_.begin_object().key(json_key).begin_array();
+        } else {
+            out_.append(heading.data(), heading.size());
+        }
+    }
+
+    void begin_row() {
+        if (is_json_) json_.begin_object();
+        first_field_ = true;
+    }
+
+    void end_row() {
+        if (is_json_) json_.end_object();
+        else out_ += '\n';
+        ++rows_;
+    }
+
+    // `key` is the JSON member name, `label` the text-format label.
+    void field(std::string_view key, std::string_view label, std::string_view value) {
+        if (is_json_) {
+            json_.field(key, value);
+        } else {
+            text_label(label);
+            out_.append(value.data(), value.size());
+        }
+    }
+
+    void field(std::string_view key, std::string_view label, int value) {
+        field(key, label, static_cast<long long>(value));
+    }
+
+    void field(std::string_view key, std::string_view label, long long value) {
+        if (is_json_) {
+            json_.field(key, value);
+        } else {
+            text_label(label);
+            append_number(out_, value);
+        }
+    }
+
+    // Text doubles keep std::to_string's fixed six decimals.
+    void field(std::string_view key, std::string_view label, double value) {
+        if (is_json_) {
+            json_.field(key, value);
+        } else {
+            text_label(label);
+            append_number(out_, value, 6);
+        }
+    }
+
+    // Closes the JSON document, or swaps in `empty_text` for an empty text
+    // listing. Returns the number of rows written.
+    size_t finish() {
+        if (is_json_) {
+            json_.end_array().end_object();
+        } else if (rows_ == 0 && empty_text_) {
+            out_.resize(start_);
+            out_ += empty_text_;
+        }
+        return rows_;
+    }
+
+private:
+    void text_label(std::string_view label) {
+        if (!first_field_) out_ += ", ";
+        first_field_ = false;
+        out_.append(label.data(), label.size());
+        out_ += ": ";
+    }
+
+    std::string& out_;
+    JsonWriter json_;
+    bool is_json_;
+    size_t start_;
+    const char* empty_text_;
+    size_t rows_ = 0;
+    bool first_field_ = true;
+};
@@ -0,0 +1,187 @@
+#pragma once
+
+// SQLite statement profiler built on sqlite3_trace_v2.
+//
+// Once attached to a connection it aggregates, per normalized statement
+// (whitespace collapsed, literals replaced by ?), the number of executions,
+// total and maximum run time and rows stepped. Executions slower than the
+// threshold are written to the log as slow queries, with their bound
+// parameters unless the statement touches a password or session token.
+//
+// Callbacks run with the connection's mutex held, so the profiler's own lock
+// is only contended by readers of snapshot().
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "logger.hpp"
+
+namespace sql {
+
+class Profiler {
+public:
+    struct Entry {
+        std::string statement;
+        uint64_t calls = 0;
+        uint64_t total_ns = 0;
+        uint64_t max_ns = 0;
+        uint64_t rows = 0;
+    };
+
+    // Starts profiling `db`. Executions taking at least `slow_ns` are logged.
+    void attach(sqlite3* db, uint64_t slow_ns) {
+        slow_ns_ = slow_ns;
+        sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW, &Profiler::trace, this);
+    }
+
+    // Aggregates sorted by total time, largest first.
+    std::vector<Entry> snapshot() const {
+        std::vector<Entry> entries;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            entries.reserve(entries_.size());
+            for (const auto& [text, entry] : entries_) entries.push_back(entry);
+        }
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& a, const Entry& b) { return a.total_ns > b.total_ns; });
+        return entries;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        by_stmt_.clear();
+    }
+
+    // Collapses whitespace and replaces numeric and string literals with ?,
+    // so the same statement with different literals aggregates together.
+    // With `keep_literals` only the whitespace is collapsed.
+    static std::string normalize(std::string_view sql, bool keep_literals = false) {
+        std::string out;
+        out.reserve(sql.size());
+        bool space = false;
+        for (size_t i = 0; i < sql.size(); ++i) {
+            unsigned char c = static_cast<unsigned char>(sql[i]);
+            if (std::isspace(c)) {
+                space = !out.empty();
+                continue;
+            }
+            if (space) out += ' ';
+            space = false;
+            if (keep_literals) {
+                out += static_cast<char>(c);
+            } else if (c == '\'') {
+                // String literal, '' is an escaped quote
+                for (++i; i < sql.size(); ++i) {
+                    if (sql[i] == '\'') {
+                        if (i + 1 < sql.size() && sql[i + 1] == '\'') ++i;
+                        else break;
+                    }
+                }
+                out += '?';
+            } else if (std::isdigit(c) && (out.empty() || !(std::isalnum(static_cast<unsigned char>(out.back())) || out.back() == '_'))) {
+                while (i + 1 < sql.size() && (std::isalnum(static_cast<unsigned char>(sql[i + 1])) || sql[i + 1] == '.')) ++i;
+                out += '?';
+            } else {
+                out += static_cast<char>(c);
+            }
+        }
+        return out;
+    }
+
+private:
+    struct Pending {
+        std::string sql; // raw text, to notice a handle reused for another statement
+        Entry* entry = nullptr;
+        uint64_t rows = 0;
+        std::chrono::steady_clock::time_point start{};
+    };
+
+    static int trace(unsigned type, void* context, void* p, void* x) {
+        auto* self = static_cast<Profiler*>(context);
+        auto* stmt = static_cast<sqlite3_stmt*>(p);
+        if (!sqlite3_sql(stmt)) return 0; // SQLite's own schema reads
+        if (type == SQLITE_TRACE_STMT) {
+            // Also fires for each trigger program; keep the outermost start.
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            Pending& pending = self->pending(stmt);
+            if (pending.start == std::chrono::steady_clock::time_point{}) {
+                pending.start = std::chrono::steady_clock::now();
+            }
+        } else if (type == SQLITE_TRACE_ROW) {
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            ++self->pending(stmt).rows;
+        } else if (type == SQLITE_TRACE_PROFILE) {
+            // SQLite's own estimate is only millisecond-grained; prefer the
+            // time since SQLITE_TRACE_STMT.
+            self->finish(stmt, static_cast<uint64_t>(*static_cast<sqlite3_int64*>(x)));
+        }
+        return 0;
+    }
+
+    // Pending counters for a statement, resolving its aggregate on first use.
+    // Pooled statements are reused, so the lookup is cached per handle.
+    Pending& pending(sqlite3_stmt* stmt) {
+        Pending& p = by_stmt_[stmt];
+        const char* sql = sqlite3_sql(stmt);
+        if (!p.entry || p.sql != sql) {
+            p.sql = sql;
+            p.rows = 0;
+            p.start = {};
+            std::string text = normalize(sql);
+            Entry& entry = entries_[text];
+            if (entry.statement.empty()) entry.statement = text;
+            p.entry = &entry;
+        }
+        return p;
+    }
+
+    void finish(sqlite3_stmt* stmt, uint64_t ns) {
+        std::string statement;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Pending& p = pending(stmt);
+            if (p.start != std::chrono::steady_clock::time_point{}) {
+                ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - p.start).count());
+                p.start = {};
+            }
+            Entry& entry = *p.entry;
+            ++entry.calls;
+            entry.total_ns += ns;
+            entry.max_ns = std::max(entry.max_ns, ns);
+            entry.rows += p.rows;
+            p.rows = 0;
+            if (ns < slow_ns_) return;
+            statement = entry.statement;
+        }
+        log_slow(stmt, statement, ns);
+    }
+
+    static void log_slow(sqlite3_stmt* stmt, const std::string& statement, uint64_t ns) {
+        // Anything that could carry a credential is logged without parameters.
+        if (statement.find("password") != std::string::npos || statement.find("auth_token") != std::string::npos) {
+            LOG_WARN << "Slow query (" << ns / 1000 << " us): " << statement << " [parameters redacted]";
+            return;
+        }
+        char* expanded = sqlite3_expanded_sql(stmt);
+        LOG_WARN << "Slow query (" << ns / 1000 << " us): " << (expanded ? normalize(expanded, true) : statement);
+        sqlite3_free(expanded);
+    }
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::unordered_map<sqlite3_stmt*, Pending> by_stmt_;
+    uint64_t slow_ns_ = 0;
+};
+
+} // namespace sql
@@ -0,0 +1,320 @@
+#pragma once
+
+// Typed, cached SQLite statements.
+//
+// A statement is declared once with its parameter and column types:
+//
+//     static sql::Statement<sql::Params<int>, sql::Columns<int, std::string_view>>
+//         select_names{"SELECT user_id, username FROM Korisnici WHERE user_id > ?"};
+//
+// Binding and row decoding are expanded at compile time from those lists, so
+// there are no manual indices or casts at the call site, and NULL columns
+// decode to an empty string_view / std::nullopt instead of crashing a
+// std::string constructor.
+//
+// Prepared sqlite3_stmt objects are kept in a per-statement pool, per
+// connection. A stepping statement must not be shared between threads, so
+// each query leases one from the pool and returns it (reset, bindings
+// cleared) when the Cursor goes out of scope.
+//
+// Text columns decoded as std::string_view point into SQLite's buffer and are
+// only valid until the cursor steps again or is destroyed.
+//
+// Each statement reports its pool hit/miss counts and the time spent in
+// sqlite3_step per query to the metrics registry, labelled with its SQL.
+// When tracing is on, each query is also recorded as an "sql" span under the
+// thread's current span, from its first step to the end of the lease.
+
+#include <sqlite3.h>
+
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "contention.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
+
+namespace sql {
+
+template <typename... Ts> struct Params {};
+template <typename... Ts> struct Columns { using Row = std::tuple<Ts...>; };
+
+// ---- column decoding --------------------------------------------------------
+
+template <typename T> struct column;
+
+template <> struct column<int> {
+    static int get(sqlite3_stmt* s, int i) { return sqlite3_column_int(s, i); }
+};
+template <> struct column<int64_t> {
+    static int64_t get(sqlite3_stmt* s, int i) { return sqlite3_column_int64(s, i); }
+};
+template <> struct column<double> {
+    static double get(sqlite3_stmt* s, int i) { return sqlite3_column_double(s, i); }
+};
+template <> struct column<std::string_view> {
+    static std::string_view get(sqlite3_stmt* s, int i) {
+        const char* text = reinterpret_cast<const char*>(sqlite3_column_text(s, i));
+        return text ? std::string_view(text, static_cast<size_t>(sqlite3_column_bytes(s, i))) : std::string_view();
+    }
+};
+template <> struct column<std::string> {
+    static std::string get(sqlite3_stmt* s, int i) { return std::string(column<std::string_view>::get(s, i)); }
+};
+template <typename T> struct column<std::optional<T>> {
+    static std::optional<T> get(sqlite3_stmt* s, int i) {
+        if (sqlite3_column_type(s, i) == SQLITE_NULL) return std::nullopt;
+        return column<T>::get(s, i);
+    }
+};
+
+// ---- parameter binding ------------------------------------------------------
+
+// Text is bound SQLITE_STATIC: the caller's arguments outlive the Cursor
+// they are passed to, which is the only place the statement is stepped.
+inline int bind(sqlite3_stmt* s, int i, int v) { return sqlite3_bind_int(s, i, v); }
+inline int bind(sqlite3_stmt* s, int i, int64_t v) { return sqlite3_bind_int64(s, i, v); }
+inline int bind(sqlite3_stmt* s, int i, double v) { return sqlite3_bind_double(s, i, v); }
+inline int bind(sqlite3_stmt* s, int i, std::string_view v) {
+    return sqlite3_bind_text(s, i, v.data(), static_cast<int>(v.size()), SQLITE_STATIC);
+}
+inline int bind(sqlite3_stmt* s, int i, std::nullptr_t) { return sqlite3_bind_null(s, i); }
+template <typename T>
+int bind(sqlite3_stmt* s, int i, const std::optional<T>& v) {
+    return v ? bind(s, i, *v) : sqlite3_bind_null(s, i);
+}
+
+// ---- statement pool ---------------------------------------------------------
+
+// SQL text with whitespace runs collapsed, cut at 80 characters; used as
+// the metrics label.
+inline std::string sql_label(const char* sql) {
+    std::string out;
+    bool space = false;
+    for (const char* p = sql; *p && out.size() < 80; ++p) {
+        if (std::isspace(static_cast<unsigned char>(*p))) {
+            space = !out.empty();
+            continue;
+        }
+        if (space) out += ' ';
+        space = false;
+        out += *p;
+    }
+    return out;
+}
+
+class StatementPool {
+public:
+    explicit StatementPool(const char* sql)
+        : sql_(sql),
+          mutex_("sql_statement_pool"),
+          hits_(metrics::Registry::global()
+                    .counter_family("sqlite_statement_cache_total", "Statement leases served from the pool (hit) or newly prepared (miss)")
+                    .with(metrics::label("sql", sql_label(sql)) + ",result=\"hit\"")),
+          misses_(metrics::Registry::global()
+                      .counter_family("sqlite_statement_cache_total", "Statement leases served from the pool (hit) or newly prepared (miss)")
+                      .with(metrics::label("sql", sql_label(sql)) + ",result=\"miss\"")),
+          duration_(metrics::Registry::global()
+                        .histogram_family("sqlite_statement_duration_seconds", "Time from first step to release per query")
+                        .with(metrics::label("sql", sql_label(sql)))) {}
+    StatementPool(const StatementPool&) = delete;
+    StatementPool& operator=(const StatementPool&) = delete;
+
+    ~StatementPool() {
+        for (auto& [db, idle] : idle_) {
+            for (sqlite3_stmt* stmt : idle) sqlite3_finalize(stmt);
+        }
+    }
+
+    const char* text() const { return sql_; }
+
+    // Returns an idle statement prepared on `db`, or prepares a new one.
+    // nullptr if preparing fails (sqlite3_errmsg(db) has the reason).
+    // A connection with pooled statements can't be closed (sqlite3_close
+    // fails while statements are unfinalized), so a handle seen here is
+    // never reused for another database.
+    sqlite3_stmt* acquire(sqlite3* db) {
+        {
+            std::lock_guard<contention::Mutex> lock(mutex_);
+            std::vector<sqlite3_stmt*>& idle = idle_for(db);
+            if (!idle.empty()) {
+                sqlite3_stmt* stmt = idle.back();
+                idle.pop_back();
+                hits_.add();
+                return stmt;
+            }
+        }
+        misses_.add();
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v3(db, sql_, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+            sqlite3_finalize(stmt);
+            return nullptr;
+        }
+        return stmt;
+    }
+
+    // `lease_ns` is the time from the lease's first step to its release; 0
+    // if it never stepped.
+    void release(sqlite3_stmt* stmt, uint64_t lease_ns = 0) {
+        if (lease_ns) duration_.record(lease_ns);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        std::lock_guard<contention::Mutex> lock(mutex_);
+        idle_for(sqlite3_db_handle(stmt)).push_back(stmt);
+    }
+
+private:
+    // Processes have one connection, or a few (one per partition on
+    // central), so a linear scan beats a map.
+    std::vector<sqlite3_stmt*>& idle_for(sqlite3* db) {
+        for (auto& [handle, idle] : idle_) {
+            if (handle == db) return idle;
+        }
+        idle_.emplace_back(db, std::vector<sqlite3_stmt*>());
+        return idle_.back().second;
+    }
+
+    const char* sql_;
+    contention::Mutex mutex_;
+    std::vector<std::pair<sqlite3*, std::vector<sqlite3_stmt*>>> idle_;
+    metrics::Counter& hits_;
+    metrics::Counter& misses_;
+    metrics::Histogram& duration_;
+};
+
+// ---- typed statements -------------------------------------------------------
+
+template <typename ParamList, typename ColumnList> class Statement;
+
+template <typename... P, typename... C>
+class Statement<Params<P...>, Columns<C...>> {
+public:
+    using Row = std::tuple<C...>;
+
+    explicit Statement(const char* sql) : pool_(sql) {}
+
+    // A leased, bound statement. Falsy if preparing or binding failed.
+    class Cursor {
+    public:
+        Cursor(StatementPool& pool, sqlite3_stmt* stmt) : pool_(&pool), stmt_(stmt) {}
+        Cursor(Cursor&& other) noexcept
+            : pool_(other.pool_), stmt_(other.stmt_), rc_(other.rc_), first_step_(other.first_step_),
+              trace_start_us_(other.trace_start_us_) {
+            other.stmt_ = nullptr;
+        }
+        Cursor(const Cursor&) = delete;
+        Cursor& operator=(const Cursor&) = delete;
+        ~Cursor() {
+            if (!stmt_) return;
+            if (trace_start_us_) {
+                tracing::record_child("sql", trace_start_us_, tracing::now_us(), sql_label(pool_->text()));
+            }
+            uint64_t lease_ns = 0;
+            if (first_step_ != std::chrono::steady_clock::time_point{}) {
+                lease_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - first_step_).count());
+            }
+            pool_->release(stmt_, lease_ns);
+        }
+
+        explicit operator bool() const { return stmt_ != nullptr; }
+        sqlite3_stmt* get() const { return stmt_; }
+
+        // Steps once. Returns the decoded row, or std::nullopt when the
+        // result set is exhausted or stepping failed (see done()).
+        std::optional<Row> next() {
+            if (!step()) return std::nullopt;
+            return row();
+        }
+
+        // Steps once; true while a row is available. The lease is timed
+        // from its first step to its release, so rows cost no clock reads.
+        bool step() {
+            if (first_step_ == std::chrono::steady_clock::time_point{}) {
+                first_step_ = std::chrono::steady_clock::now();
+                if (tracing::enabled()) trace_start_us_ = tracing::now_us();
+            }
+            rc_ = sqlite3_step(stmt_);
+            return rc_ == SQLITE_ROW;
+        }
+
+        // Decodes the current row into the column tuple.
+        Row row() const { return decode(std::index_sequence_for<C...>{}); }
+
+        // Decodes the current row into an aggregate whose members are in
+        // column order.
+        template <typename Struct>
+        Struct as() const { return as<Struct>(std::index_sequence_for<C...>{}); }
+
+        // Result of the last step: SQLITE_ROW, SQLITE_DONE or an error code.
+        int rc() const { return rc_; }
+        bool done() const { return rc_ == SQLITE_DONE; }
+
+    private:
+        template <size_t... I>
+        Row decode(std::index_sequence<I...>) const {
+            return Row(column<C>::get(stmt_, static_cast<int>(I))...);
+        }
+
+        template <typename Struct, size_t... I>
+        Struct as(std::index_sequence<I...>) const {
+            return Struct{column<C>::get(stmt_, static_cast<int>(I))...};
+        }
+
+        StatementPool* pool_;
+        sqlite3_stmt* stmt_;
+        int rc_ = SQLITE_OK;
+        std::chrono::steady_clock::time_point first_step_{};
+        int64_t trace_start_us_ = 0; // wall clock at the first step, when tracing
+    };
+
+    // Leases a statement and binds `params` in order.
+    Cursor query(sqlite3* db, const P&... params) {
+        sqlite3_stmt* stmt = pool_.acquire(db);
+        if (stmt && !bind_all(stmt, std::index_sequence_for<P...>{}, params...)) {
+            pool_.release(stmt);
+            stmt = nullptr;
+        }
+        return Cursor(pool_, stmt);
+    }
+
+    // Runs a statement that returns no rows. Returns SQLITE_DONE on success,
+    // otherwise the failing result code.
+    int exec(sqlite3* db, const P&... params) {
+        Cursor cursor = query(db, params...);
+        if (!cursor) return SQLITE_ERROR;
+        cursor.step();
+        return cursor.rc();
+    }
+
+    // First row of the result, if any. The statement is released before
+    // returning, so text columns must be std::string here, not string_view.
+    std::optional<Row> one(sqlite3* db, const P&... params) {
+        static_assert((!std::is_same<C, std::string_view>::value && ...),
+                      "one() would return views into a released statement");
+        Cursor cursor = query(db, params...);
+        if (!cursor) return std::nullopt;
+        return cursor.next();
+    }
+
+    const char* text() const { return pool_.text(); }
+
+private:
+    template <size_t... I>
+    static bool bind_all([[maybe_unused]] sqlite3_stmt* stmt, std::index_sequence<I...>, const P&... params) {
+        return ((bind(stmt, static_cast<int>(I) + 1, params) == SQLITE_OK) && ... && true);
+    }
+
+    StatementPool pool_;
+};
+
+} // namespace sql
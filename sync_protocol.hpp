@@ -0,0 +1,594 @@
+#pragma once
+
+// Binary replication protocol between regional servers and central.
+//
+// Every message is a length-prefixed frame (see wire.hpp) starting with a
+// message type byte. A connection opens with the regional server's Hello
+// (protocol version, region id, capability bits) and central's Welcome (its
+// version, the capabilities both sides support and the region's stored
+// watermark); central drops connections speaking a version it doesn't know.
+// Then the regional server sends Batch frames, several at a time
+// without waiting; central answers each one, in order, with an Ack carrying
+// the batch's last changelog seq once every row in it has been stored.
+// Central remembers the highest acknowledged seq per region and skips rows
+// at or below it, so a batch resent after a lost ack or a crash is stored
+// once. An idle connection is kept alive with Heartbeat frames, which
+// central echoes.
+//
+// Instead of batches, a regional server that is being provisioned sends a
+// SnapshotRequest after the Welcome. Central copies the region's partition
+// with SQLite's online backup API and streams the file back as SnapshotChunk
+// frames ("varint watermark, varint total size, varint offset, bytes data"),
+// in order, the watermark being the seq the copy is consistent with.
+//
+// Between batches, a regional server checks that central still holds what it
+// sent by comparing hash trees over each table (merkle.hpp): a MerkleQuery
+// ("u8 table id, varint level, varint count, count varint node indexes")
+// asks for the children of those nodes, and the MerkleReply repeats the
+// table and level and gives, per queried node in order, "varint count,
+// count × (varint child index, varint hash)". Level 0 children are rows
+// (primary key, row hash). Rows that differ go out again as ordinary
+// changes with new seqs.
+//
+// Central also pushes the service catalog (usluge) of every other region.
+// After the Welcome a regional server sends a CatalogSubscribe with the seq
+// it has applied per origin region ("varint count, count × (bytes region
+// id, varint seq)"); central then sends CatalogUpdate frames, unprompted,
+// whenever an origin has changes past that. A CatalogUpdate is laid out
+// like a Batch whose region id, seqs and rows are the origin's; deletes are
+// included. The regional server stores the seq with the rows, so the next
+// subscribe resumes where it left off.
+//
+// Batch payload:
+//     u8 type, u8 flags, bytes region_id, varint first_seq, varint last_seq,
+//     bytes traceparent, body
+// The body is a run of table groups, each "u8 table id, varint row count,
+// rows". A row is "varint seq, u8 op" followed, for an upsert, by a varint
+// NULL bitmap and the non-NULL columns in schema order (integers as zigzag
+// varints, reals as 8-byte doubles, text as length-prefixed bytes), or, for
+// a delete, by the zigzag-varint primary key. With kFlagCompressed the body
+// is "varint raw size, zlib stream" instead.
+//
+// Column types are fixed by the shared schema below, so rows carry no type
+// tags or separators and user data can contain anything. Decoding returns
+// views into the received frame (or the decompressed body) without copying.
+
+#include <zlib.h>
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "wire.hpp"
+
+namespace syncproto {
+
+enum class MessageType : uint8_t {
+    batch = 1, ack = 2, heartbeat = 3, hello = 4, welcome = 5, snapshot_request = 6, snapshot_chunk = 7,
+    merkle_query = 8, merkle_reply = 9, catalog_subscribe = 10, catalog_update = 11
+};
+enum class Op : uint8_t { upsert = 1, remove = 2 };
+enum class ColumnType : uint8_t { integer, real, text };
+
+constexpr uint8_t kFlagCompressed = 0x01;
+
+constexpr uint32_t kProtocolVersion = 1;
+
+// Capability bits. A regional server offers what it can send, central grants
+// the subset it can read, and only granted features are used.
+constexpr uint64_t kCapCompression = 0x01; // zlib batch bodies
+constexpr uint64_t kCapTracing = 0x02;     // traceparent in batches
+constexpr uint64_t kCapSnapshot = 0x04;    // SnapshotRequest
+constexpr uint64_t kCapMerkle = 0x08;      // MerkleQuery
+constexpr uint64_t kCapCatalog = 0x10;     // CatalogSubscribe / CatalogUpdate
+constexpr uint64_t kCapAll = kCapCompression | kCapTracing | kCapSnapshot | kCapMerkle | kCapCatalog;
+
+// Snapshot data per SnapshotChunk frame.
+constexpr size_t kSnapshotChunkSize = 256 * 1024;
+
+// Most nodes per MerkleQuery; a full leaf reply is about 1 KiB.
+constexpr size_t kMerkleMaxNodes = 4096;
+
+// Bodies smaller than this go out uncompressed; so do bodies zlib can't
+// shrink.
+constexpr size_t kCompressMinBytes = 512;
+
+// Upper bound on a sync frame and on a decompressed body.
+constexpr uint32_t kMaxFrameSize = 64 * 1024 * 1024;
+
+struct Column {
+    const char* name;
+    ColumnType type;
+};
+
+// A replicated table. Column 0 is the INTEGER PRIMARY KEY.
+struct Table {
+    uint8_t id;
+    const char* name; // also the table name used in central's storage
+    const Column* columns;
+    size_t column_count;
+};
+
+namespace schema {
+
+inline constexpr Column korisnici[] = {
+    {"user_id", ColumnType::integer}, {"username", ColumnType::text},
+    {"email", ColumnType::text}, {"user_type", ColumnType::text},
+};
+inline constexpr Column usluge[] = {
+    {"service_id", ColumnType::integer}, {"seller_id", ColumnType::integer},
+    {"service_name", ColumnType::text}, {"price", ColumnType::real},
+    {"capacity", ColumnType::integer}, {"working_hours", ColumnType::text},
+    {"service_type", ColumnType::text}, {"loyalty_requirement", ColumnType::integer},
+    {"loyalty_discount", ColumnType::real},
+};
+inline constexpr Column narudzbe[] = {
+    {"order_id", ColumnType::integer}, {"buyer_id", ColumnType::integer},
+    {"seller_id", ColumnType::integer}, {"service_id", ColumnType::integer},
+    {"quantity", ColumnType::integer}, {"cost", ColumnType::real},
+    {"order_status", ColumnType::text},
+};
+inline constexpr Column loyalnost[] = {
+    {"loyalty_id", ColumnType::integer}, {"buyer_id", ColumnType::integer},
+    {"seller_id", ColumnType::integer}, {"loyalty_points", ColumnType::integer},
+};
+
+} // namespace schema
+
+inline constexpr Table kTables[] = {
+    {1, "korisnici", schema::korisnici, std::size(schema::korisnici)},
+    {2, "usluge", schema::usluge, std::size(schema::usluge)},
+    {3, "narudzbe", schema::narudzbe, std::size(schema::narudzbe)},
+    {4, "loyalnost", schema::loyalnost, std::size(schema::loyalnost)},
+};
+
+constexpr size_t kMaxColumns = 16;
+
+inline const Table* find_table(uint8_t id) {
+    for (const Table& table : kTables) {
+        if (table.id == id) return &table;
+    }
+    return nullptr;
+}
+
+inline const Table* find_table(std::string_view name) {
+    for (const Table& table : kTables) {
+        if (name == table.name) return &table;
+    }
+    return nullptr;
+}
+
+// One column value. Text points at the caller's (or the frame's) buffer.
+struct Value {
+    bool null = true;
+    int64_t integer = 0;
+    double real = 0;
+    std::string_view text;
+};
+
+// ---- encoding ---------------------------------------------------------------
+
+// Collects rows per table, then writes the complete Batch frame.
+class BatchWriter {
+public:
+    // `values` holds table.column_count entries; each is encoded as the
+    // schema's type.
+    void upsert(const Table& table, uint64_t seq, const Value* values) {
+        Group& group = group_for(table);
+        wire::put_varint(group.rows, seq);
+        wire::put_u8(group.rows, static_cast<uint8_t>(Op::upsert));
+        uint64_t nulls = 0;
+        for (size_t i = 0; i < table.column_count; ++i) {
+            if (values[i].null) nulls |= uint64_t(1) << i;
+        }
+        wire::put_varint(group.rows, nulls);
+        for (size_t i = 0; i < table.column_count; ++i) {
+            if (values[i].null) continue;
+            switch (table.columns[i].type) {
+                case ColumnType::integer: wire::put_svarint(group.rows, values[i].integer); break;
+                case ColumnType::real: wire::put_double(group.rows, values[i].real); break;
+                case ColumnType::text: wire::put_bytes(group.rows, values[i].text); break;
+            }
+        }
+        ++group.count;
+        ++rows_;
+    }
+
+    void remove(const Table& table, uint64_t seq, int64_t key) {
+        Group& group = group_for(table);
+        wire::put_varint(group.rows, seq);
+        wire::put_u8(group.rows, static_cast<uint8_t>(Op::remove));
+        wire::put_svarint(group.rows, key);
+        ++group.count;
+        ++rows_;
+    }
+
+    size_t rows() const { return rows_; }
+
+    // Appends the frame (a Batch, or a CatalogUpdate) to `out`. Returns the
+    // encoded body size, after compression if that was used.
+    size_t finish(std::string& out, std::string_view region_id, uint64_t first_seq, uint64_t last_seq,
+                  std::string_view traceparent, bool allow_compression = true,
+                  MessageType type = MessageType::batch) const {
+        std::string body;
+        for (const Group& group : groups_) {
+            if (!group.count) continue;
+            wire::put_u8(body, group.table_id);
+            wire::put_varint(body, group.count);
+            body += group.rows;
+        }
+
+        uint8_t flags = 0;
+        std::string compressed;
+        if (allow_compression && body.size() >= kCompressMinBytes && compress(body, compressed)) {
+            flags |= kFlagCompressed;
+        }
+
+        size_t start = wire::begin_frame(out);
+        wire::put_u8(out, static_cast<uint8_t>(type));
+        wire::put_u8(out, flags);
+        wire::put_bytes(out, region_id);
+        wire::put_varint(out, first_seq);
+        wire::put_varint(out, last_seq);
+        wire::put_bytes(out, traceparent);
+        const std::string& payload = flags & kFlagCompressed ? compressed : body;
+        out += payload;
+        wire::finish_frame(out, start);
+        return payload.size();
+    }
+
+private:
+    struct Group {
+        uint8_t table_id = 0;
+        uint64_t count = 0;
+        std::string rows;
+    };
+
+    Group& group_for(const Table& table) {
+        Group& group = groups_[table.id % groups_.size()];
+        group.table_id = table.id;
+        return group;
+    }
+
+    // "varint raw size, zlib stream"; false if it would not be smaller.
+    static bool compress(const std::string& body, std::string& out) {
+        wire::put_varint(out, body.size());
+        size_t header = out.size();
+        uLongf bound = compressBound(static_cast<uLong>(body.size()));
+        out.resize(header + bound);
+        if (::compress2(reinterpret_cast<Bytef*>(&out[header]), &bound,
+                        reinterpret_cast<const Bytef*>(body.data()), static_cast<uLong>(body.size()),
+                        Z_BEST_SPEED) != Z_OK) {
+            return false;
+        }
+        out.resize(header + bound);
+        return out.size() < body.size();
+    }
+
+    std::array<Group, std::size(kTables) + 1> groups_;
+    size_t rows_ = 0;
+};
+
+inline void encode_ack(std::string& out, uint64_t last_seq) {
+    size_t start = wire::begin_frame(out);
+    wire::put_u8(out, static_cast<uint8_t>(MessageType::ack));
+    wire::put_varint(out, last_seq);
+    wire::finish_frame(out, start);
+}
+
+struct Hello {
+    uint32_t version = kProtocolVersion;
+    std::string_view region_id;
+    uint64_t capabilities = 0;
+};
+
+struct Welcome {
+    uint32_t version = kProtocolVersion;
+    uint64_t capabilities = 0;
+    uint64_t watermark = 0; // highest seq central has stored for the region
+};
+
+inline void encode_hello(std::string& out, const Hello& hello) {
+    size_t start = wire::begin_frame(out);
+    wire::put_u8(out, static_cast<uint8_t>(MessageType::hello));
+    wire::put_varint(out, hello.version);
+    wire::put_bytes(out, hello.region_id);
+    wire::put_varint(out, hello.capabilities);
+    wire::finish_frame(out, start);
+}
+
+inline void encode_welcome(std::string& out, const Welcome& welcome) {
+    size_t start = wire::begin_frame(out);
+    wire::put_u8(out, static_cast<uint8_t>(MessageType::welcome));
+    wire::put_varint(out, welcome.version);
+    wire::put_varint(out, welcome.capabilities);
+    wire::put_varint(out, welcome.watermark);
+    wire::finish_frame(out, start);
+}
+
+inline void encode_heartbeat(std::string& out) {
+    size_t start = wire::begin_frame(out);
+    wire::put_u8(out, static_cast<uint8_t>(MessageType::heartbeat));
+    wire::finish_frame(out, start);
+}
+
+inline void encode_snapshot_request(std::string& out) {
+    size_t start = wire::begin_frame(out);
+    wire::put_u8(out, static_cast<uint8_t>(MessageType::snapshot_request));
+    wire::finish_frame(out, start);
+}
+
+struct SnapshotChunk {
+    uint64_t watermark = 0;
+    uint64_t total_size = 0;
+    uint64_t offset = 0;
+    std::string_view data;
+};
+
+inline void encode_snapshot_chunk(std::string& out, const SnapshotChunk& chunk) {
+    size_t start = wire::begin_frame(out);
+    wire::put_u8(out, static_cast<uint8_t>(MessageType::snapshot_chunk));
+    wire::put_varint(out, chunk.watermark);
+    wire::put_varint(out, chunk.total_size);
+    wire::put_varint(out, chunk.offset);
+    wire::put_bytes(out, chunk.data);
+    wire::finish_frame(out, start);
+}
+
+struct MerkleQuery {
+    uint8_t table = 0;
+    uint32_t level = 0;
+    std::vector<uint64_t> indexes;
+};
+
+// Per queried node, its children as (index, hash).
+struct MerkleReply {
+    uint8_t table = 0;
+    uint32_t level = 0;
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> nodes;
+};
+
+inline void encode_merkle_query(std::string& out, const MerkleQuery& query) {
+    size_t start = wire::begin_frame(out);
+    wire::put_u8(out, static_cast<uint8_t>(MessageType::merkle_query));
+    wire::put_u8(out, query.table);
+    wire::put_varint(out, query.level);
+    wire::put_varint(out, query.indexes.size());
+    for (uint64_t index : query.indexes) wire::put_varint(out, index);
+    wire::finish_frame(out, start);
+}
+
+inline void encode_merkle_reply(std::string& out, const MerkleReply& reply) {
+    size_t start = wire::begin_frame(out);
+    wire::put_u8(out, static_cast<uint8_t>(MessageType::merkle_reply));
+    wire::put_u8(out, reply.table);
+    wire::put_varint(out, reply.level);
+    for (const auto& children : reply.nodes) {
+        wire::put_varint(out, children.size());
+        for (const auto& [index, hash] : children) {
+            wire::put_varint(out, index);
+            wire::put_varint(out, hash);
+        }
+    }
+    wire::finish_frame(out, start);
+}
+
+// Seq applied per origin region.
+using CatalogVersions = std::vector<std::pair<std::string_view, uint64_t>>;
+
+inline void encode_catalog_subscribe(std::string& out, const CatalogVersions& versions) {
+    size_t start = wire::begin_frame(out);
+    wire::put_u8(out, static_cast<uint8_t>(MessageType::catalog_subscribe));
+    wire::put_varint(out, versions.size());
+    for (const auto& [region, seq] : versions) {
+        wire::put_bytes(out, region);
+        wire::put_varint(out, seq);
+    }
+    wire::finish_frame(out, start);
+}
+
+// ---- decoding ---------------------------------------------------------------
+
+inline bool decode_type(std::string_view payload, MessageType& type) {
+    uint8_t t;
+    if (!wire::get_u8(payload, t)) return false;
+    type = static_cast<MessageType>(t);
+    return true;
+}
+
+inline bool decode_ack(std::string_view payload, uint64_t& last_seq) {
+    uint8_t type;
+    return wire::get_u8(payload, type) && type == static_cast<uint8_t>(MessageType::ack)
+        && wire::get_varint(payload, last_seq) && payload.empty();
+}
+
+inline bool decode_hello(std::string_view payload, Hello& hello) {
+    uint8_t type;
+    uint64_t version;
+    if (!wire::get_u8(payload, type) || type != static_cast<uint8_t>(MessageType::hello)
+        || !wire::get_varint(payload, version) || !wire::get_bytes(payload, hello.region_id)
+        || !wire::get_varint(payload, hello.capabilities)) {
+        return false;
+    }
+    hello.version = static_cast<uint32_t>(version);
+    return true;
+}
+
+inline bool decode_welcome(std::string_view payload, Welcome& welcome) {
+    uint8_t type;
+    uint64_t version;
+    if (!wire::get_u8(payload, type) || type != static_cast<uint8_t>(MessageType::welcome)
+        || !wire::get_varint(payload, version) || !wire::get_varint(payload, welcome.capabilities)
+        || !wire::get_varint(payload, welcome.watermark)) {
+        return false;
+    }
+    welcome.version = static_cast<uint32_t>(version);
+    return true;
+}
+
+inline bool decode_snapshot_chunk(std::string_view payload, SnapshotChunk& chunk) {
+    uint8_t type;
+    return wire::get_u8(payload, type) && type == static_cast<uint8_t>(MessageType::snapshot_chunk)
+        && wire::get_varint(payload, chunk.watermark) && wire::get_varint(payload, chunk.total_size)
+        && wire::get_varint(payload, chunk.offset) && wire::get_bytes(payload, chunk.data) && payload.empty();
+}
+
+inline bool decode_merkle_query(std::string_view payload, MerkleQuery& query) {
+    uint8_t type;
+    uint64_t level, count;
+    if (!wire::get_u8(payload, type) || type != static_cast<uint8_t>(MessageType::merkle_query)
+        || !wire::get_u8(payload, query.table) || !wire::get_varint(payload, level)
+        || !wire::get_varint(payload, count) || count > kMerkleMaxNodes) {
+        return false;
+    }
+    query.level = static_cast<uint32_t>(level);
+    query.indexes.resize(count);
+    for (uint64_t& index : query.indexes) {
+        if (!wire::get_varint(payload, index)) return false;
+    }
+    return payload.empty();
+}
+
+// `expected` is the number of nodes that were queried.
+inline bool decode_merkle_reply(std::string_view payload, size_t expected, MerkleReply& reply) {
+    uint8_t type;
+    uint64_t level;
+    if (!wire::get_u8(payload, type) || type != static_cast<uint8_t>(MessageType::merkle_reply)
+        || !wire::get_u8(payload, reply.table) || !wire::get_varint(payload, level)) {
+        return false;
+    }
+    reply.level = static_cast<uint32_t>(level);
+    reply.nodes.assign(expected, {});
+    for (auto& children : reply.nodes) {
+        uint64_t count;
+        // Each child takes at least two bytes.
+        if (!wire::get_varint(payload, count) || count > payload.size() / 2) return false;
+        children.resize(count);
+        for (auto& [index, hash] : children) {
+            if (!wire::get_varint(payload, index) || !wire::get_varint(payload, hash)) return false;
+        }
+    }
+    return payload.empty();
+}
+
+inline bool decode_catalog_subscribe(std::string_view payload, CatalogVersions& versions) {
+    uint8_t type;
+    uint64_t count;
+    if (!wire::get_u8(payload, type) || type != static_cast<uint8_t>(MessageType::catalog_subscribe)
+        || !wire::get_varint(payload, count) || count > payload.size() / 2) {
+        return false;
+    }
+    versions.resize(count);
+    for (auto& [region, seq] : versions) {
+        if (!wire::get_bytes(payload, region) || !wire::get_varint(payload, seq)) return false;
+    }
+    return payload.empty();
+}
+
+struct BatchHeader {
+    uint8_t flags = 0;
+    std::string_view region_id;
+    uint64_t first_seq = 0; // seq range of the rows in the batch
+    uint64_t last_seq = 0;
+    std::string_view traceparent;
+    std::string_view body; // uncompressed table groups
+};
+
+// Parses a Batch (or, with `expected`, CatalogUpdate) frame payload. A
+// compressed body is inflated into `scratch`; otherwise header.body points
+// into `payload`.
+inline bool decode_batch(std::string_view payload, BatchHeader& header, std::string& scratch,
+                         MessageType expected = MessageType::batch) {
+    uint8_t type;
+    if (!wire::get_u8(payload, type) || type != static_cast<uint8_t>(expected)
+        || !wire::get_u8(payload, header.flags) || !wire::get_bytes(payload, header.region_id)
+        || !wire::get_varint(payload, header.first_seq) || !wire::get_varint(payload, header.last_seq)
+        || !wire::get_bytes(payload, header.traceparent)) {
+        return false;
+    }
+    if (!(header.flags & kFlagCompressed)) {
+        header.body = payload;
+        return true;
+    }
+    uint64_t raw_size;
+    if (!wire::get_varint(payload, raw_size) || raw_size > kMaxFrameSize) return false;
+    scratch.resize(static_cast<size_t>(raw_size));
+    uLongf size = static_cast<uLongf>(raw_size);
+    if (::uncompress(reinterpret_cast<Bytef*>(&scratch[0]), &size,
+                     reinterpret_cast<const Bytef*>(payload.data()), static_cast<uLong>(payload.size())) != Z_OK
+        || size != raw_size) {
+        return false;
+    }
+    header.body = scratch;
+    return true;
+}
+
+struct Row {
+    const Table* table = nullptr;
+    uint64_t seq = 0;
+    Op op = Op::upsert;
+    int64_t key = 0; // primary key, for upserts too
+    std::array<Value, kMaxColumns> values; // upserts only
+};
+
+// Walks the rows of a batch body in place.
+class BatchReader {
+public:
+    explicit BatchReader(std::string_view body) : in_(body) {}
+
+    // False at the end of the body or on malformed input (see failed()).
+    bool next(Row& row) {
+        while (remaining_ == 0) {
+            if (in_.empty()) return false;
+            uint8_t id;
+            if (!wire::get_u8(in_, id) || !(table_ = find_table(id)) || !wire::get_varint(in_, remaining_)) {
+                return fail();
+            }
+        }
+        --remaining_;
+        row.table = table_;
+        uint8_t op;
+        if (!wire::get_varint(in_, row.seq) || !wire::get_u8(in_, op)) return fail();
+        row.op = static_cast<Op>(op);
+        if (row.op == Op::remove) {
+            return wire::get_svarint(in_, row.key) || fail();
+        }
+        if (row.op != Op::upsert) return fail();
+
+        uint64_t nulls;
+        if (!wire::get_varint(in_, nulls)) return fail();
+        for (size_t i = 0; i < table_->column_count; ++i) {
+            Value& v = row.values[i];
+            v = Value{};
+            if (nulls & (uint64_t(1) << i)) continue;
+            v.null = false;
+            bool ok = false;
+            switch (table_->columns[i].type) {
+                case ColumnType::integer: ok = wire::get_svarint(in_, v.integer); break;
+                case ColumnType::real: ok = wire::get_double(in_, v.real); break;
+                case ColumnType::text: ok = wire::get_bytes(in_, v.text); break;
+            }
+            if (!ok) return fail();
+        }
+        row.key = row.values[0].integer;
+        return true;
+    }
+
+    bool failed() const { return failed_; }
+
+private:
+    bool fail() {
+        failed_ = true;
+        return false;
+    }
+
+    std::string_view in_;
+    const Table* table_ = nullptr;
+    uint64_t remaining_ = 0;
+    bool failed_ = false;
+};
+
+} // namespace syncproto
@@ -0,0 +1,156 @@
+// Checks that the SSE2 and AVX2 url_decode kernels agree with the scalar
+// loop: same verdict and, when decoding succeeds, the same bytes.
+//
+//   g++ -std=c++17 -O2 -I. tests/url_decode_test.cpp -o url_decode_test && ./url_decode_test  (from the repo root)
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "url_decode.hpp"
+
+namespace {
+
+struct Kernel {
+    const char* name;
+    urldecode::detail::Kernel run;
+};
+
+struct Result {
+    bool ok;
+    std::string out;
+};
+
+Result run(urldecode::detail::Kernel kernel, const std::string& in) {
+    std::string out(in.size(), '\0');
+    char* begin = &out[0];
+    char* end = begin;
+    bool ok = kernel(in.data(), in.size(), end);
+    out.resize(ok ? static_cast<size_t>(end - begin) : 0);
+    return {ok, out};
+}
+
+std::string escaped(const std::string& in) {
+    std::string out;
+    for (unsigned char c : in) {
+        if (c >= 0x20 && c < 0x7F) {
+            out += static_cast<char>(c);
+        } else {
+            char hex[5];
+            std::snprintf(hex, sizeof(hex), "\\x%02X", c);
+            out += hex;
+        }
+    }
+    return out;
+}
+
+int failures = 0;
+
+void check(const std::vector<Kernel>& kernels, const std::string& in) {
+    Result expected = run(urldecode::detail::decode_scalar, in);
+    for (const Kernel& kernel : kernels) {
+        Result got = run(kernel.run, in);
+        if (got.ok == expected.ok && got.out == expected.out) continue;
+        if (++failures <= 20) {
+            std::printf("%s differs on \"%s\" (%zu bytes): %s \"%s\", scalar %s \"%s\"\n", kernel.name,
+                        escaped(in).c_str(), in.size(), got.ok ? "ok" : "fail", escaped(got.out).c_str(),
+                        expected.ok ? "ok" : "fail", escaped(expected.out).c_str());
+        }
+    }
+}
+
+void expect(const std::string& in, bool ok, const std::string& out) {
+    Result got = run(urldecode::detail::decode_scalar, in);
+    if (got.ok == ok && (!ok || got.out == out)) return;
+    ++failures;
+    std::printf("scalar decodes \"%s\" as %s \"%s\", expected %s \"%s\"\n", escaped(in).c_str(),
+                got.ok ? "ok" : "fail", escaped(got.out).c_str(), ok ? "ok" : "fail", escaped(out).c_str());
+}
+
+// Random input of length n, biased towards what the kernels treat
+// specially: escapes (valid, truncated, non-hex), '+', raw non-ASCII and
+// escaped UTF-8 sequences, some of them broken.
+std::string random_input(std::mt19937& rng, size_t n) {
+    static const char* const pieces[] = {
+        "a", "b", "z", "0", "=", "&", "+", "%", "%2", "%20", "%41", "%zz", "%G1", "%C3%A9", "%E2%82%AC",
+        "%F0%9F%98%80", "%C3", "%E2%82", "%C0%80", "%ED%A0%80", "%F4%90%80%80", "%80", "%FF", "\xC3\xA9",
+        "\xE2\x82\xAC", "\xC3", "\x80", "\xFF",
+    };
+    std::uniform_int_distribution<size_t> pick(0, std::size(pieces) - 1);
+    std::uniform_int_distribution<int> plain(0, 3);
+    std::string out;
+    while (out.size() < n) {
+        // Mostly plain bytes, so the vector fast path gets exercised too.
+        out += plain(rng) ? std::string(1, static_cast<char>('a' + rng() % 26)) : std::string(pieces[pick(rng)]);
+    }
+    out.resize(n);
+    return out;
+}
+
+} // namespace
+
+int main() {
+    std::vector<Kernel> kernels;
+#ifdef URL_DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) kernels.push_back({"sse2", urldecode::detail::decode_sse2});
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({"avx2", urldecode::detail::decode_avx2});
+#endif
+    if (kernels.empty()) {
+        std::printf("No vector kernels on this CPU; nothing to compare\n");
+        return 0;
+    }
+
+    // The scalar loop itself, on known answers.
+    expect("", true, "");
+    expect("a+b%20c", true, "a b c");
+    expect("%C3%A9t%C3%A9", true, "\xC3\xA9t\xC3\xA9");
+    expect("%", false, "");
+    expect("%2", false, "");
+    expect("%zz", false, "");
+    expect("%C3", false, "");
+    expect("%C0%80", false, "");
+    expect("%ED%A0%80", false, "");
+    expect("\xFF", false, "");
+
+    size_t cases = 0;
+    // '%', a truncated escape, a full escape and a split UTF-8 sequence at
+    // every position of every length up to 64, so each lands on and around
+    // the 16- and 32-byte block ends.
+    const char* const probes[] = {"%", "%4", "%41", "%C3%A9", "\xC3\xA9", "+", "\x80"};
+    for (size_t n = 0; n <= 64; ++n) {
+        std::string plain(n, 'x');
+        check(kernels, plain);
+        ++cases;
+        for (size_t at = 0; at < n; ++at) {
+            for (const char* probe : probes) {
+                std::string in = plain;
+                in.replace(at, std::string(probe).size(), probe);
+                in.resize(n);
+                check(kernels, in);
+                ++cases;
+            }
+        }
+    }
+
+    // A multi-byte sequence broken by a run of ASCII long enough to fill a
+    // whole block: the fast path must not skip the pending continuation.
+    for (size_t offset = 0; offset <= 33; ++offset) {
+        for (size_t gap = 0; gap <= 40; ++gap) {
+            std::string prefix(offset, 'x'), ascii(gap, 'a');
+            check(kernels, prefix + "\xC3" + ascii + "\xA9");
+            check(kernels, prefix + "%C3" + ascii + "%A9");
+            cases += 2;
+        }
+    }
+
+    std::mt19937 rng(12345);
+    for (size_t n = 0; n <= 64; ++n) {
+        for (int i = 0; i < 2000; ++i, ++cases) check(kernels, random_input(rng, n));
+    }
+    for (int i = 0; i < 2000; ++i, ++cases) check(kernels, random_input(rng, 65 + rng() % 4000));
+
+    std::printf("%zu inputs, %zu kernels, %d failures\n", cases, kernels.size(), failures);
+    return failures ? 1 : 0;
+}
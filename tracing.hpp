@@ -0,0 +1,298 @@
+#pragma once
+
+// Request tracing with W3C trace context and Chrome trace-event output.
+//
+// A trace id follows one user action from the client through the regional
+// server to central; every timed phase along the way is a span with its own
+// id and its parent's. Context travels as a W3C "traceparent" value
+// (00-<32 hex trace id>-<16 hex span id>-<flags>) in an HTTP header, in the
+// binary protocol's optional trace field and in sync messages.
+//
+// Replication is batched, so it can't continue each request's trace: a
+// sync pass is a trace of its own, and its traceparent is the one batches
+// carry to central (whose "process" spans are its children). To follow a
+// write to its replication, the regional server stores the writing
+// request's traceparent with the change (Changelog.traceparent) and, once
+// central acknowledges the batch that shipped it, records a "replicate" span
+// in the request's trace with a link (args.link) to the sync pass.
+//
+// Spans are written to --trace-file as Chrome trace-event JSON ("X" complete
+// events, microsecond wall-clock timestamps) that chrome://tracing and
+// Perfetto open directly, including a file left unterminated by a killed
+// process. Files from the client, regional and central servers can be loaded
+// side by side; args.trace_id and args.parent_id tie the pieces together.
+//
+// With no trace file the Span constructor and destructor only check a flag.
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <unistd.h>
+
+#include "json_writer.hpp"
+
+namespace tracing {
+
+struct Context {
+    std::array<uint8_t, 16> trace_id{};
+    uint64_t span_id = 0;
+    bool sampled = true;
+
+    bool valid() const {
+        for (uint8_t b : trace_id) {
+            if (b) return span_id != 0;
+        }
+        return false;
+    }
+};
+
+namespace detail {
+
+inline std::mt19937_64& rng() {
+    thread_local std::mt19937_64 gen(std::random_device{}());
+    return gen;
+}
+
+inline void append_hex(std::string& out, uint64_t v, int digits) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = digits - 1; i >= 0; --i) out += hex[(v >> (4 * i)) & 0xF];
+}
+
+inline bool parse_hex(std::string_view s, uint64_t& v) {
+    v = 0;
+    for (char c : s) {
+        int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (d < 0) return false;
+        v = (v << 4) | static_cast<uint64_t>(d);
+    }
+    return true;
+}
+
+} // namespace detail
+
+inline uint64_t new_span_id() {
+    uint64_t id;
+    do id = detail::rng()(); while (id == 0);
+    return id;
+}
+
+// A fresh trace with a random id.
+inline Context new_trace() {
+    Context ctx;
+    uint64_t hi = detail::rng()(), lo = detail::rng()();
+    for (int i = 0; i < 8; ++i) {
+        ctx.trace_id[i] = static_cast<uint8_t>(hi >> (56 - 8 * i));
+        ctx.trace_id[8 + i] = static_cast<uint8_t>(lo >> (56 - 8 * i));
+    }
+    ctx.span_id = new_span_id();
+    return ctx;
+}
+
+inline std::string trace_id_hex(const Context& ctx) {
+    std::string out;
+    out.reserve(32);
+    for (uint8_t b : ctx.trace_id) detail::append_hex(out, b, 2);
+    return out;
+}
+
+inline std::string format_traceparent(const Context& ctx) {
+    std::string out = "00-" + trace_id_hex(ctx) + "-";
+    detail::append_hex(out, ctx.span_id, 16);
+    out += ctx.sampled ? "-01" : "-00";
+    return out;
+}
+
+inline bool parse_traceparent(std::string_view s, Context& ctx) {
+    if (s.size() < 55 || s.substr(0, 3) != "00-" || s[35] != '-' || s[52] != '-') return false;
+    for (int i = 0; i < 16; ++i) {
+        uint64_t byte;
+        if (!detail::parse_hex(s.substr(3 + 2 * i, 2), byte)) return false;
+        ctx.trace_id[i] = static_cast<uint8_t>(byte);
+    }
+    uint64_t flags;
+    if (!detail::parse_hex(s.substr(36, 16), ctx.span_id) || !detail::parse_hex(s.substr(53, 2), flags)) return false;
+    ctx.sampled = flags & 1;
+    return ctx.valid();
+}
+
+inline int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Appends trace events to a file. Opt-in, so a mutex around a buffered FILE
+// is good enough; a background thread flushes it every 250 ms so a killed
+// process loses little.
+class Recorder {
+public:
+    static Recorder& instance() {
+        static Recorder recorder;
+        return recorder;
+    }
+
+    bool start(const std::string& path, std::string_view process_name) {
+        file_ = std::fopen(path.c_str(), "w");
+        if (!file_) return false;
+        std::string meta = "[\n";
+        JsonWriter(meta).begin_object()
+            .field("name", "process_name")
+            .field("ph", "M")
+            .field("pid", static_cast<long>(getpid()))
+            .key("args").begin_object().field("name", process_name).end_object()
+            .end_object();
+        std::fputs(meta.c_str(), file_);
+        std::fflush(file_);
+        enabled_ = true;
+        std::thread([this] {
+            for (;;) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(250));
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!file_) return;
+                std::fflush(file_);
+            }
+        }).detach();
+        return true;
+    }
+
+    bool enabled() const { return enabled_; }
+
+    // Writes one complete span; `link`, if given, is a span in another
+    // trace it relates to.
+    void record(std::string_view name, const Context& ctx, uint64_t parent_id, int64_t start_us, int64_t end_us,
+                std::string_view note = {}, const Context* link = nullptr) {
+        std::string event = ",\n";
+        std::string span, parent;
+        detail::append_hex(span, ctx.span_id, 16);
+        if (parent_id) detail::append_hex(parent, parent_id, 16);
+        JsonWriter writer(event);
+        writer.begin_object()
+            .field("name", name)
+            .field("ph", "X")
+            .field("ts", static_cast<long long>(start_us))
+            .field("dur", static_cast<long long>(end_us - start_us))
+            .field("pid", static_cast<long>(getpid()))
+            .field("tid", static_cast<long>(thread_number()))
+            .key("args").begin_object()
+                .field("trace_id", trace_id_hex(ctx))
+                .field("span_id", span);
+        if (parent_id) writer.field("parent_id", parent);
+        if (!note.empty()) writer.field("detail", note);
+        if (link) writer.field("link", format_traceparent(*link));
+        writer.end_object().end_object();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (file_) std::fputs(event.c_str(), file_);
+    }
+
+    ~Recorder() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!file_) return;
+        std::fputs("\n]\n", file_);
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+
+private:
+    Recorder() = default;
+
+    static unsigned thread_number() {
+        static std::atomic<unsigned> next{1};
+        thread_local unsigned number = next.fetch_add(1);
+        return number;
+    }
+
+    std::FILE* file_ = nullptr;
+    bool enabled_ = false;
+    std::mutex mutex_;
+};
+
+inline bool enabled() { return Recorder::instance().enabled(); }
+
+// The innermost open span on this thread; new spans become its children.
+inline Context& current() {
+    thread_local Context ctx;
+    return ctx;
+}
+
+// A timed span. Opens as a child of current() (or of an explicit parent,
+// e.g. one taken from a traceparent header), becomes current() for its
+// lifetime and is written out when it ends.
+class Span {
+public:
+    explicit Span(std::string_view name, std::string_view note = {})
+        : Span(name, current(), now_us(), note) {}
+
+    // `parent` may be invalid, which starts a new trace. `start_us` lets a
+    // span cover work done before its context was known (e.g. reading the
+    // request that carried the traceparent).
+    Span(std::string_view name, const Context& parent, int64_t start_us, std::string_view note = {}) {
+        if (!enabled()) return;
+        active_ = true;
+        name_ = name;
+        note_ = note;
+        start_us_ = start_us;
+        saved_ = current();
+        if (parent.valid()) {
+            ctx_ = parent;
+            parent_id_ = parent.span_id;
+            ctx_.span_id = new_span_id();
+        } else {
+            ctx_ = new_trace();
+        }
+        current() = ctx_;
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+    ~Span() { end(); }
+
+    // Ends the span early; the destructor then does nothing.
+    void end() {
+        if (!active_) return;
+        active_ = false;
+        Recorder::instance().record(name_, ctx_, parent_id_, start_us_, now_us(), note_);
+        current() = saved_;
+    }
+
+    const Context& context() const { return ctx_; }
+
+private:
+    bool active_ = false;
+    std::string name_;
+    std::string note_;
+    Context ctx_;
+    Context saved_;
+    uint64_t parent_id_ = 0;
+    int64_t start_us_ = 0;
+};
+
+// Records an already-finished child of current(), e.g. a SQL statement
+// timed by its cursor.
+inline void record_child(std::string_view name, int64_t start_us, int64_t end_us, std::string_view note = {}) {
+    if (!enabled()) return;
+    const Context& parent = current();
+    Context ctx = parent.valid() ? parent : new_trace();
+    ctx.span_id = new_span_id();
+    Recorder::instance().record(name, ctx, parent.valid() ? parent.span_id : 0, start_us, end_us, note);
+}
+
+// Records an already-finished child of `parent` (a span that has itself
+// ended, e.g. a request whose write is replicated later), linked to `link`.
+inline void record_linked(std::string_view name, const Context& parent, int64_t start_us, int64_t end_us,
+                          const Context& link, std::string_view note = {}) {
+    if (!enabled() || !parent.valid()) return;
+    Context ctx = parent;
+    ctx.span_id = new_span_id();
+    Recorder::instance().record(name, ctx, parent.span_id, start_us, end_us, note, link.valid() ? &link : nullptr);
+}
+
+} // namespace tracing
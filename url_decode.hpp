@@ -0,0 +1,195 @@
+#pragma once
+
+// Percent-decoding for application/x-www-form-urlencoded bodies.
+//
+// The decoder scans 16 (SSE2) or 32 (AVX2) bytes at a time for '%', '+' and
+// non-ASCII bytes and copies plain runs straight to the output. Escapes and
+// multi-byte sequences drop to a table-driven scalar path that also validates
+// the decoded bytes as UTF-8, so a single pass both decodes and validates.
+// The widest kernel the CPU supports is picked once at runtime; other
+// architectures use the scalar loop.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define URL_DECODE_X86 1
+#endif
+
+namespace urldecode {
+namespace detail {
+
+// -1 for anything that is not a hex digit.
+struct HexTable {
+    int8_t v[256];
+    constexpr HexTable() : v() {
+        for (int i = 0; i < 256; ++i) v[i] = -1;
+        for (int i = 0; i < 10; ++i) v['0' + i] = static_cast<int8_t>(i);
+        for (int i = 0; i < 6; ++i) {
+            v['a' + i] = static_cast<int8_t>(10 + i);
+            v['A' + i] = static_cast<int8_t>(10 + i);
+        }
+    }
+};
+inline constexpr HexTable kHex{};
+
+// Incremental UTF-8 validator (RFC 3629: no overlongs, surrogates or code
+// points above U+10FFFF).
+struct Utf8State {
+    unsigned need = 0;          // continuation bytes still expected
+    unsigned char lo = 0x80;    // allowed range of the next continuation byte
+    unsigned char hi = 0xBF;
+};
+
+inline bool utf8_feed(Utf8State& s, unsigned char c) {
+    if (s.need == 0) {
+        if (c < 0x80) return true;
+        s.lo = 0x80;
+        s.hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) { s.need = 1; }
+        else if (c == 0xE0) { s.need = 2; s.lo = 0xA0; }
+        else if (c == 0xED) { s.need = 2; s.hi = 0x9F; }
+        else if (c >= 0xE1 && c <= 0xEF) { s.need = 2; }
+        else if (c == 0xF0) { s.need = 3; s.lo = 0x90; }
+        else if (c == 0xF4) { s.need = 3; s.hi = 0x8F; }
+        else if (c >= 0xF1 && c <= 0xF3) { s.need = 3; }
+        else return false;
+        return true;
+    }
+    if (c < s.lo || c > s.hi) return false;
+    s.lo = 0x80;
+    s.hi = 0xBF;
+    --s.need;
+    return true;
+}
+
+// Decodes one token at in[i] ('%HH', '+' or a literal byte) and any run of
+// escapes that immediately follows it. Returns the index after the consumed
+// input, or std::string_view::npos on a malformed escape / invalid UTF-8.
+inline size_t decode_token(const char* in, size_t n, size_t i, char*& out, Utf8State& utf8) {
+    unsigned char c = static_cast<unsigned char>(in[i]);
+    if (c == '+') {
+        if (utf8.need != 0) return std::string_view::npos;
+        *out++ = ' ';
+        return i + 1;
+    }
+    if (c != '%') {
+        if (!utf8_feed(utf8, c)) return std::string_view::npos;
+        *out++ = static_cast<char>(c);
+        return i + 1;
+    }
+    // Escapes usually come in runs (every byte of a multi-byte character is
+    // escaped), so keep decoding while the next byte is another '%'.
+    do {
+        if (i + 2 >= n) return std::string_view::npos;
+        int h = kHex.v[static_cast<unsigned char>(in[i + 1])];
+        int l = kHex.v[static_cast<unsigned char>(in[i + 2])];
+        if ((h | l) < 0) return std::string_view::npos;
+        unsigned char b = static_cast<unsigned char>((h << 4) | l);
+        if (!utf8_feed(utf8, b)) return std::string_view::npos;
+        *out++ = static_cast<char>(b);
+        i += 3;
+    } while (i < n && in[i] == '%');
+    return i;
+}
+
+inline size_t decode_tail(const char* in, size_t n, size_t i, char*& out, Utf8State& utf8) {
+    while (i < n) {
+        i = decode_token(in, n, i, out, utf8);
+        if (i == std::string_view::npos) return i;
+    }
+    return i;
+}
+
+inline bool decode_scalar(const char* in, size_t n, char*& out) {
+    Utf8State utf8;
+    return decode_tail(in, n, 0, out, utf8) != std::string_view::npos && utf8.need == 0;
+}
+
+#ifdef URL_DECODE_X86
+
+__attribute__((target("sse2")))
+inline bool decode_sse2(const char* in, size_t n, char*& out) {
+    const __m128i pct = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    Utf8State utf8;
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus));
+        // movemask picks up the high bit, so non-ASCII bytes are flagged too.
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(special, v)));
+        if (mask == 0 && utf8.need == 0) {
+            std::memcpy(out, in + i, 16);
+            out += 16;
+            i += 16;
+            continue;
+        }
+        // Copy the plain prefix, then hand the first flagged byte to the
+        // scalar path. Mid-sequence, the next byte must be a continuation.
+        size_t run = (mask != 0 && utf8.need == 0) ? static_cast<size_t>(__builtin_ctz(mask)) : 0;
+        std::memcpy(out, in + i, run);
+        out += run;
+        i = decode_token(in, n, i + run, out, utf8);
+        if (i == std::string_view::npos) return false;
+    }
+    return decode_tail(in, n, i, out, utf8) != std::string_view::npos && utf8.need == 0;
+}
+
+__attribute__((target("avx2")))
+inline bool decode_avx2(const char* in, size_t n, char*& out) {
+    const __m256i pct = _mm256_set1_epi8('%');
+    const __m256i plus = _mm256_set1_epi8('+');
+    Utf8State utf8;
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(v, pct), _mm256_cmpeq_epi8(v, plus));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(special, v)));
+        if (mask == 0 && utf8.need == 0) {
+            std::memcpy(out, in + i, 32);
+            out += 32;
+            i += 32;
+            continue;
+        }
+        size_t run = (mask != 0 && utf8.need == 0) ? static_cast<size_t>(__builtin_ctz(mask)) : 0;
+        std::memcpy(out, in + i, run);
+        out += run;
+        i = decode_token(in, n, i + run, out, utf8);
+        if (i == std::string_view::npos) return false;
+    }
+    return decode_tail(in, n, i, out, utf8) != std::string_view::npos && utf8.need == 0;
+}
+
+#endif
+
+using Kernel = bool (*)(const char*, size_t, char*&);
+
+inline Kernel select_kernel() {
+#ifdef URL_DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return decode_avx2;
+    if (__builtin_cpu_supports("sse2")) return decode_sse2;
+#endif
+    return decode_scalar;
+}
+
+} // namespace detail
+
+// Decodes `in` into `out` (replacing its contents). Returns false if an escape
+// is malformed or the decoded bytes are not valid UTF-8.
+inline bool decode(std::string_view in, std::string& out) {
+    static const detail::Kernel kernel = detail::select_kernel();
+    out.resize(in.size()); // decoding never grows the input
+    char* begin = &out[0];
+    char* end = begin;
+    bool ok = in.empty() || kernel(in.data(), in.size(), end);
+    out.resize(ok ? static_cast<size_t>(end - begin) : 0);
+    return ok;
+}
+
+} // namespace urldecode
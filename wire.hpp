@@ -0,0 +1,114 @@
+#pragma once
+
+// Low-level encoding helpers shared by the binary client protocol and the
+// regional <-> central sync protocol: LEB128 varints, zigzag for signed
+// values, length-prefixed byte strings and big-endian frame lengths.
+//
+// Decoders take a std::string_view by reference and advance it past what
+// they consumed; they return false on truncated input instead of throwing.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace wire {
+
+inline void put_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += static_cast<char>((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+inline bool get_varint(std::string_view& in, uint64_t& v) {
+    v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (in.empty()) return false;
+        unsigned char b = static_cast<unsigned char>(in.front());
+        in.remove_prefix(1);
+        v |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+inline void put_svarint(std::string& out, int64_t v) {
+    put_varint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+}
+
+inline bool get_svarint(std::string_view& in, int64_t& v) {
+    uint64_t u;
+    if (!get_varint(in, u)) return false;
+    v = static_cast<int64_t>((u >> 1) ^ (~(u & 1) + 1));
+    return true;
+}
+
+inline void put_u8(std::string& out, uint8_t v) { out += static_cast<char>(v); }
+
+inline bool get_u8(std::string_view& in, uint8_t& v) {
+    if (in.empty()) return false;
+    v = static_cast<uint8_t>(in.front());
+    in.remove_prefix(1);
+    return true;
+}
+
+inline void put_double(std::string& out, double d) {
+    uint64_t bits;
+    std::memcpy(&bits, &d, sizeof(bits));
+    for (int i = 0; i < 8; ++i) out += static_cast<char>(bits >> (8 * i));
+}
+
+inline bool get_double(std::string_view& in, double& d) {
+    if (in.size() < 8) return false;
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; ++i) bits |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    std::memcpy(&d, &bits, sizeof(d));
+    in.remove_prefix(8);
+    return true;
+}
+
+// Varint length followed by the raw bytes.
+inline void put_bytes(std::string& out, std::string_view s) {
+    put_varint(out, s.size());
+    out.append(s.data(), s.size());
+}
+
+// The returned view points into the input buffer; nothing is copied.
+inline bool get_bytes(std::string_view& in, std::string_view& s) {
+    uint64_t n;
+    if (!get_varint(in, n) || n > in.size()) return false;
+    s = in.substr(0, static_cast<size_t>(n));
+    in.remove_prefix(static_cast<size_t>(n));
+    return true;
+}
+
+// Frames start with a 4-byte big-endian payload length.
+constexpr size_t kFrameHeaderSize = 4;
+
+inline void put_frame_length(char* dst, uint32_t n) {
+    dst[0] = static_cast<char>(n >> 24);
+    dst[1] = static_cast<char>(n >> 16);
+    dst[2] = static_cast<char>(n >> 8);
+    dst[3] = static_cast<char>(n);
+}
+
+inline uint32_t get_frame_length(const char* src) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(src);
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+// Starts a frame in `out`: reserves room for the length, which
+// finish_frame() fills in once the payload has been appended.
+inline size_t begin_frame(std::string& out) {
+    size_t start = out.size();
+    out.append(kFrameHeaderSize, '\0');
+    return start;
+}
+
+inline void finish_frame(std::string& out, size_t start) {
+    put_frame_length(&out[start], static_cast<uint32_t>(out.size() - start - kFrameHeaderSize));
+}
+
+} // namespace wire